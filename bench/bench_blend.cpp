@@ -0,0 +1,116 @@
+// blend kernels: megapixels per second of each variant the cpu can run. glyphs are
+// drawn span by span out of a synthetic atlas, the way draw_text_run_clipped does
+// it, rects and fills as the wide spans of draw_rect_clipped
+
+#include <random>
+
+#include "../tests/test.h"
+
+#define W 1600
+#define H 1000
+#define ATLAS 512
+
+typedef struct {
+    const char *name;
+    blend_coverage_span_fn coverage;
+    blend_image_span_fn image;
+    blend_rect_span_fn rect;
+    fill_span_fn fill;
+} Kernels;
+
+typedef struct {
+    int x, y, w, h;
+} Cell;
+
+static std::vector<RenColor> screen(W *H);
+static std::vector<uint8_t> atlas(ATLAS *ATLAS);
+static std::vector<RenColor> image(ATLAS *ATLAS);
+static std::vector<Cell> glyphs;
+
+// glyph sized cells with an antialiased blob each: mostly empty and solid coverage, edges in between
+static void make_atlas() {
+    std::mt19937 rng(5);
+    for (int y = 0; y + 20 <= ATLAS; y += 20) {
+        for (int x = 0; x + 14 <= ATLAS; x += 14) {
+            Cell c = {x, y, 6 + (int)(rng() % 8), 10 + (int)(rng() % 10)};
+            for (int j = 0; j < c.h; j++) {
+                for (int i = 0; i < c.w; i++) {
+                    float dx = (i + 0.5f) / c.w - 0.5f, dy = (j + 0.5f) / c.h - 0.5f;
+                    float v = (0.45f - sqrtf(dx * dx + dy * dy)) * 4 * 255;
+                    atlas[(y + j) * ATLAS + x + i] = (uint8_t)std::clamp(v, 0.0f, 255.0f);
+                }
+            }
+            glyphs.push_back(c);
+        }
+    }
+    for (int i = 0; i < ATLAS * ATLAS; i++) image[i] = RenColor{(uint8_t)i, (uint8_t)(i >> 3), 200, atlas[i]};
+}
+
+// a screen of text, 8 px apart like a monospace font, returns the pixels blended
+static int64_t draw_text(const Kernels &k, bool from_image) {
+    int64_t pixels = 0;
+    RenColor color = {220, 220, 220, 255};
+    size_t gi = 0;
+    for (int y = 0; y + 20 <= H; y += 20) {
+        for (int x = 0; x + 14 <= W; x += 8) {
+            const Cell &c = glyphs[gi++ % glyphs.size()];
+            for (int j = 0; j < c.h; j++) {
+                RenColor *d = &screen[(y + j) * W + x];
+                if (from_image) {
+                    k.image(d, &image[(c.y + j) * ATLAS + c.x], c.w, color);
+                } else {
+                    k.coverage(d, &atlas[(c.y + j) * ATLAS + c.x], c.w, color);
+                }
+            }
+            pixels += c.w * c.h;
+        }
+    }
+    return pixels;
+}
+
+// line highlights, selections and the caret: translucent rects, then a full clear
+static int64_t draw_rects(const Kernels &k, bool fill) {
+    int64_t pixels = 0;
+    for (int y = 0; y < H; y++) {
+        int x = (y * 37) % 200, w = W - 2 * x;
+        if (fill) {
+            k.fill(&screen[y * W], W, RenColor{37, 37, 38, 255});
+            pixels += W;
+        } else {
+            k.rect(&screen[y * W + x], w, RenColor{255, 255, 255, 40});
+            pixels += w;
+        }
+    }
+    return pixels;
+}
+
+static double mpix_per_s(const Kernels &k, int op, double ms_budget) {
+    int64_t pixels = 0;
+    double t0 = test_now_ms(), t1 = t0;
+    while (t1 - t0 < ms_budget) {
+        pixels += op < 2 ? draw_text(k, op == 1) : draw_rects(k, op == 3);
+        t1 = test_now_ms();
+    }
+    return pixels / ((t1 - t0) * 1000);
+}
+
+int main(int argc, char **argv) {
+    double ms = argc > 1 ? atof(argv[1]) : 500;
+    make_atlas();
+    std::vector<Kernels> sets;
+    sets.push_back(Kernels{"scalar", blend_coverage_span_scalar, blend_image_span_scalar, blend_rect_span_scalar, fill_span_scalar});
+#if defined(LT_ARCH_X86)
+    sets.push_back(Kernels{"sse2", blend_coverage_span_sse2, blend_image_span_sse2, blend_rect_span_sse2, fill_span_sse2});
+    if (cpu_has_avx2()) sets.push_back(Kernels{"avx2", blend_coverage_span_avx2, blend_image_span_avx2, blend_rect_span_avx2, fill_span_sse2});
+#elif defined(LT_ARCH_NEON)
+    sets.push_back(Kernels{"neon", blend_coverage_span_neon, blend_image_span_neon, blend_rect_span_neon, fill_span_scalar});
+#endif
+
+    printf("%-8s %12s %12s %12s %12s   (megapixels/s)\n", "", "glyphs", "image", "rect", "fill");
+    for (const Kernels &k : sets) {
+        printf("%-8s", k.name);
+        for (int op = 0; op < 4; op++) printf(" %12.1f", mpix_per_s(k, op, ms));
+        printf("\n");
+    }
+    return 0;
+}
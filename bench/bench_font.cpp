@@ -0,0 +1,76 @@
+// fonts: what a zoom step costs, the way plugins/scale.lua does it: load the new
+// sizes, free the old ones, draw the first frame with them
+
+#include <thread>
+
+#include "../tests/test.h"
+
+#define W 1600
+#define H 1000
+
+static const char *lines[] = {
+    "local function scale(doc, amount) -- comment",
+    "  for i, line in ipairs(self.doc.lines) do",
+    "    return string.format(\"%d:%d\", x, y) end",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 {}[]()<>",
+    "\xc3\xa0\xc3\xa9\xc3\xae\xc3\xb5\xc3\xbc \xc3\x85ngstr\xc3\xb6m na\xc3\xafve caf\xc3\xa9",
+};
+
+static void wait_prewarm() {
+    std::unique_lock<std::mutex> lock(prewarm_worker.mutex);
+    prewarm_worker.idle.wait(lock, [] { return !prewarm_worker.running && prewarm_worker.queue.empty(); });
+}
+
+static void draw_screen(RenFont *code, RenFont *ui) {
+    int lh = ren_get_font_height(code);
+    for (int y = 0, i = 0; y < H; y += lh, i++) ren_draw_text(code, lines[i % 5], 200, y, RenColor{220, 220, 220, 255});
+    for (int y = 0; y < H; y += ren_get_font_height(ui)) ren_draw_text(ui, "file_name.lua", 10, y, RenColor{200, 200, 200, 255});
+}
+
+// zooms from one size through the next ones, adds up the ms of loading a step, of its first
+// frame and of the frame after, which has every glyph in the atlas already
+static void zoom(float from, const float *sizes, int count, bool settle, double *load_ms, double *frame_ms, double *next_ms) {
+    RenFont *code = ren_load_font(TEST_MONO_FONT, from), *ui = ren_load_font(TEST_FONT, from);
+    for (int i = 0; i < count; i++) {
+        double t0 = test_now_ms();
+        RenFont *next_code = ren_load_font(TEST_MONO_FONT, sizes[i]), *next_ui = ren_load_font(TEST_FONT, sizes[i]);
+        ren_free_font(code);
+        ren_free_font(ui);
+        code = next_code, ui = next_ui;
+        double t1 = test_now_ms();
+        if (settle) wait_prewarm();  // the prewarm had the frames before the first draw to itself
+        double t2 = test_now_ms();
+        draw_screen(code, ui);
+        double t3 = test_now_ms();
+        draw_screen(code, ui);
+        double t4 = test_now_ms();
+        *load_ms += t1 - t0, *frame_ms += t3 - t2, *next_ms += t4 - t3;
+    }
+    ren_free_font(code);
+    ren_free_font(ui);
+}
+
+int main() {
+    lt_context *ctx = test_context(W, H);
+    const char *names[] = {"new sizes, drawn at once", "new sizes, prewarmed", "cached sizes"};
+    double load[3] = {0}, frame[3] = {0}, next[3] = {0};
+    int rounds = 5;
+    // three zoom steps in, then back out through the sizes the cache kept. sizes
+    // are a little off each round so that every round starts with new ones
+    for (int r = 0; r < rounds; r++) {
+        float base = 14 + r * 0.1f;
+        float in[3] = {base + 1, base + 2, base + 3}, out[3] = {base + 2, base + 1, base};
+        bool settle = r % 2;
+        wait_prewarm();
+        zoom(base, in, 3, settle, &load[settle], &frame[settle], &next[settle]);
+        zoom(base + 3, out, 3, false, &load[2], &frame[2], &next[2]);
+    }
+    for (int i = 0; i < 3; i++) {
+        int steps = i == 2 ? rounds * 3 : (i == 0 ? (rounds + 1) / 2 : rounds / 2) * 3;
+        printf("%-26s load %6.3f ms  first frame %7.3f ms  next frame %7.3f ms\n", names[i], load[i] / steps, frame[i] / steps, next[i] / steps);
+    }
+
+    glyph_prewarm_stop();
+    test_free_context(ctx);
+    return 0;
+}
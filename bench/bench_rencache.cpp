@@ -0,0 +1,104 @@
+// rencache: time per frame of a text heavy editor frame, and its dirty rect replay
+// with commands binned per cell against walking every command for each rect
+
+#include <random>
+
+#include "../tests/test.h"
+
+#define W 1600
+#define H 1000
+
+static const char *tokens[] = {"local", " ", "function", "(", "self", ", ", "x", ")", " = ", "table.insert", "\"string\"", "-- comment", "12345", "end", "return", "if", " then"};
+
+static RenFont *code_font, *ui_font;
+
+// a docview, a gutter, a tree view and a status bar. lines listed in changed get one token replaced
+static void draw_frame(std::mt19937 &rng, const std::vector<int> &changed, bool caret) {
+    int lh = ren_get_font_height(code_font) + 2;
+    rencache_begin_frame();
+    rencache_set_clip_rect(RenRect{0, 0, W, H});
+    rencache_draw_rect(RenRect{0, 0, W, H}, RenColor{37, 37, 38, 255});
+    rencache_draw_rect(RenRect{0, 0, 250, H}, RenColor{30, 30, 30, 255});
+    for (int i = 0; i < H / 20; i++) rencache_draw_text(ui_font, "some_file_name.lua", 20, i * 20, RenColor{200, 200, 200, 255});
+
+    rencache_set_clip_rect(RenRect{250, 0, W - 250, H - 24});
+    for (int line = 0; line < (H - 24) / lh; line++) {
+        int y = line * lh;
+        if (line == 10) rencache_draw_rect(RenRect{250, y, W - 250, lh}, RenColor{50, 50, 50, 255});
+        char num[16];
+        snprintf(num, sizeof(num), "%d", line + 1);
+        rencache_draw_text(code_font, num, 260, y, RenColor{120, 120, 120, 255});
+        int x = 320;
+        int edit = std::find(changed.begin(), changed.end(), line) != changed.end() ? (line * 5) % 12 : -1;
+        for (int t = 0; t < 12; t++) {
+            const char *tok = tokens[(line * 7 + t * 3 + (t == edit ? rng() : 0)) % (sizeof(tokens) / sizeof(*tokens))];
+            x = rencache_draw_text(code_font, tok, x, y, RenColor{(uint8_t)(100 + t * 12), 180, 220, 255});
+        }
+        if (line == 10 && caret) rencache_draw_rect(RenRect{320 + 40, y, 2, lh}, RenColor{255, 255, 255, 255});
+    }
+
+    rencache_set_clip_rect(RenRect{0, 0, W, H});
+    rencache_draw_rect(RenRect{0, H - 24, W, 24}, RenColor{0, 122, 204, 255});
+    rencache_draw_text(ui_font, "lite.cpp  ln 120, col 41", 10, H - 20, RenColor{255, 255, 255, 255});
+    rencache_end_frame();
+}
+
+// what end_frame did before binning: every command clipped against every dirty rect
+static void replay_unbinned() {
+    for (const RenRect &r : rcache->rect_buf) {
+        for (const BinCommand &bc : rcache->bins.cmds) {
+            RenClip clip = clip_from_rect(intersect_rects(bc.clip, r));
+            if (bc.cmd->type == DRAW_RECT) {
+                draw_rect_clipped(&clip, bc.cmd->rect, bc.cmd->color);
+            } else {
+                draw_text_run_clipped(&clip, bc.cmd->run, bc.cmd->rect.x, bc.cmd->rect.y, bc.cmd->color);
+            }
+        }
+    }
+}
+
+static void replay_binned() {
+    for (int i = 0; i < (int)rcache->rect_buf.size(); i++) replay_rect(i, rcache->rect_buf[i]);
+}
+
+static void run(const char *name, int frames, int edits, bool full) {
+    std::mt19937 rng(1);
+    double frame_ms = 0, binned_ms = 0, unbinned_ms = 0;
+    size_t rects = 0, commands = 0;
+    for (int f = 0; f < frames; f++) {
+        std::vector<int> changed;
+        for (int e = 0; e < edits; e++) changed.push_back(rng() % 50);
+        if (full) rencache_invalidate();
+        double t0 = test_now_ms();
+        draw_frame(rng, changed, f & 1);
+        double t1 = test_now_ms();
+        // the bins and dirty rects of the frame are still intact after end_frame
+        replay_binned();
+        double t2 = test_now_ms();
+        replay_unbinned();
+        double t3 = test_now_ms();
+        frame_ms += t1 - t0, binned_ms += t2 - t1, unbinned_ms += t3 - t2;
+        rects += rcache->rect_buf.size();
+        commands += rcache->bins.cmds.size();
+    }
+    printf("%-16s %6.2f ms/frame  %5.1f rects %6.0f commands  replay binned %6.2f ms  unbinned %7.2f ms\n", name, frame_ms / frames, (double)rects / frames, (double)commands / frames, binned_ms / frames,
+           unbinned_ms / frames);
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 200;
+    lt_context *ctx = test_context(W, H);
+    code_font = ren_load_font(TEST_MONO_FONT, 14);
+    ui_font = ren_load_font(TEST_FONT, 14);
+    CHECK(code_font && ui_font);
+
+    run("full redraw", frames, 0, true);
+    run("caret blink", frames, 0, false);
+    run("8 lines edited", frames, 8, false);
+    run("30 lines edited", frames, 30, false);
+
+    ren_free_font(code_font);
+    ren_free_font(ui_font);
+    test_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,101 @@
+// project search: the lua loop projectsearch.lua used to run against filesearch,
+// on a generated tree of source-like files
+
+#include <filesystem>
+#include <random>
+
+#include "../tests/test.h"
+
+static const char *words[] = {"local", "function", "return", "end", "if", "then", "else", "for", "in", "pairs", "self", "abc", "value", "=", "(", ")", "{", "}", ",", "--", "table.insert", "string.format", "nil", "true"};
+
+// count files of about size bytes, one in every few lines ends up matching each query
+static void generate_tree(const std::string &dir, int count, int size) {
+    std::mt19937 rng(7);
+    std::filesystem::create_directories(dir);
+    for (int i = 0; i < count; i++) {
+        std::string sub = dir + "/" + std::to_string(i % 20);
+        std::filesystem::create_directories(sub);
+        FILE *fp = fopen((sub + "/f" + std::to_string(i) + ".lua").c_str(), "wb");
+        CHECK(fp);
+        for (int n = 0; n < size;) {
+            std::string line(rng() % 8, ' ');
+            for (int w = 0, words_in_line = 3 + rng() % 10; w < words_in_line; w++) {
+                line += words[rng() % (sizeof(words) / sizeof(*words))];
+                line += ' ';
+            }
+            if (rng() % 40 == 0) line += "Return ABC";
+            line += '\n';
+            fwrite(line.data(), 1, line.size(), fp);
+            n += (int)line.size();
+        }
+        fclose(fp);
+    }
+}
+
+static const char *bench_lua = R"(
+local dir = ...
+local files = {}
+for i = 0, FILE_COUNT - 1 do files[#files + 1] = string.format("%s/%d/f%d.lua", dir, i % 20, i) end
+
+-- the loop projectsearch.lua ran before filesearch, minus the coroutine yields
+local function lua_search(fn)
+  local results = {}
+  for _, filename in ipairs(files) do
+    local fp = io.open(filename)
+    local n = 1
+    for line in fp:lines() do
+      local s = fn(line)
+      if s then
+        local start_index = math.max(s - 80, 1)
+        table.insert(results, { file = filename, text = (start_index > 1 and "..." or "") .. line:sub(start_index, 256 + start_index), line = n, col = s })
+      end
+      n = n + 1
+    end
+    fp:close()
+  end
+  return #results
+end
+
+local function native_search(text, pattern, nocase)
+  local search, results = filesearch.start(files, text, pattern, nocase), {}
+  repeat
+    local n, finished, err = search:poll(results)
+    assert(not err, err)
+  until finished
+  return #results
+end
+
+local queries = {
+  { "plain", "return abc", function(l) return l:find("return abc", nil, true) end },
+  { "case-insensitive", "return abc", function(l) return l:lower():find("return abc", nil, true) end, false, true },
+  { "pattern", "^%s*if%s.-%sthen%s", function(l) return l:find("^%s*if%s.-%sthen%s") end, true },
+}
+for _, q in ipairs(queries) do
+  local t0 = system.get_time()
+  local lua_hits = lua_search(q[3])
+  local t1 = system.get_time()
+  local native_hits = native_search(q[2], q[4], q[5])
+  local t2 = system.get_time()
+  assert(lua_hits == native_hits, q[1] .. ": " .. lua_hits .. " hits in lua, " .. native_hits .. " native")
+  print(string.format("%-18s %6d hits  lua %8.1f ms  filesearch %7.1f ms", q[1], lua_hits, (t1 - t0) * 1000, (t2 - t1) * 1000))
+end
+)";
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1500;
+    std::string dir = (std::filesystem::temp_directory_path() / "lite_bench_search").string();
+    std::filesystem::remove_all(dir);
+    generate_tree(dir, count, 12 * 1024);
+    printf("%d files of 12 KB in %s\n", count, dir.c_str());
+
+    lua_State *L = test_lua();
+    lua_pushinteger(L, count);
+    lua_setglobal(L, "FILE_COUNT");
+    if (luaL_loadstring(L, bench_lua) != LUA_OK || (lua_pushstring(L, dir.c_str()), lua_pcall(L, 1, 0, 0)) != LUA_OK) {
+        fprintf(stderr, "lua: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_close(L);
+    std::filesystem::remove_all(dir);
+    return 0;
+}
@@ -4,8 +4,13 @@
 //               https://github.com/r-lyeh/FWK (public domain)
 // modified by KaoruXun(cstom4994) for NekoEngine
 
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "../lite.h"
 
@@ -14,6 +19,7 @@
 #include <imgui_impl_opengl3.h>
 #include <imgui_internal.h>
 
+#include <algorithm>
 #include <iostream>
 
 #if defined(_MSC_VER) && (_MSC_VER >= 1900) && !defined(IMGUI_DISABLE_WIN32_FUNCTIONS)
@@ -33,6 +39,18 @@ double window_scale() {
     return NEKO_MAX(xscale, yscale);
 }
 
+// cpu time of the whole process, for the idle cpu readout
+double process_cpu_seconds() {
+#ifdef _WIN32
+    FILETIME create, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user);
+    auto secs = [](FILETIME t) { return (double)(((unsigned long long)t.dwHighDateTime << 32) | t.dwLowDateTime) * 1e-7; };
+    return secs(kernel) + secs(user);
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
 ImVec2 get_mouse_in_window() {
     double x, y;
     glfwGetCursorPos(glfw_window, &x, &y);
@@ -76,14 +94,31 @@ int main(int, char**) {
     // const_str str = "table.insert(package.searchers, 2, __neko_loader) \n";
     // luaL_dostring(g_app->lite_L, str);
 
-    lt_init(L, glfw_window, "./lite", __argc, __argv, window_scale(), "Windows");
+    // lua 和渲染在自己的线程上跑 慢帧不拖累 imgui
+    lt_context* lite = lt_init(L, glfw_window, "./lite", __argc, __argv, window_scale(), "Windows", LT_INIT_THREADED_TICK);
+
+    double lite_wait = 0;
+    double cpu_mark = process_cpu_seconds(), wall_mark = glfwGetTime(), cpu_percent = 0;
 
     // Main loop
     while (!glfwWindowShouldClose(glfw_window)) {
 
-        glfwPollEvents();
+        // 编辑器空闲时睡到它下一次有事做 输入和渲染线程会提前唤醒
+        if (lite_wait > 0) {
+            glfwWaitEventsTimeout(std::min(lite_wait, 1.0));
+        } else {
+            glfwPollEvents();
+        }
+
+        lite_wait = lt_tick(lite);
 
-        lt_tick(L);
+        // 每秒统计一次整个进程的 cpu 占用
+        double wall = glfwGetTime();
+        if (wall - wall_mark >= 1.0) {
+            double cpu = process_cpu_seconds();
+            cpu_percent = 100.0 * (cpu - cpu_mark) / (wall - wall_mark);
+            cpu_mark = cpu, wall_mark = wall;
+        }
 
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
@@ -97,16 +132,23 @@ int main(int, char**) {
             assert(window);
             ImVec2 pos = window->Pos;
             ImVec2 size = window->Size;
-            lt_mx = mouse_pos.x - pos.x;
-            lt_my = mouse_pos.y - pos.y;
-            lt_wx = pos.x;
-            lt_wy = pos.y;
-            lt_ww = size.x;
-            lt_wh = size.y;
-            if (lt_resizesurface(lt_getsurface(0), lt_ww, lt_wh)) {
+            lt_setmouse(lite, mouse_pos.x - pos.x, mouse_pos.y - pos.y);
+            lt_setwindowrect(lite, pos.x, pos.y, size.x, size.y);
+            if (ImGui::IsWindowFocused()) lt_setfocus(lite);  // 多个编辑器时输入给当前窗口
+            lt_surface* surf = lt_getsurface(lite);
+            if (lt_resizesurface(surf, size.x, size.y)) {
                 // window_refresh_callback(g_app->game_window);
             }
-            ImGui::Image((ImTextureID)lt_getsurface(0)->t.id, bounds);
+            ImGui::Image((ImTextureID)surf->t.id, bounds);
+        }
+        ImGui::End();
+
+        if (ImGui::Begin("Stats")) {
+            ImGui::Text("cpu %.1f%%", cpu_percent);
+            ImGui::Text("lite idle for %.2fs", lite_wait);
+            lt_tick_stats ts;
+            lt_gettickstats(lite, &ts);
+            ImGui::Text("tick %.2fms: poll %.2f update %.2f draw %.2f threads %.2f", ts.total_ms, ts.poll_ms, ts.update_ms, ts.draw_ms, ts.threads_ms);
         }
         ImGui::End();
 
@@ -122,7 +164,7 @@ int main(int, char**) {
     }
 
     // Cleanup
-    lt_fini();
+    lt_fini(lite);
     lua_close(L);
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -8,12 +8,21 @@
 
 #include <direct.h>
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
+#include <csetjmp>
 #include <cstdint>
 #include <filesystem>
-#include <fstream>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #if (defined NEKO_IS_WIN32)
 #include <Windows.h>
@@ -27,9 +36,82 @@
 
 // ----------------------------------------------------------------------------
 
-extern GLFWwindow *glfw_window;
+typedef struct {
+    GLuint fbo, tex;
+    int width, height;
+} lt_scroll_scratch;
+
+// LT_INIT_THREADED_TICK: glfw 的窗口和剪贴板函数只能在主线程调用 渲染线程经由这里请求 由 lt_tick 处理
+typedef struct {
+    std::mutex mutex;
+    std::condition_variable done;
+    unsigned asked, answered;  // 剪贴板读取 请求和已完成的序号
+    bool has_clipboard;
+    std::string clipboard;
+    bool set_clipboard;
+    std::string new_clipboard;
+    bool focus;
+    bool quit;
+    std::atomic<bool> window_focused;  // lt_tick 每帧刷新
+} lt_mailbox;
+
+// LT_INIT_THREADED_TICK: 渲染线程画到 back 每帧把变化的像素发布到 surface 由 lt_tick 上传
+typedef struct {
+    std::thread thread;
+    std::mutex mutex;  // 保护 surface 的 w/h/pixels/scrolls 和下面的字段
+    std::condition_variable wake;
+    bool quit;
+    std::vector<lt_rect> rects;  // 已发布 还没上传到纹理
+    int want_w, want_h;          // 宿主请求的尺寸
+    std::atomic<bool> sleeping;  // 渲染线程在等下一次唤醒
+} lt_handoff;
+
+// 一个编辑器实例 渲染器和 rencache 的状态经由 lt_makecurrent 切换到调用线程
+struct lt_context {
+    lua_State *L;
+    GLFWwindow *window;
+    unsigned flags;
+    lt_surface surface;  // 宿主显示的纹理
+    lt_surface back;     // 线程模式下渲染线程的画布
+    lt_surface *target;  // 渲染器画到这里
+    lt_scroll_scratch scroll_scratch;
+    lt_handoff handoff;
+    lt_mailbox mailbox;
+
+    event_queue input;                    // glfw 回调无锁写入
+    std::mutex input_mutex;               // 保护下面的鼠标/窗口状态和 events
+    std::vector<INPUT_WRAP_event> events;  // 已从 input 取出 合并过的事件
+    size_t next_event;
+    int mx, my, wx, wy, ww, wh;
+    int prev_mx, prev_my;
+    unsigned clicks, clicks_time;
+
+    std::atomic<bool> poke;         // lua 之外有变化 下一次 tick 不能跳过
+    std::atomic<double> wake_at;    // core.run1() 想再运行的时间 秒 同 system.get_time()
+    int tick_ref;                   // 编译好的 tick 入口 在 registry 里
+    lt_tick_stats tick;             // 正在进行的 tick
+    lt_tick_stats tick_stats;       // 上一次完成的 tick 由 handoff.mutex 保护
+    std::chrono::steady_clock::time_point draw_start;
+    struct RenState *ren;
+    struct RenCache *rencache;
+};
+
+static thread_local lt_context *lt_current;
+static std::atomic<lt_context *> lt_focused;  // 接收 glfw 输入的上下文
+
+static lt_context *lt_makecurrent(lt_context *ctx);
 
-int lt_mx = 0, lt_my = 0, lt_wx = 0, lt_wy = 0, lt_ww = 0, lt_wh = 0;
+static double ms_since(std::chrono::steady_clock::time_point start) { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); }
+
+// input, resize or focus changed: the next tick runs even if lua has nothing due
+static void lt_poke(lt_context *ctx) {
+    ctx->poke = true;
+    lt_handoff *h = &ctx->handoff;
+    if (h->sleeping.exchange(false)) {
+        std::lock_guard<std::mutex> lock(h->mutex);
+        h->wake.notify_all();
+    }
+}
 
 int neko_os_chdir(const char *path) {
 #if (defined NEKO_IS_WIN32)
@@ -94,16 +176,50 @@ std::string os_program_dir() {
     return dir;
 }
 
-const char *window_clipboard() { return glfwGetClipboardString(glfw_window); }
+#define lt_threaded(ctx) ((ctx)->flags & LT_INIT_THREADED_TICK)
+
+const char *window_clipboard() {
+    if (!lt_threaded(lt_current)) return glfwGetClipboardString(lt_window());
+    // 等主线程下一次 lt_tick 读出来
+    lt_mailbox *m = &lt_current->mailbox;
+    std::unique_lock<std::mutex> lock(m->mutex);
+    unsigned ticket = ++m->asked;
+    glfwPostEmptyEvent();
+    m->done.wait(lock, [&] { return m->answered == ticket || m->quit; });
+    return m->answered == ticket && m->has_clipboard ? m->clipboard.c_str() : NULL;
+}
 
-void window_setclipboard(const char *text) { glfwSetClipboardString(glfw_window, text); }
+void window_setclipboard(const char *text) {
+    if (!lt_threaded(lt_current)) {
+        glfwSetClipboardString(lt_window(), text);
+        return;
+    }
+    lt_mailbox *m = &lt_current->mailbox;
+    std::lock_guard<std::mutex> lock(m->mutex);
+    m->new_clipboard = text;
+    m->set_clipboard = true;
+    glfwPostEmptyEvent();
+}
 
-void window_focus() { glfwFocusWindow(glfw_window); }
+void window_focus() {
+    if (!lt_threaded(lt_current)) {
+        glfwFocusWindow(lt_window());
+        return;
+    }
+    lt_mailbox *m = &lt_current->mailbox;
+    std::lock_guard<std::mutex> lock(m->mutex);
+    m->focus = true;
+    glfwPostEmptyEvent();
+}
 
-int window_has_focus() { return !!glfwGetWindowAttrib(glfw_window, GLFW_FOCUSED); }
+// 同一窗口里的多个编辑器只有获得输入的那个算有焦点
+int window_has_focus() {
+    if (lt_focused != lt_current) return 0;
+    return lt_threaded(lt_current) ? lt_current->mailbox.window_focused.load() : glfwGetWindowAttrib(lt_window(), GLFW_FOCUSED);
+}
 
 char *tmp_fmt(const char *fmt, ...) {
-    static char s_buf[1024] = {};
+    static thread_local char s_buf[1024] = {};
 
     va_list args;
     va_start(args, fmt);
@@ -132,35 +248,203 @@ void destroy_texture(LT_Texture *tex) {
     glDeleteTextures(1, &id);
 }
 
+// (重新)分配纹理存储 只在创建和尺寸变化时调用
 bool texture_update_data(LT_Texture *tex, uint8_t *data) {
 
     // LockGuard lock{&g_app->gpu_mtx};
 
-    // 如果存在 则释放旧的 GL 纹理
-    if (tex->id != 0) glDeleteTextures(1, &tex->id);
-
-    // 生成 GL 纹理
-    glGenTextures(1, &tex->id);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tex->id);
+    // 生成 GL 纹理 已存在则复用
+    if (tex->id == 0) {
+        glGenTextures(1, &tex->id);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, tex->id);
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    } else {
+        glBindTexture(GL_TEXTURE_2D, tex->id);
+    }
 
     // 将纹理数据复制到 GL
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, tex->width, tex->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, tex->width, tex->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
     glBindTexture(GL_TEXTURE_2D, 0);
 
     return true;
 }
 
-lt_surface *lt_getsurface(void *window) {
-    static lt_surface s = {0};
-    return &s;
+// 只上传脏矩形 rects 直接从 stride 像素宽的源图像中读取
+size_t texture_update_rects(LT_Texture *tex, const uint8_t *data, int stride, const lt_rect *rects, unsigned count) {
+    size_t bytes = 0;
+
+    glBindTexture(GL_TEXTURE_2D, tex->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+    for (unsigned i = 0; i < count; i++) {
+        const lt_rect *r = &rects[i];
+        if (r->width <= 0 || r->height <= 0) continue;
+        const uint8_t *p = data + ((size_t)r->y * stride + r->x) * 4;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r->x, r->y, r->width, r->height, GL_RGBA, GL_UNSIGNED_BYTE, p);
+        bytes += (size_t)r->width * r->height * 4;
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return bytes;
+}
+
+// 纹理内的滚动 源和目标区域重叠 所以经由一张临时纹理在 GPU 上拷贝两次
+static bool texture_scroll_rect(lt_scroll_scratch *scratch, LT_Texture *tex, lt_rect r, int dy) {
+    if (!(GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object)) return false;
+    int h = r.height - abs(dy);
+    if (h <= 0 || dy == 0) return true;  // 没有保留下来的行
+    int src_y = dy > 0 ? r.y : r.y - dy;
+
+    if (!scratch->fbo) glGenFramebuffers(1, &scratch->fbo);
+    if (scratch->width < r.width || scratch->height < h) {
+        if (!scratch->tex) glGenTextures(1, &scratch->tex);
+        scratch->width = NEKO_MAX(scratch->width, r.width);
+        scratch->height = NEKO_MAX(scratch->height, h);
+        glBindTexture(GL_TEXTURE_2D, scratch->tex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, scratch->width, scratch->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    GLint prev_fbo = 0;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &prev_fbo);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, scratch->fbo);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex->id, 0);
+    bool ok = glCheckFramebufferStatus(GL_READ_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    if (ok) {
+        glBindTexture(GL_TEXTURE_2D, scratch->tex);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, r.x, src_y, r.width, h);
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, scratch->tex, 0);
+        glBindTexture(GL_TEXTURE_2D, tex->id);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, r.x, src_y + dy, 0, 0, r.width, h);
+    }
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, prev_fbo);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return ok;
+}
+
+static void scroll_scratch_destroy(lt_scroll_scratch *scratch) {
+    if (scratch->fbo) glDeleteFramebuffers(1, &scratch->fbo);
+    if (scratch->tex) glDeleteTextures(1, &scratch->tex);
+    *scratch = {};
+}
+
+// 持久映射的 PBO 环 CPU 写入空闲的缓冲区 GPU 异步从中拷贝到纹理
+#define LT_PBO_COUNT 3
+
+struct lt_pbo_ring {
+    GLuint buf[LT_PBO_COUNT];
+    GLsync fence[LT_PBO_COUNT];
+    uint8_t *mapped[LT_PBO_COUNT];
+    size_t size;
+    int next;
+};
+
+static bool pbo_supported() { return (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) && (GLEW_VERSION_3_2 || GLEW_ARB_sync); }
+
+void pbo_ring_destroy(lt_pbo_ring *ring) {
+    if (!ring) return;
+    for (int i = 0; i < LT_PBO_COUNT; i++) {
+        if (ring->fence[i]) glDeleteSync(ring->fence[i]);
+        if (ring->buf[i]) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buf[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(LT_PBO_COUNT, ring->buf);
+    lt_free(ring);
+}
+
+lt_pbo_ring *pbo_ring_create(size_t size) {
+    if (size == 0 || !pbo_supported()) return NULL;
+
+    lt_pbo_ring *ring = (lt_pbo_ring *)lt_calloc(1, sizeof(lt_pbo_ring));
+    ring->size = size;
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(LT_PBO_COUNT, ring->buf);
+    for (int i = 0; i < LT_PBO_COUNT; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buf[i]);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+        ring->mapped[i] = (uint8_t *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+        if (!ring->mapped[i]) {
+            fprintf(stderr, "Warning: (" __FILE__ "): failed to map pixel buffer, using synchronous uploads\n");
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            pbo_ring_destroy(ring);
+            return NULL;
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return ring;
+}
+
+// 返回 0 表示没有空闲缓冲区或数据放不下 由调用者回退到同步上传
+size_t pbo_ring_update_rects(lt_pbo_ring *ring, LT_Texture *tex, const uint8_t *data, int stride, const lt_rect *rects, unsigned count) {
+    size_t total = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (rects[i].width > 0 && rects[i].height > 0) total += (size_t)rects[i].width * rects[i].height * 4;
+    }
+    if (total == 0 || total > ring->size) return 0;
+
+    // 找一个 GPU 已经用完的缓冲区 从不等待
+    int slot = -1;
+    for (int k = 0; k < LT_PBO_COUNT; k++) {
+        int i = (ring->next + k) % LT_PBO_COUNT;
+        if (ring->fence[i]) {
+            GLenum res = glClientWaitSync(ring->fence[i], 0, 0);
+            if (res != GL_ALREADY_SIGNALED && res != GL_CONDITION_SATISFIED) continue;
+            glDeleteSync(ring->fence[i]);
+            ring->fence[i] = 0;
+        }
+        slot = i;
+        break;
+    }
+    if (slot < 0) return 0;
+
+    // 紧密打包各个矩形到映射内存
+    uint8_t *dst = ring->mapped[slot];
+    for (unsigned i = 0; i < count; i++) {
+        const lt_rect *r = &rects[i];
+        if (r->width <= 0 || r->height <= 0) continue;
+        size_t row = (size_t)r->width * 4;
+        const uint8_t *src = data + ((size_t)r->y * stride + r->x) * 4;
+        for (int y = 0; y < r->height; y++) {
+            lt_memcpy(dst, src, row);
+            dst += row;
+            src += (size_t)stride * 4;
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buf[slot]);
+    glBindTexture(GL_TEXTURE_2D, tex->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    size_t offset = 0;
+    for (unsigned i = 0; i < count; i++) {
+        const lt_rect *r = &rects[i];
+        if (r->width <= 0 || r->height <= 0) continue;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r->x, r->y, r->width, r->height, GL_RGBA, GL_UNSIGNED_BYTE, (const void *)offset);
+        offset += (size_t)r->width * r->height * 4;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    ring->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring->next = (slot + 1) % LT_PBO_COUNT;
+    return total;
 }
 
+lt_surface *lt_getsurface(lt_context *ctx) { return &ctx->surface; }
+
 void lt_updatesurfacerects(lt_surface *s, lt_rect *rects, unsigned count) {
     if (0)
         for (int i = 0; i < count; ++i) {
@@ -173,66 +457,298 @@ void lt_updatesurfacerects(lt_surface *s, lt_rect *rects, unsigned count) {
 
     // update contents
     // texture_update(&s->t, s->w, s->h, 4, s->pixels, TEXTURE_LINEAR | TEXTURE_BGRA); // TODO
+    s->upload_bytes = 0;
+    if (s->t.id == 0) {
+        s->scroll_count = 0;
+        return;
+    }
+
+    // 先在纹理里重放滚动 脏矩形再覆盖其上 无法在 GPU 上拷贝时上传整个区域
+    for (int i = 0; i < s->scroll_count; i++) {
+        if (!texture_scroll_rect(&s->ctx->scroll_scratch, &s->t, s->scrolls[i].rect, s->scrolls[i].dy)) {
+            s->upload_bytes += texture_update_rects(&s->t, (const uint8_t *)s->pixels, s->w, &s->scrolls[i].rect, 1);
+        }
+    }
+    s->scroll_count = 0;
+
+    if (count == 0) return;
+    if (s->pbo) {
+        size_t bytes = pbo_ring_update_rects(s->pbo, &s->t, (const uint8_t *)s->pixels, s->w, rects, count);
+        if (bytes) {
+            s->upload_bytes += bytes;
+            return;
+        }
+    }
+    s->upload_bytes += texture_update_rects(&s->t, (const uint8_t *)s->pixels, s->w, rects, count);
+}
+
+// 将 rect 内的像素行移动 dy 纹理中的对应拷贝推迟到下一次 lt_updatesurfacerects
+bool lt_scrollsurface(lt_surface *s, lt_rect rect, int dy) {
+    if (s->scroll_count == LT_SURFACE_MAX_SCROLLS) return false;
+    int h = rect.height - abs(dy);
+    if (h > 0 && dy != 0) {
+        unsigned *px = (unsigned *)s->pixels;
+        size_t n = rect.width * sizeof(unsigned);
+        if (dy < 0) {
+            for (int y = rect.y; y < rect.y + h; y++) memcpy(px + (size_t)y * s->w + rect.x, px + (size_t)(y - dy) * s->w + rect.x, n);
+        } else {
+            for (int y = rect.y + rect.height - 1; y >= rect.y + dy; y--) memcpy(px + (size_t)y * s->w + rect.x, px + (size_t)(y - dy) * s->w + rect.x, n);
+        }
+    }
+    s->scrolls[s->scroll_count].rect = rect;
+    s->scrolls[s->scroll_count].dy = dy;
+    s->scroll_count++;
+    return true;
+}
+
+void ren_set_clip_rect(struct lt_rect rect);
+void rencache_invalidate(void);
+// (重新)分配纹理和 PBO 并上传 s 的全部像素
+static void surface_alloc_texture(lt_surface *s) {
+    // texture storage is allocated once per resize, frames only upload dirty rects
+    // if (!s->t.id) s->t = texture_create(1, 1, 4, "    ", TEXTURE_LINEAR | TEXTURE_RGBA | TEXTURE_BYTE);
     s->t.width = s->w;
     s->t.height = s->h;
     texture_update_data(&s->t, (uint8_t *)s->pixels);
+    s->upload_bytes = (size_t)s->w * s->h * 4;
+    s->scroll_count = 0;
+
+    // the ring buffers are sized for a full-surface update
+    pbo_ring_destroy(s->pbo);
+    s->pbo = (s->ctx->flags & LT_INIT_PBO_UPLOAD) ? pbo_ring_create((size_t)s->w * s->h * 4) : NULL;
 }
 
-void ren_set_clip_rect(struct lt_rect rect);
-void rencache_invalidate(void);
-int lt_resizesurface(lt_surface *s, int ww, int wh) {
+// texture 为 false 时 s 只是渲染线程的画布 没有纹理
+static int surface_resize(lt_surface *s, int ww, int wh, bool texture) {
+    int pw = texture ? s->t.width : s->w, ph = texture ? s->t.height : s->h;
     s->w = ww, s->h = wh;
     // TODO
     if (s->w * s->h <= 0) {
         s->w = 0;
         s->h = 0;
     }
-    if (s->t.id == 0 || s->w != s->t.width || s->h != s->t.height) {
-        // invalidate tiles
+    if ((texture && s->t.id == 0) || s->w != pw || s->h != ph) {
+        // invalidate tiles, the host may resize outside of lt_tick
+        lt_context *prev = lt_makecurrent(s->ctx);
         ren_set_clip_rect(lt_rect{0, 0, s->w, s->h});
         rencache_invalidate();
+        lt_makecurrent(prev);
 
-        // texture clear
-        // if (!s->t.id) s->t = texture_create(1, 1, 4, "    ", TEXTURE_LINEAR | TEXTURE_RGBA | TEXTURE_BYTE);
-        if (!s->t.id) {
-            LT_Texture t = {.width = 1, .height = 1};
-            bool ok = texture_update_data(&t, (uint8_t *)"    ");
-            s->t = t;
-        }
         s->pixels = lt_realloc(s->pixels, s->w * s->h * 4);
         memset(s->pixels, 0, s->w * s->h * 4);
+        s->scroll_count = 0;
 
-        // texture update
-        lt_updatesurfacerects(s, 0, 0);
+        if (texture) surface_alloc_texture(s);
         return 1;  // resized
     }
     return 0;  // unchanged
 }
 
-void *lt_load_file(const char *filename, int *ret_size) {
-    std::ifstream file(filename, std::ios::in | std::ios::binary);
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file");
+int lt_resizesurface(lt_surface *s, int ww, int wh) {
+    lt_context *ctx = s->ctx;
+    int changed;
+    if (!lt_threaded(ctx)) {
+        changed = surface_resize(s, ww, wh, true);
+    } else {
+        // 只记下尺寸 渲染线程在下一帧开始时调整画布 发布时 lt_tick 再调整纹理
+        if (ww * wh <= 0) ww = wh = 0;
+        std::lock_guard<std::mutex> lock(ctx->handoff.mutex);
+        changed = ww != ctx->handoff.want_w || wh != ctx->handoff.want_h;
+        ctx->handoff.want_w = ww, ctx->handoff.want_h = wh;
+    }
+    if (changed) lt_poke(ctx);
+    return changed;
+}
+
+static void copy_surface_rect(lt_surface *dst, const lt_surface *src, lt_rect r) {
+    for (int y = r.y; y < r.y + r.height; y++) {
+        memcpy((unsigned *)dst->pixels + (size_t)y * dst->w + r.x, (unsigned *)src->pixels + (size_t)y * src->w + r.x, r.width * sizeof(unsigned));
+    }
+}
+
+// 渲染线程 把这一帧变化的像素交给 GL 线程. 上一帧还没被取走时 新的滚动无法排在
+// 待上传的矩形之后 改为上传整个滚动区域
+static void surface_publish(lt_context *ctx, const lt_rect *rects, unsigned count) {
+    lt_surface *back = &ctx->back, *front = &ctx->surface;
+    lt_handoff *h = &ctx->handoff;
+    size_t bytes = 0;
+
+    std::lock_guard<std::mutex> lock(h->mutex);
+    if (front->w != back->w || front->h != back->h) {
+        front->w = back->w, front->h = back->h;
+        front->pixels = lt_realloc(front->pixels, (size_t)front->w * front->h * 4);
+        lt_memcpy(front->pixels, back->pixels, (size_t)front->w * front->h * 4);
+        front->scroll_count = 0;
+        h->rects.assign(1, lt_rect{0, 0, front->w, front->h});
+        bytes = (size_t)front->w * front->h * 4;
+    } else {
+        bool pending = !h->rects.empty() || front->scroll_count > 0;
+        for (int i = 0; i < back->scroll_count; i++) {
+            lt_rect r = back->scrolls[i].rect;
+            copy_surface_rect(front, back, r);
+            if (!pending && front->scroll_count < LT_SURFACE_MAX_SCROLLS) {
+                front->scrolls[front->scroll_count++] = back->scrolls[i];
+            } else {
+                h->rects.push_back(r);
+                bytes += (size_t)r.width * r.height * 4;
+            }
+        }
+        for (unsigned i = 0; i < count; i++) {
+            copy_surface_rect(front, back, rects[i]);
+            h->rects.push_back(rects[i]);
+            bytes += (size_t)rects[i].width * rects[i].height * 4;
+        }
+    }
+    back->scroll_count = 0;
+    back->upload_bytes = bytes;
+    glfwPostEmptyEvent();  // 宿主可能在 glfwWaitEventsTimeout 里
+}
+
+// GL 线程 上传最近发布的帧
+static void surface_present(lt_context *ctx) {
+    lt_surface *s = &ctx->surface;
+    lt_handoff *h = &ctx->handoff;
+
+    std::lock_guard<std::mutex> lock(h->mutex);
+    if (!s->pixels) return;  // 还没有完成的帧
+    if (s->t.id == 0 || s->w != s->t.width || s->h != s->t.height) {
+        surface_alloc_texture(s);
+    } else {
+        lt_updatesurfacerects(s, h->rects.data(), (unsigned)h->rects.size());
+    }
+    h->rects.clear();
+}
+
+// 只读文件映射, 空文件 data 为 NULL
+typedef struct lt_filemap {
+    const char *data;
+    size_t size;
+#ifdef NEKO_IS_WIN32
+    HANDLE file, mapping;
+#endif
+} lt_filemap;
+
+#ifndef NEKO_IS_WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static bool lt_mapfile(lt_filemap *map, const char *filename) {
+    *map = lt_filemap{};
+#ifdef NEKO_IS_WIN32
+    map->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        errno = (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND) ? ENOENT : EACCES;
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size)) {
+        CloseHandle(map->file);
+        errno = EIO;
+        return false;
+    }
+    map->size = (size_t)size.QuadPart;
+    if (map->size == 0) return true;
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    map->data = map->mapping ? (const char *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!map->data) {
+        if (map->mapping) CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        errno = ENOMEM;
+        return false;
     }
-    file.seekg(0, std::ios::end);
-    std::streamsize size = file.tellg();
-    if (size <= 0) {
-        throw std::runtime_error("File is empty or an error occurred while reading");
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
     }
-    file.seekg(0, std::ios::beg);
-    std::string contents(size, '\0');
-    if (!file.read(&contents[0], size)) {
-        throw std::runtime_error("Error occurred while reading file");
+    map->size = (size_t)st.st_size;
+    if (map->size > 0) {
+        void *p = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        map->data = (const char *)p;
     }
+    close(fd);  // 映射不依赖 fd
+#endif
+    return true;
+}
+
+static void lt_unmapfile(lt_filemap *map) {
+#ifdef NEKO_IS_WIN32
+    if (map->data) UnmapViewOfFile(map->data);
+    if (map->mapping) CloseHandle(map->mapping);
+    if (map->file && map->file != INVALID_HANDLE_VALUE) CloseHandle(map->file);
+#else
+    if (map->data) munmap((void *)map->data, map->size);
+#endif
+    *map = lt_filemap{};
+}
+
+// 共享的只读映射, 同一个文件 (比如不同字号的同一字体) 只映射一次, 引用计数归零时解除
+typedef struct lt_sharedfile {
+    lt_filemap map;
+    std::string key;
+    int refs;
+} lt_sharedfile;
+
+static std::mutex shared_files_mutex;
+static std::unordered_map<std::string, lt_sharedfile *> shared_files;
+static std::unordered_map<const void *, lt_sharedfile *> shared_files_by_data;
+
+// 同一文件的不同写法 (相对路径, ./ 之类) 归一成同一个键
+static std::string lt_file_key(const char *filename) {
+    std::error_code ec;
+    std::filesystem::path path = std::filesystem::absolute(filename, ec);
+    return ec ? std::string(filename) : path.lexically_normal().string();
+}
+
+// 返回只读的文件内容, 失败或空文件返回 NULL; 用完交给 lt_release_file
+const void *lt_load_file(const char *filename, int *ret_size) {
     if (ret_size) *ret_size = 0;
-    if (contents.empty()) {
-        return NULL;
+    std::string key = lt_file_key(filename);
+
+    std::lock_guard<std::mutex> lock(shared_files_mutex);
+    lt_sharedfile *f;
+    auto it = shared_files.find(key);
+    if (it != shared_files.end()) {
+        f = it->second;
+    } else {
+        f = new lt_sharedfile();
+        if (!lt_mapfile(&f->map, filename) || !f->map.data || f->map.size > INT_MAX) {
+            lt_unmapfile(&f->map);
+            delete f;
+            return NULL;
+        }
+        f->key = key;
+        shared_files[key] = f;
+        shared_files_by_data[f->map.data] = f;
     }
-    size_t len = contents.length();
-    if (ret_size) *ret_size = len;
-    void *data = lt_malloc(len);
-    memcpy(data, contents.data(), len);
-    return data;
+    f->refs++;
+    if (ret_size) *ret_size = (int)f->map.size;
+    return f->map.data;
+}
+
+void lt_release_file(const void *data) {
+    if (!data) return;
+    std::lock_guard<std::mutex> lock(shared_files_mutex);
+    auto it = shared_files_by_data.find(data);
+    if (it == shared_files_by_data.end()) return;
+    lt_sharedfile *f = it->second;
+    if (--f->refs > 0) return;
+    shared_files_by_data.erase(it);
+    shared_files.erase(f->key);
+    lt_unmapfile(&f->map);
+    delete f;
 }
 
 const char *lt_button_name(int button) {
@@ -295,45 +811,18 @@ char *lt_key_name(char *dst, int key, int vk, int mods) {
     return dst;
 }
 
+// names of the files and directories in path, see system.scan_dir for their metadata
 void lt_globpath(struct lua_State *L, const char *path) {
     unsigned j = 0;
 
     namespace fs = std::filesystem;
-    std::string basePath = path;
-
-    if (basePath.back() != '/') {
-        basePath += '/';
-    }
-
-    // directory iteration using std::filesystem
-    for (const auto &entry : fs::directory_iterator(basePath)) {
-        if (entry.is_regular_file() || entry.is_directory()) {
-            std::string name = entry.path().filename().string();
-            lua_pushstring(L, name.c_str());
+    std::error_code ec;
+    for (fs::directory_iterator it(*path ? path : ".", ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec) || it->is_directory(ec)) {
+            lua_pushstring(L, it->path().filename().string().c_str());
             lua_rawseti(L, -2, ++j);
         }
     }
-
-    // handling the LT_DATAPATH section
-    const std::string _LT_DATAPATH = LT_DATAPATH;  // Define LT_DATAPATH appropriately
-    size_t sectionPos = basePath.find(_LT_DATAPATH);
-    if (sectionPos != std::string::npos && basePath[sectionPos + _LT_DATAPATH.size()] == '/') {
-        std::vector<std::string> list;
-        for (const auto &entry : fs::recursive_directory_iterator(".")) {
-            if (entry.is_regular_file() || entry.is_directory()) {
-                list.push_back(entry.path().string());
-            }
-        }
-
-        for (const auto &name : list) {
-            if (name.find(basePath.substr(sectionPos + 1)) != std::string::npos) {
-                lua_pushstring(L, fs::path(name).filename().string().c_str());
-                lua_rawseti(L, -2, ++j);
-            }
-        }
-
-        if (!list.empty()) return;
-    }
 }
 
 int lt_emit_event(lua_State *L, const char *event_name, const char *event_fmt, ...) {
@@ -367,351 +856,1088 @@ int printi(int i) {
 INPUT_WRAP_DEFINE(lt);
 
 static const char *codepoint_to_utf8_(unsigned c);
-int lt_poll_event(lua_State *L) {  // init.lua > core.step() wakes on mousemoved || inputtext
-    int rc = 0;
-    char buf[16];
-    static int prevx = 0, prevy = 0;
-
-    static unsigned clicks_time = 0, clicks = 0;
-    if ((lt_time_ms() - clicks_time) > 400) clicks = 0;
-
-    for (INPUT_WRAP_event e; input_wrap_next_e(&lt_input_queue, &e); input_wrap_free_e(&e))
-        if (e.type) switch (e.type) {
-                default:
-                    break;
-                case INPUT_WRAP_WINDOW_CLOSED:  // it used to be ok. depends on window_swap() flow
-                    rc += lt_emit_event(L, "quit", NULL);
-                    return rc;
-
-                    break;
-                case INPUT_WRAP_WINDOW_MOVED:
-                    lt_wx = e.pos.x;
-                    lt_wy = e.pos.y;
-
-                    break;
-                case INPUT_WRAP_WINDOW_RESIZED:
-                    rc += lt_emit_event(L, "resized", "dd", lt_ww = e.size.width, lt_wh = e.size.height);
-                    lt_resizesurface(lt_getsurface(lt_window()), lt_ww, lt_wh);
-
-                    break;
-                case INPUT_WRAP_WINDOW_REFRESH:
-                    rc += lt_emit_event(L, "exposed", NULL);
-                    rencache_invalidate();
-
-                    break;
-                // case INPUT_WRAP_FILE_DROPPED:
-                //     rc += lt_emit_event(L, "filedropped", "sdd", e.file.paths[0], lt_mx, lt_my);
-                //     break;
-                case INPUT_WRAP_KEY_PRESSED:
-                case INPUT_WRAP_KEY_REPEATED:
-                    rc += lt_emit_event(L, "keypressed", "s", lt_key_name(buf, e.keyboard.key, e.keyboard.scancode, e.keyboard.mods));
-                    goto bottom;
-
-                    break;
-                case INPUT_WRAP_KEY_RELEASED:
-                    rc += lt_emit_event(L, "keyreleased", "s", lt_key_name(buf, e.keyboard.key, e.keyboard.scancode, e.keyboard.mods));
-                    goto bottom;
-
-                    break;
-                case INPUT_WRAP_CODEPOINT_INPUT:
-                    rc += lt_emit_event(L, "textinput", "s", codepoint_to_utf8_(e.codepoint));
-
-                    break;
-                case INPUT_WRAP_BUTTON_PRESSED:
-                    rc += lt_emit_event(L, "mousepressed", "sddd", lt_button_name(e.mouse.button), lt_mx, lt_my, printi(1 + clicks));
-
-                    break;
-                case INPUT_WRAP_BUTTON_RELEASED:
-                    clicks += e.mouse.button == GLFW_MOUSE_BUTTON_1;
-                    clicks_time = lt_time_ms();
-                    rc += lt_emit_event(L, "mousereleased", "sdd", lt_button_name(e.mouse.button), lt_mx, lt_my);
-
-                    break;
-                case INPUT_WRAP_CURSOR_MOVED:
-                    lt_mx = e.pos.x - lt_wx, lt_my = e.pos.y - lt_wy;
-                    rc += lt_emit_event(L, "mousemoved", "dddd", lt_mx, lt_my, lt_mx - prevx, lt_my - prevy);
-                    prevx = lt_mx, prevy = lt_my;
-
-                    break;
-                case INPUT_WRAP_SCROLLED:
-                    rc += lt_emit_event(L, "mousewheel", "f", e.scroll.y);
-            }
 
-bottom:;
-
-    return rc;
+// moves the queued input to ctx->events, merging runs of cursor moves and scrolls
+static void lt_drain_input(lt_context *ctx) {
+    ctx->events.erase(ctx->events.begin(), ctx->events.begin() + ctx->next_event);
+    ctx->next_event = 0;
+    for (INPUT_WRAP_event e; input_wrap_next_e(&ctx->input, &e); input_wrap_free_e(&e)) {
+        INPUT_WRAP_event *last = ctx->events.empty() ? NULL : &ctx->events.back();
+        if (last && last->type == e.type && e.type == INPUT_WRAP_CURSOR_MOVED) {
+            last->pos = e.pos;
+        } else if (last && last->type == e.type && e.type == INPUT_WRAP_SCROLLED) {
+            last->scroll.x += e.scroll.x;
+            last->scroll.y += e.scroll.y;
+        } else {
+            ctx->events.push_back(e);
+        }
+    }
 }
 
-// ----------------------------------------------------------------------------
-// lite/renderer.c
-
-#define MAX_GLYPHSET 256
-
-struct RenImage {
-    RenColor *pixels;
-    int width, height;
-};
-
-typedef struct {
-    RenImage *image;
-    stbtt_bakedchar glyphs[256];
-} GlyphSet;
+// pushes the lua values of one event, 0 for events lua never sees
+static int lt_push_event(lua_State *L, lt_context *ctx, const INPUT_WRAP_event &e) {
+    char buf[16];
+    switch (e.type) {
+        default:
+            return 0;
+        case INPUT_WRAP_WINDOW_CLOSED:  // it used to be ok. depends on window_swap() flow
+            return lt_emit_event(L, "quit", NULL);
+        case INPUT_WRAP_WINDOW_MOVED:
+            ctx->wx = e.pos.x;
+            ctx->wy = e.pos.y;
+            return 0;
+        case INPUT_WRAP_WINDOW_RESIZED:
+            lt_resizesurface(lt_getsurface(ctx), ctx->ww = e.size.width, ctx->wh = e.size.height);
+            return lt_emit_event(L, "resized", "dd", ctx->ww, ctx->wh);
+        case INPUT_WRAP_WINDOW_REFRESH:
+            rencache_invalidate();
+            return lt_emit_event(L, "exposed", NULL);
+        // case INPUT_WRAP_FILE_DROPPED:
+        //     return lt_emit_event(L, "filedropped", "sdd", e.file.paths[0], ctx->mx, ctx->my);
+        case INPUT_WRAP_KEY_PRESSED:
+        case INPUT_WRAP_KEY_REPEATED:
+            return lt_emit_event(L, "keypressed", "s", lt_key_name(buf, e.keyboard.key, e.keyboard.scancode, e.keyboard.mods));
+        case INPUT_WRAP_KEY_RELEASED:
+            return lt_emit_event(L, "keyreleased", "s", lt_key_name(buf, e.keyboard.key, e.keyboard.scancode, e.keyboard.mods));
+        case INPUT_WRAP_CODEPOINT_INPUT:
+            return lt_emit_event(L, "textinput", "s", codepoint_to_utf8_(e.codepoint));
+        case INPUT_WRAP_BUTTON_PRESSED:
+            return lt_emit_event(L, "mousepressed", "sddd", lt_button_name(e.mouse.button), ctx->mx, ctx->my, printi(1 + ctx->clicks));
+        case INPUT_WRAP_BUTTON_RELEASED:
+            ctx->clicks += e.mouse.button == GLFW_MOUSE_BUTTON_1;
+            ctx->clicks_time = lt_time_ms();
+            return lt_emit_event(L, "mousereleased", "sdd", lt_button_name(e.mouse.button), ctx->mx, ctx->my);
+        case INPUT_WRAP_CURSOR_MOVED: {
+            ctx->mx = e.pos.x - ctx->wx, ctx->my = e.pos.y - ctx->wy;
+            int rc = lt_emit_event(L, "mousemoved", "dddd", ctx->mx, ctx->my, ctx->mx - ctx->prev_mx, ctx->my - ctx->prev_my);
+            ctx->prev_mx = ctx->mx, ctx->prev_my = ctx->my;
+            return rc;
+        }
+        case INPUT_WRAP_SCROLLED:
+            return lt_emit_event(L, "mousewheel", "f", e.scroll.y);
+    }
+}
 
-struct RenFont {
-    void *data;
-    stbtt_fontinfo stbfont;
-    GlyphSet *sets[MAX_GLYPHSET];
-    float size;
-    int height;
-};
+int lt_poll_event(lua_State *L) {  // one event per call, see lt_poll_events for the batch
+    lt_context *ctx = lt_current;
+    std::lock_guard<std::mutex> lock(ctx->input_mutex);
 
-static struct {
-    int left, top, right, bottom;
-} lt_clip;
+    if ((lt_time_ms() - ctx->clicks_time) > 400) ctx->clicks = 0;
 
-static const char *codepoint_to_utf8_(unsigned c) {
-    static char s[4 + 1];
-    lt_memset(s, 0, 5);
-    if (c < 0x80)
-        s[0] = c, s[1] = 0;
-    else if (c < 0x800)
-        s[0] = 0xC0 | ((c >> 6) & 0x1F), s[1] = 0x80 | (c & 0x3F), s[2] = 0;
-    else if (c < 0x10000)
-        s[0] = 0xE0 | ((c >> 12) & 0x0F), s[1] = 0x80 | ((c >> 6) & 0x3F), s[2] = 0x80 | (c & 0x3F), s[3] = 0;
-    else if (c < 0x110000)
-        s[0] = 0xF0 | ((c >> 18) & 0x07), s[1] = 0x80 | ((c >> 12) & 0x3F), s[2] = 0x80 | ((c >> 6) & 0x3F), s[3] = 0x80 | (c & 0x3F), s[4] = 0;
-    return s;
-}
-static const char *utf8_to_codepoint_(const char *p, unsigned *dst) {
-    unsigned res, n;
-    switch (*p & 0xf0) {
-        case 0xf0:
-            res = *p & 0x07;
-            n = 3;
-            break;
-        case 0xe0:
-            res = *p & 0x0f;
-            n = 2;
-            break;
-        case 0xd0:
-        case 0xc0:
-            res = *p & 0x1f;
-            n = 1;
-            break;
-        default:
-            res = *p;
-            n = 0;
-            break;
-    }
-    while (n-- && *p++) {                //< https://github.com/rxi/lite/issues/262
-        res = (res << 6) | (*p & 0x3f);  //< https://github.com/rxi/lite/issues/262
+    if (ctx->next_event == ctx->events.size()) lt_drain_input(ctx);
+    while (ctx->next_event < ctx->events.size()) {
+        int rc = lt_push_event(L, ctx, ctx->events[ctx->next_event++]);
+        if (rc) return rc;
     }
-    *dst = res;
-    return p + 1;
+    return 0;
 }
 
-void ren_init(void *win) {
-    lt_surface *surf = lt_getsurface(lt_window());
-    ren_set_clip_rect(RenRect{0, 0, surf->w, surf->h});
-}
+// fills the table at idx with type, a, b, c, d of every pending event and returns the count
+int lt_poll_events(lua_State *L, int idx) {
+    lt_context *ctx = lt_current;
+    std::lock_guard<std::mutex> lock(ctx->input_mutex);
 
-void ren_update_rects(RenRect *rects, int count) { lt_updatesurfacerects(lt_getsurface(lt_window()), (lt_rect *)rects, count); }
+    if ((lt_time_ms() - ctx->clicks_time) > 400) ctx->clicks = 0;
 
-void ren_set_clip_rect(RenRect rect) {
-    lt_clip.left = rect.x;
-    lt_clip.top = rect.y;
-    lt_clip.right = rect.x + rect.width;
-    lt_clip.bottom = rect.y + rect.height;
+    lt_drain_input(ctx);
+    int count = 0;
+    for (const INPUT_WRAP_event &e : ctx->events) {
+        int rc = lt_push_event(L, ctx, e);
+        if (!rc) continue;
+        for (; rc < 5; rc++) lua_pushnil(L);
+        for (int i = 5; i >= 1; i--) lua_rawseti(L, idx, count * 5 + i);
+        count++;
+    }
+    ctx->events.clear();
+    return count;
 }
 
-void ren_get_size(int *x, int *y) {
-    lt_surface *surf = lt_getsurface(lt_window());
-    *x = surf->w;
-    *y = surf->h;
-}
+// ----------------------------------------------------------------------------
+// lite/renderer_blend.c
 
-RenImage *ren_new_image(int width, int height) {
-    lt_assert(width > 0 && height > 0);
-    RenImage *image = (RenImage *)lt_malloc(sizeof(RenImage) + width * height * sizeof(RenColor));
-    image->pixels = (RenColor *)(image + 1);
-    image->width = width;
-    image->height = height;
-    return image;
-}
+/* span kernels used by the software renderer. every vector kernel must give
+** bit-identical results to the scalar blend_pixel*() functions below; the
+** best variant for the running cpu is picked once by ren_init_kernels() */
 
-void ren_free_image(RenImage *image) { lt_free(image); }
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define LT_ARCH_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64)
+#define LT_ARCH_NEON
+#include <arm_neon.h>
+#endif
 
-static GlyphSet *load_glyphset(RenFont *font, int idx) {
-    GlyphSet *set = (GlyphSet *)lt_calloc(1, sizeof(GlyphSet));
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LT_TARGET_AVX2
+#else
+#define LT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
-    // init image
-    int width = 128;
-    int height = 128;
-retry:
-    set->image = ren_new_image(width, height);
+static inline RenColor blend_pixel(RenColor dst, RenColor src) {
+    int ia = 0xff - src.a;
+    dst.r = ((src.r * src.a) + (dst.r * ia)) >> 8;
+    dst.g = ((src.g * src.a) + (dst.g * ia)) >> 8;
+    dst.b = ((src.b * src.a) + (dst.b * ia)) >> 8;
+    return dst;
+}
 
-    // load glyphs
-    float s = stbtt_ScaleForMappingEmToPixels(&font->stbfont, 1) / stbtt_ScaleForPixelHeight(&font->stbfont, 1);
-    int res = stbtt_BakeFontBitmap((unsigned char *)font->data, 0, font->size * s, (unsigned char *)set->image->pixels, width, height, idx * 256, 256, set->glyphs);
+static inline RenColor blend_pixel2(RenColor dst, RenColor src, RenColor color) {
+    src.a = (src.a * color.a) >> 8;
+    int ia = 0xff - src.a;
+    dst.r = ((src.r * color.r * src.a) >> 16) + ((dst.r * ia) >> 8);
+    dst.g = ((src.g * color.g * src.a) >> 16) + ((dst.g * ia) >> 8);
+    dst.b = ((src.b * color.b * src.a) >> 16) + ((dst.b * ia) >> 8);
+    return dst;
+}
 
-    // retry with a larger image buffer if the buffer wasn't large enough
-    if (res < 0) {
-        width *= 2;
-        height *= 2;
-        ren_free_image(set->image);
-        goto retry;
+// d[i] = blend_pixel2(d[i], {255, 255, 255, s[i]}, color)
+typedef void (*blend_coverage_span_fn)(RenColor *d, const uint8_t *s, int n, RenColor color);
+// d[i] = blend_pixel2(d[i], s[i], color)
+typedef void (*blend_image_span_fn)(RenColor *d, const RenColor *s, int n, RenColor color);
+// d[i] = blend_pixel(d[i], color)
+typedef void (*blend_rect_span_fn)(RenColor *d, int n, RenColor color);
+// d[i] = color
+typedef void (*fill_span_fn)(RenColor *d, int n, RenColor color);
+
+static void blend_coverage_span_scalar(RenColor *d, const uint8_t *s, int n, RenColor color) {
+    for (int i = 0; i < n; i++) {
+        d[i] = blend_pixel2(d[i], RenColor{0xff, 0xff, 0xff, s[i]}, color);
     }
+}
 
-    // adjust glyph yoffsets and xadvance
-    int ascent, descent, linegap;
-    stbtt_GetFontVMetrics(&font->stbfont, &ascent, &descent, &linegap);
-    float scale = stbtt_ScaleForMappingEmToPixels(&font->stbfont, font->size);
-    int scaled_ascent = ascent * scale + 0.5;
-    for (int i = 0; i < 256; i++) {
-        set->glyphs[i].yoff += scaled_ascent;
-        set->glyphs[i].xadvance = floor(set->glyphs[i].xadvance);
+static void blend_image_span_scalar(RenColor *d, const RenColor *s, int n, RenColor color) {
+    for (int i = 0; i < n; i++) {
+        d[i] = blend_pixel2(d[i], s[i], color);
     }
+}
 
-    // convert 8bit data to 32bit
-    for (int i = width * height - 1; i >= 0; i--) {
-        uint8_t n = *((uint8_t *)set->image->pixels + i);
-        set->image->pixels[i] = RenColor{.b = 255, .g = 255, .r = 255, .a = n};
+static void blend_rect_span_scalar(RenColor *d, int n, RenColor color) {
+    for (int i = 0; i < n; i++) {
+        d[i] = blend_pixel(d[i], color);
     }
+}
+
+static void fill_span_scalar(RenColor *d, int n, RenColor color) {
+    uint32_t v;
+    lt_memcpy(&v, &color, sizeof(v));
+    std::fill_n((uint32_t *)d, n, v);
+}
 
-    return set;
+#ifdef LT_ARCH_X86
+// two pixels widened to 16bit lanes (b g r a b g r a)
+// src.c * color.c fits in 16 bits, so the 24bit product of blend_pixel2 is mulhi(src.c * color.c, sa)
+static inline __m128i blend2_sse2(__m128i s, __m128i d, __m128i col, __m128i ca, __m128i c255) {
+    __m128i sa = _mm_srli_epi16(_mm_mullo_epi16(s, ca), 8);
+    sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sa, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i ia = _mm_sub_epi16(c255, sa);
+    __m128i a = _mm_mulhi_epu16(_mm_mullo_epi16(s, col), sa);
+    __m128i b = _mm_srli_epi16(_mm_mullo_epi16(d, ia), 8);
+    return _mm_add_epi16(a, b);
 }
 
-static GlyphSet *get_glyphset(RenFont *font, int codepoint) {
-    int idx = (codepoint >> 8) % MAX_GLYPHSET;
-    if (!font->sets[idx]) {
-        font->sets[idx] = load_glyphset(font, idx);
+static void blend_image_span_sse2(RenColor *d, const RenColor *s, int n, RenColor color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i col = _mm_set_epi16(color.a, color.r, color.g, color.b, color.a, color.r, color.g, color.b);
+    const __m128i ca = _mm_set1_epi16(color.a);
+    const __m128i c255 = _mm_set1_epi16(0xff);
+    const __m128i amask = _mm_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i sv = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i dv = _mm_loadu_si128((const __m128i *)(d + i));
+        __m128i lo = blend2_sse2(_mm_unpacklo_epi8(sv, zero), _mm_unpacklo_epi8(dv, zero), col, ca, c255);
+        __m128i hi = blend2_sse2(_mm_unpackhi_epi8(sv, zero), _mm_unpackhi_epi8(dv, zero), col, ca, c255);
+        // destination alpha is left untouched
+        __m128i res = _mm_or_si128(_mm_andnot_si128(amask, _mm_packus_epi16(lo, hi)), _mm_and_si128(amask, dv));
+        _mm_storeu_si128((__m128i *)(d + i), res);
     }
-    return font->sets[idx];
+    blend_image_span_scalar(d + i, s + i, n - i, color);
 }
 
-RenFont *ren_load_font(const char *filename, float size) {
-    // load font into buffer
-    char *fontdata = (char *)lt_load_file(filename, NULL);
-    if (!fontdata) return NULL;
+LT_TARGET_AVX2 static inline __m256i blend2_avx2(__m256i s, __m256i d, __m256i col, __m256i ca, __m256i c255) {
+    __m256i sa = _mm256_srli_epi16(_mm256_mullo_epi16(s, ca), 8);
+    sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sa, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i ia = _mm256_sub_epi16(c255, sa);
+    __m256i a = _mm256_mulhi_epu16(_mm256_mullo_epi16(s, col), sa);
+    __m256i b = _mm256_srli_epi16(_mm256_mullo_epi16(d, ia), 8);
+    return _mm256_add_epi16(a, b);
+}
 
-    RenFont *font = NULL;
+LT_TARGET_AVX2 static void blend_image_span_avx2(RenColor *d, const RenColor *s, int n, RenColor color) {
+    // glyph spans are a handful of pixels, too short to win back the setup of the ymm constants
+    if (n < 16) return blend_image_span_sse2(d, s, n, color);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i col = _mm256_set_epi16(color.a, color.r, color.g, color.b, color.a, color.r, color.g, color.b, color.a, color.r, color.g, color.b, color.a, color.r, color.g, color.b);
+    const __m256i ca = _mm256_set1_epi16(color.a);
+    const __m256i c255 = _mm256_set1_epi16(0xff);
+    const __m256i amask = _mm256_set1_epi32((int)0xff000000);
+    int i = 0;
+    // unpack/pack work per 128bit lane, so pixel order survives the round trip
+    for (; i + 8 <= n; i += 8) {
+        __m256i sv = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i dv = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i lo = blend2_avx2(_mm256_unpacklo_epi8(sv, zero), _mm256_unpacklo_epi8(dv, zero), col, ca, c255);
+        __m256i hi = blend2_avx2(_mm256_unpackhi_epi8(sv, zero), _mm256_unpackhi_epi8(dv, zero), col, ca, c255);
+        __m256i res = _mm256_or_si256(_mm256_andnot_si256(amask, _mm256_packus_epi16(lo, hi)), _mm256_and_si256(amask, dv));
+        _mm256_storeu_si256((__m256i *)(d + i), res);
+    }
+    // the tail runs legacy sse code: gcc tail calls it without clearing the upper ymm halves,
+    // and every sse instruction after that pays for the dirty state
+    _mm256_zeroupper();
+    blend_image_span_sse2(d + i, s + i, n - i, color);
+}
 
-    // init font
-    font = (RenFont *)lt_calloc(1, sizeof(RenFont));
-    font->size = size;
-    font->data = fontdata;
+// blend_pixel with the source premultiplied once: (src.c * src.a + dst.c * ia) >> 8 never exceeds 16 bits
+static inline __m128i blend_solid2_sse2(__m128i d, __m128i pre, __m128i ia) { return _mm_srli_epi16(_mm_add_epi16(pre, _mm_mullo_epi16(d, ia)), 8); }
+
+static void blend_rect_span_sse2(RenColor *d, int n, RenColor color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i pre = _mm_set_epi16(0, color.r * color.a, color.g * color.a, color.b * color.a, 0, color.r * color.a, color.g * color.a, color.b * color.a);
+    const __m128i ia = _mm_set1_epi16(0xff - color.a);
+    const __m128i amask = _mm_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i dv = _mm_loadu_si128((const __m128i *)(d + i));
+        __m128i lo = blend_solid2_sse2(_mm_unpacklo_epi8(dv, zero), pre, ia);
+        __m128i hi = blend_solid2_sse2(_mm_unpackhi_epi8(dv, zero), pre, ia);
+        __m128i res = _mm_or_si128(_mm_andnot_si128(amask, _mm_packus_epi16(lo, hi)), _mm_and_si128(amask, dv));
+        _mm_storeu_si128((__m128i *)(d + i), res);
+    }
+    blend_rect_span_scalar(d + i, n - i, color);
+}
+
+static void fill_span_sse2(RenColor *d, int n, RenColor color) {
+    uint32_t v;
+    lt_memcpy(&v, &color, sizeof(v));
+    const __m128i cv = _mm_set1_epi32((int)v);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm_storeu_si128((__m128i *)(d + i), cv);
+        _mm_storeu_si128((__m128i *)(d + i + 4), cv);
+        _mm_storeu_si128((__m128i *)(d + i + 8), cv);
+        _mm_storeu_si128((__m128i *)(d + i + 12), cv);
+    }
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)(d + i), cv);
+    }
+    fill_span_scalar(d + i, n - i, color);
+}
+
+LT_TARGET_AVX2 static void blend_rect_span_avx2(RenColor *d, int n, RenColor color) {
+    const __m256i zero = _mm256_setzero_si256();
+    const short pb = color.b * color.a, pg = color.g * color.a, pr = color.r * color.a;
+    const __m256i pre = _mm256_set_epi16(0, pr, pg, pb, 0, pr, pg, pb, 0, pr, pg, pb, 0, pr, pg, pb);
+    const __m256i ia = _mm256_set1_epi16(0xff - color.a);
+    const __m256i amask = _mm256_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i dv = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(pre, _mm256_mullo_epi16(_mm256_unpacklo_epi8(dv, zero), ia)), 8);
+        __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(pre, _mm256_mullo_epi16(_mm256_unpackhi_epi8(dv, zero), ia)), 8);
+        __m256i res = _mm256_or_si256(_mm256_andnot_si256(amask, _mm256_packus_epi16(lo, hi)), _mm256_and_si256(amask, dv));
+        _mm256_storeu_si256((__m256i *)(d + i), res);
+    }
+    _mm256_zeroupper();
+    blend_rect_span_sse2(d + i, n - i, color);
+}
+
+// coverage blending is blend2 with a white source: 255 * color.c is constant per span
+static inline __m128i blend_coverage2_sse2(__m128i cov, __m128i d, __m128i k, __m128i ca, __m128i c255) {
+    __m128i sa = _mm_srli_epi16(_mm_mullo_epi16(cov, ca), 8);
+    __m128i ia = _mm_sub_epi16(c255, sa);
+    __m128i a = _mm_mulhi_epu16(k, sa);
+    __m128i b = _mm_srli_epi16(_mm_mullo_epi16(d, ia), 8);
+    return _mm_add_epi16(a, b);
+}
+
+static void blend_coverage_span_sse2(RenColor *d, const uint8_t *s, int n, RenColor color) {
+    const __m128i zero = _mm_setzero_si128();
+    const short kb = 0xff * color.b, kg = 0xff * color.g, kr = 0xff * color.r;
+    const __m128i k = _mm_set_epi16(0, kr, kg, kb, 0, kr, kg, kb);
+    const __m128i ca = _mm_set1_epi16(color.a);
+    const __m128i c255 = _mm_set1_epi16(0xff);
+    const __m128i amask = _mm_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int c4;
+        lt_memcpy(&c4, s + i, sizeof(c4));
+        // c0 c1 c2 c3 -> c0 c0 c0 c0 c1 c1 c1 c1 | c2 c2 c2 c2 c3 c3 c3 c3
+        __m128i cov = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c4), zero);
+        cov = _mm_unpacklo_epi16(cov, cov);
+        __m128i dv = _mm_loadu_si128((const __m128i *)(d + i));
+        __m128i lo = blend_coverage2_sse2(_mm_unpacklo_epi32(cov, cov), _mm_unpacklo_epi8(dv, zero), k, ca, c255);
+        __m128i hi = blend_coverage2_sse2(_mm_unpackhi_epi32(cov, cov), _mm_unpackhi_epi8(dv, zero), k, ca, c255);
+        __m128i res = _mm_or_si128(_mm_andnot_si128(amask, _mm_packus_epi16(lo, hi)), _mm_and_si128(amask, dv));
+        _mm_storeu_si128((__m128i *)(d + i), res);
+    }
+    blend_coverage_span_scalar(d + i, s + i, n - i, color);
+}
+
+LT_TARGET_AVX2 static inline __m256i blend_coverage2_avx2(__m256i cov, __m256i d, __m256i k, __m256i ca, __m256i c255) {
+    __m256i sa = _mm256_srli_epi16(_mm256_mullo_epi16(cov, ca), 8);
+    __m256i ia = _mm256_sub_epi16(c255, sa);
+    __m256i a = _mm256_mulhi_epu16(k, sa);
+    __m256i b = _mm256_srli_epi16(_mm256_mullo_epi16(d, ia), 8);
+    return _mm256_add_epi16(a, b);
+}
+
+LT_TARGET_AVX2 static void blend_coverage_span_avx2(RenColor *d, const uint8_t *s, int n, RenColor color) {
+    if (n < 16) return blend_coverage_span_sse2(d, s, n, color);
+    const __m256i zero = _mm256_setzero_si256();
+    const short kb = 0xff * color.b, kg = 0xff * color.g, kr = 0xff * color.r;
+    const __m256i k = _mm256_set_epi16(0, kr, kg, kb, 0, kr, kg, kb, 0, kr, kg, kb, 0, kr, kg, kb);
+    const __m256i ca = _mm256_set1_epi16(color.a);
+    const __m256i c255 = _mm256_set1_epi16(0xff);
+    const __m256i amask = _mm256_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // c0..c3 | c4..c7 as 32bit lanes, each coverage copied into both 16bit halves
+        __m256i cov = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(s + i)));
+        cov = _mm256_or_si256(cov, _mm256_slli_epi32(cov, 16));
+        __m256i dv = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i lo = blend_coverage2_avx2(_mm256_unpacklo_epi32(cov, cov), _mm256_unpacklo_epi8(dv, zero), k, ca, c255);
+        __m256i hi = blend_coverage2_avx2(_mm256_unpackhi_epi32(cov, cov), _mm256_unpackhi_epi8(dv, zero), k, ca, c255);
+        __m256i res = _mm256_or_si256(_mm256_andnot_si256(amask, _mm256_packus_epi16(lo, hi)), _mm256_and_si256(amask, dv));
+        _mm256_storeu_si256((__m256i *)(d + i), res);
+    }
+    _mm256_zeroupper();
+    blend_coverage_span_sse2(d + i, s + i, n - i, color);
+}
+
+static bool cpu_has_avx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;  // osxsave, avx
+    if ((_xgetbv(0) & 6) != 6) return false;                                    // os saves ymm state
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef LT_ARCH_NEON
+static void blend_coverage_span_neon(RenColor *d, const uint8_t *s, int n, RenColor color) {
+    const uint16x4_t k[3] = {vdup_n_u16(0xff * color.b), vdup_n_u16(0xff * color.g), vdup_n_u16(0xff * color.r)};
+    const uint8x8_t ca = vdup_n_u8(color.a);
+    const uint8x8_t c255 = vdup_n_u8(0xff);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t dv = vld4_u8((const uint8_t *)(d + i));
+        uint8x8_t sa = vshrn_n_u16(vmull_u8(vld1_u8(s + i), ca), 8);
+        uint8x8_t ia = vsub_u8(c255, sa);
+        uint16x8_t sa16 = vmovl_u8(sa);
+        for (int c = 0; c < 3; c++) {
+            uint16x4_t lo = vshrn_n_u32(vmull_u16(k[c], vget_low_u16(sa16)), 16);
+            uint16x4_t hi = vshrn_n_u32(vmull_u16(k[c], vget_high_u16(sa16)), 16);
+            uint8x8_t a = vmovn_u16(vcombine_u16(lo, hi));
+            uint8x8_t b = vshrn_n_u16(vmull_u8(dv.val[c], ia), 8);
+            dv.val[c] = vadd_u8(a, b);
+        }
+        vst4_u8((uint8_t *)(d + i), dv);
+    }
+    blend_coverage_span_scalar(d + i, s + i, n - i, color);
+}
+
+static void blend_image_span_neon(RenColor *d, const RenColor *s, int n, RenColor color) {
+    const uint8x8_t cb = vdup_n_u8(color.b), cg = vdup_n_u8(color.g), cr = vdup_n_u8(color.r), ca = vdup_n_u8(color.a);
+    const uint8x8_t c255 = vdup_n_u8(0xff);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t sv = vld4_u8((const uint8_t *)(s + i));  // planes b g r a
+        uint8x8x4_t dv = vld4_u8((const uint8_t *)(d + i));
+        uint8x8_t sa = vshrn_n_u16(vmull_u8(sv.val[3], ca), 8);
+        uint8x8_t ia = vsub_u8(c255, sa);
+        uint16x8_t sa16 = vmovl_u8(sa);
+        const uint8x8_t cc[3] = {cb, cg, cr};
+        for (int c = 0; c < 3; c++) {
+            uint16x8_t sc = vmull_u8(sv.val[c], cc[c]);
+            uint16x4_t lo = vshrn_n_u32(vmull_u16(vget_low_u16(sc), vget_low_u16(sa16)), 16);
+            uint16x4_t hi = vshrn_n_u32(vmull_u16(vget_high_u16(sc), vget_high_u16(sa16)), 16);
+            uint8x8_t a = vmovn_u16(vcombine_u16(lo, hi));
+            uint8x8_t b = vshrn_n_u16(vmull_u8(dv.val[c], ia), 8);
+            dv.val[c] = vadd_u8(a, b);
+        }
+        vst4_u8((uint8_t *)(d + i), dv);
+    }
+    blend_image_span_scalar(d + i, s + i, n - i, color);
+}
+
+static void blend_rect_span_neon(RenColor *d, int n, RenColor color) {
+    const uint16x8_t pb = vdupq_n_u16(color.b * color.a), pg = vdupq_n_u16(color.g * color.a), pr = vdupq_n_u16(color.r * color.a);
+    const uint8x8_t ia = vdup_n_u8(0xff - color.a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t dv = vld4_u8((const uint8_t *)(d + i));
+        dv.val[0] = vshrn_n_u16(vmlal_u8(pb, dv.val[0], ia), 8);
+        dv.val[1] = vshrn_n_u16(vmlal_u8(pg, dv.val[1], ia), 8);
+        dv.val[2] = vshrn_n_u16(vmlal_u8(pr, dv.val[2], ia), 8);
+        vst4_u8((uint8_t *)(d + i), dv);
+    }
+    blend_rect_span_scalar(d + i, n - i, color);
+}
+#endif
+
+static blend_coverage_span_fn blend_coverage_span = blend_coverage_span_scalar;
+static blend_image_span_fn blend_image_span = blend_image_span_scalar;
+static blend_rect_span_fn blend_rect_span = blend_rect_span_scalar;
+static fill_span_fn fill_span = fill_span_scalar;
+
+static void ren_init_kernels() {
+    // contexts may be created on several threads
+    static std::once_flag once;
+    std::call_once(once, [] {
+#if defined(LT_ARCH_X86)
+        blend_coverage_span = blend_coverage_span_sse2;
+        blend_image_span = blend_image_span_sse2;
+        blend_rect_span = blend_rect_span_sse2;
+        fill_span = fill_span_sse2;
+        if (cpu_has_avx2()) {
+            blend_coverage_span = blend_coverage_span_avx2;
+            blend_image_span = blend_image_span_avx2;
+            blend_rect_span = blend_rect_span_avx2;
+        }
+#elif defined(LT_ARCH_NEON)
+        blend_coverage_span = blend_coverage_span_neon;
+        blend_image_span = blend_image_span_neon;
+        blend_rect_span = blend_rect_span_neon;
+#endif
+    });
+}
+
+// ----------------------------------------------------------------------------
+// lite/renderer.c
+
+/* glyphs are rasterized on first draw into a single 8bit coverage atlas per
+** font. the atlas is packed in shelves (rows of glyphs of similar height); it
+** grows up to GLYPH_ATLAS_MAX_SIZE and then evicts the least recently drawn
+** shelf. glyph metrics are kept when a bitmap is evicted, so width queries
+** never rasterize anything */
+
+#define GLYPH_ATLAS_INIT_SIZE 256
+#define GLYPH_ATLAS_MAX_SIZE 2048
+#define GLYPH_PADDING 1
+
+struct RenImage {
+    RenColor *pixels;
+    int width, height;
+};
+
+typedef struct {
+    int index;               // stbtt glyph index
+    short x, y, w, h;        // coverage rect inside the atlas
+    short xoff, yoff;        // offset from the pen position
+    int xadvance;            // pen advance
+    short shelf;             // atlas shelf holding the bitmap, -1 when not resident
+    bool loaded;             // metrics loaded
+} Glyph;
+
+typedef struct {
+    int y, height;
+    int x;                   // first free column
+    unsigned last_use;       // glyph_clock of the last draw that touched the shelf
+} GlyphShelf;
+
+typedef struct {
+    uint8_t *pixels;
+    int width, height;
+    GlyphShelf *shelves;
+    int shelf_count, shelf_cap;
+    int next_y;              // top of the unused area below the last shelf
+    unsigned generation;     // bumped whenever resident glyphs are evicted
+} GlyphAtlas;
+
+// a parsed font file, shared by every size and every context. stbtt_fontinfo is
+// only read after stbtt_InitFont, so glyphs can be rasterized from any thread
+typedef struct RenFace {
+    const void *data;  // lt_load_file 的共享映射
+    stbtt_fontinfo info;
+    std::string key;
+    int refs;  // guarded by face_mutex
+    int ink_x0, ink_y0, ink_y1;  // font bounding box, font units
+    int ink_over;                // furthest any glyph's ink reaches past its advance, font units
+} RenFace;
+
+// latin glyphs of a new size rasterized ahead of their first draw by the prewarm
+// worker; each slot is claimed by whichever side gets to it first so nobody waits
+enum { PREWARM_FREE, PREWARM_BUSY, PREWARM_READY, PREWARM_TAKEN };
+
+typedef struct GlyphPrewarm {
+    RenFace *face;
+    float scale;
+    std::atomic<uint8_t> state[256];
+    std::vector<uint8_t> bitmaps[256];  // w * h, written before state becomes READY
+    std::atomic<bool> cancel;
+} GlyphPrewarm;
+
+// a face at one size and its glyphs, shared by every handle of that size in a context
+typedef struct RenFontSize {
+    RenFace *face;
+    GlyphPrewarm *prewarm;
+    GlyphAtlas atlas;
+    Glyph latin[256];                              // codepoints < 256
+    std::unordered_map<unsigned, Glyph> *glyphs;   // all other codepoints
+    float size;
+    float scale;
+    int height;
+    int ascent;
+    int ink_left, ink_top, ink_right, ink_bottom;  // how far ink can reach outside a run's advance box, see ren_get_text_run_ink
+    RenState *owner;    // context whose size cache holds the size, NULL once it is gone
+    int refs;           // handles, 0 while the size only sits in the size cache
+    unsigned released;  // owner->font_clock when refs dropped to 0
+} RenFontSize;
+
+// what ren_load_font hands out. the glyphs come from the shared size, settings stay with the handle
+struct RenFont {
+    RenFontSize *shared;
+    int tab_width;
+};
+
+typedef struct {
+    int left, top, right, bottom;
+} RenClip;
+
+// per context renderer state, see lt_makecurrent
+typedef struct RenState {
+    RenClip clip;
+    unsigned glyph_clock;  // bumped once per text draw, shelves touched by the current draw are never evicted
+    struct {
+        TextRun **slots;
+        int size;  // power of 2
+        int count;
+        unsigned frame;
+        unsigned hits, misses;
+    } text_cache;
+    std::vector<RenFontSize *> sizes;  // sizes in use and recently released ones, see ren_load_font
+    unsigned font_clock;
+} RenState;
+
+static thread_local RenState *rstate;
+
+static inline RenClip clip_from_rect(RenRect rect) { return RenClip{rect.x, rect.y, rect.x + rect.width, rect.y + rect.height}; }
+
+static const char *codepoint_to_utf8_(unsigned c) {
+    static thread_local char s[4 + 1];
+    lt_memset(s, 0, 5);
+    if (c < 0x80)
+        s[0] = c, s[1] = 0;
+    else if (c < 0x800)
+        s[0] = 0xC0 | ((c >> 6) & 0x1F), s[1] = 0x80 | (c & 0x3F), s[2] = 0;
+    else if (c < 0x10000)
+        s[0] = 0xE0 | ((c >> 12) & 0x0F), s[1] = 0x80 | ((c >> 6) & 0x3F), s[2] = 0x80 | (c & 0x3F), s[3] = 0;
+    else if (c < 0x110000)
+        s[0] = 0xF0 | ((c >> 18) & 0x07), s[1] = 0x80 | ((c >> 12) & 0x3F), s[2] = 0x80 | ((c >> 6) & 0x3F), s[3] = 0x80 | (c & 0x3F), s[4] = 0;
+    return s;
+}
+static const char *utf8_to_codepoint_(const char *p, unsigned *dst) {
+    unsigned res, n;
+    switch (*p & 0xf0) {
+        case 0xf0:
+            res = *p & 0x07;
+            n = 3;
+            break;
+        case 0xe0:
+            res = *p & 0x0f;
+            n = 2;
+            break;
+        case 0xd0:
+        case 0xc0:
+            res = *p & 0x1f;
+            n = 1;
+            break;
+        default:
+            res = *p;
+            n = 0;
+            break;
+    }
+    while (n-- && *p++) {                //< https://github.com/rxi/lite/issues/262
+        res = (res << 6) | (*p & 0x3f);  //< https://github.com/rxi/lite/issues/262
+    }
+    *dst = res;
+    return p + 1;
+}
+
+void ren_init(void *win) {
+    ren_init_kernels();
+    lt_surface *surf = lt_current->target;
+    ren_set_clip_rect(RenRect{0, 0, surf->w, surf->h});
+}
+
+void ren_update_rects(RenRect *rects, int count) {
+    if (lt_threaded(lt_current)) {
+        surface_publish(lt_current, (lt_rect *)rects, count);
+    } else {
+        lt_updatesurfacerects(lt_current->target, (lt_rect *)rects, count);
+    }
+}
+
+bool ren_scroll_rect(RenRect rect, int dy) { return lt_scrollsurface(lt_current->target, rect, dy); }
+
+void ren_set_clip_rect(RenRect rect) { rstate->clip = clip_from_rect(rect); }
+
+void ren_get_size(int *x, int *y) {
+    lt_surface *surf = lt_current->target;
+    *x = surf->w;
+    *y = surf->h;
+}
+
+RenImage *ren_new_image(int width, int height) {
+    lt_assert(width > 0 && height > 0);
+    RenImage *image = (RenImage *)lt_malloc(sizeof(RenImage) + width * height * sizeof(RenColor));
+    image->pixels = (RenColor *)(image + 1);
+    image->width = width;
+    image->height = height;
+    return image;
+}
+
+void ren_free_image(RenImage *image) { lt_free(image); }
+
+static Glyph *get_glyph(RenFontSize *font, unsigned codepoint) {
+    Glyph *g = codepoint < 256 ? &font->latin[codepoint] : &(*font->glyphs)[codepoint];
+    if (!g->loaded) {
+        int advance, lsb, x0, y0, x1, y1;
+        const stbtt_fontinfo *info = &font->face->info;
+        g->index = stbtt_FindGlyphIndex(info, codepoint);
+        stbtt_GetGlyphHMetrics(info, g->index, &advance, &lsb);
+        stbtt_GetGlyphBitmapBox(info, g->index, font->scale, font->scale, &x0, &y0, &x1, &y1);
+        g->xoff = x0;
+        g->yoff = y0 + font->ascent;
+        g->xadvance = floor(font->scale * advance);
+        g->w = x1 - x0;
+        g->h = y1 - y0;
+        // make tab and newline glyphs invisible
+        if (codepoint == '\t' || codepoint == '\n') {
+            g->w = 0;
+        }
+        g->shelf = -1;
+        g->loaded = true;
+    }
+    return g;
+}
+
+static void atlas_drop_glyphs(RenFontSize *font, int shelf) {
+    for (int i = 0; i < 256; i++) {
+        if (shelf < 0 || font->latin[i].shelf == shelf) font->latin[i].shelf = -1;
+    }
+    for (auto &it : *font->glyphs) {
+        if (shelf < 0 || it.second.shelf == shelf) it.second.shelf = -1;
+    }
+    font->atlas.generation++;
+}
+
+static bool atlas_grow(GlyphAtlas *atlas) {
+    if (atlas->width >= GLYPH_ATLAS_MAX_SIZE) return false;
+    int w = atlas->width ? atlas->width * 2 : GLYPH_ATLAS_INIT_SIZE;
+    int h = atlas->height ? atlas->height * 2 : GLYPH_ATLAS_INIT_SIZE;
+    uint8_t *pixels = (uint8_t *)lt_calloc(1, (size_t)w * h);
+    for (int y = 0; y < atlas->height; y++) {
+        lt_memcpy(pixels + (size_t)y * w, atlas->pixels + (size_t)y * atlas->width, atlas->width);
+    }
+    lt_free(atlas->pixels);
+    atlas->pixels = pixels;
+    atlas->width = w;
+    atlas->height = h;
+    return true;
+}
+
+static int atlas_add_shelf(GlyphAtlas *atlas, int height) {
+    if (atlas->shelf_count == atlas->shelf_cap) {
+        atlas->shelf_cap = atlas->shelf_cap ? atlas->shelf_cap * 2 : 16;
+        atlas->shelves = (GlyphShelf *)lt_realloc(atlas->shelves, atlas->shelf_cap * sizeof(GlyphShelf));
+    }
+    GlyphShelf *sh = &atlas->shelves[atlas->shelf_count];
+    sh->y = atlas->next_y;
+    sh->height = height;
+    sh->x = 0;
+    sh->last_use = 0;
+    atlas->next_y += height;
+    return atlas->shelf_count++;
+}
+
+// finds room for a w*h bitmap, returns the shelf index or -1
+static int atlas_alloc(RenFontSize *font, int w, int h) {
+    GlyphAtlas *atlas = &font->atlas;
+    w += GLYPH_PADDING;
+    h += GLYPH_PADDING;
+    if (w > GLYPH_ATLAS_MAX_SIZE || h > GLYPH_ATLAS_MAX_SIZE) return -1;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // best fitting shelf with free room, don't waste shelves much taller than the glyph
+        int best = -1;
+        for (int i = 0; i < atlas->shelf_count; i++) {
+            GlyphShelf *sh = &atlas->shelves[i];
+            if (sh->height < h || sh->height > h + h / 2 + 2 || sh->x + w > atlas->width) continue;
+            if (best < 0 || sh->height < atlas->shelves[best].height) best = i;
+        }
+        if (best >= 0) return best;
+
+        // open a new shelf, growing the atlas while allowed
+        while (atlas->next_y + h > atlas->height || w > atlas->width) {
+            if (!atlas_grow(atlas)) break;
+        }
+        if (atlas->next_y + h <= atlas->height && w <= atlas->width) {
+            return atlas_add_shelf(atlas, h);
+        }
 
-    // init stbfont
-    int ok = stbtt_InitFont(&font->stbfont, (unsigned char *)font->data, 0);
-    if (!ok) {
-        if (font) {
-            lt_free(font->data);
+        // evict the least recently used shelf that is tall enough and not in use by the current draw
+        int lru = -1;
+        for (int i = 0; i < atlas->shelf_count; i++) {
+            GlyphShelf *sh = &atlas->shelves[i];
+            if (sh->height < h || sh->last_use == rstate->glyph_clock) continue;
+            if (lru < 0 || sh->last_use < atlas->shelves[lru].last_use) lru = i;
         }
-        lt_free(font);
+        if (lru >= 0) {
+            atlas->shelves[lru].x = 0;
+            atlas_drop_glyphs(font, lru);
+            return lru;
+        }
+
+        // nothing reusable: start over with an empty atlas
+        atlas->shelf_count = 0;
+        atlas->next_y = 0;
+        atlas_drop_glyphs(font, -1);
+    }
+    return -1;
+}
+
+static std::mutex face_mutex;
+static std::unordered_map<std::string, RenFace *> faces;
+
+// the ink extents every size of the face derives its padding from, see ren_load_font
+static void face_ink_bounds(RenFace *face) {
+    const stbtt_fontinfo *info = &face->info;
+    int x0, y0, x1, y1;
+    stbtt_GetFontBoundingBox(info, &x0, &y0, &x1, &y1);
+    face->ink_x0 = x0;
+    face->ink_y0 = y0;
+    face->ink_y1 = y1;
+    face->ink_over = 0;
+    for (int i = 0; i < info->numGlyphs; i++) {
+        int advance, lsb;
+        stbtt_GetGlyphHMetrics(info, i, &advance, &lsb);
+        if (stbtt_GetGlyphBox(info, i, &x0, &y0, &x1, &y1)) face->ink_over = NEKO_MAX(face->ink_over, x1 - advance);
+    }
+}
+
+static RenFace *ren_acquire_face(const char *filename, const std::string &key) {
+    std::lock_guard<std::mutex> lock(face_mutex);
+    auto it = faces.find(key);
+    if (it != faces.end()) {
+        it->second->refs++;
+        return it->second;
+    }
+    const void *data = lt_load_file(filename, NULL);
+    if (!data) return NULL;
+    RenFace *face = new RenFace();
+    if (!stbtt_InitFont(&face->info, (const unsigned char *)data, 0)) {
+        lt_release_file(data);
+        delete face;
         return NULL;
     }
+    face->data = data;
+    face->key = key;
+    face->refs = 1;
+    face_ink_bounds(face);
+    faces[key] = face;
+    return face;
+}
+
+static void ren_release_face(RenFace *face) {
+    std::lock_guard<std::mutex> lock(face_mutex);
+    if (--face->refs > 0) return;
+    faces.erase(face->key);
+    lt_release_file(face->data);
+    delete face;
+}
+
+static void glyph_prewarm_run(GlyphPrewarm *pw) {
+    static const int ranges[][2] = {{32, 127}, {160, 256}};  // ascii first
+    const stbtt_fontinfo *info = &pw->face->info;
+    for (auto &r : ranges) {
+        for (int cp = r[0]; cp < r[1] && !pw->cancel.load(std::memory_order_relaxed); cp++) {
+            uint8_t expected = PREWARM_FREE;
+            if (!pw->state[cp].compare_exchange_strong(expected, PREWARM_BUSY)) continue;
+            int index = stbtt_FindGlyphIndex(info, cp), x0, y0, x1, y1;
+            stbtt_GetGlyphBitmapBox(info, index, pw->scale, pw->scale, &x0, &y0, &x1, &y1);
+            int w = x1 - x0, h = y1 - y0;
+            if (w > 0 && h > 0) {
+                pw->bitmaps[cp].resize((size_t)w * h);
+                stbtt_MakeGlyphBitmap(info, pw->bitmaps[cp].data(), w, h, w, pw->scale, pw->scale, index);
+            }
+            pw->state[cp].store(PREWARM_READY, std::memory_order_release);
+        }
+    }
+}
+
+/* a single worker prewarms the new sizes one after the other. it is started by
+** the first new size and joined by lt_fini, or at exit for hosts that never call
+** it. a font cancels its job and waits for the worker to let go of it before its
+** face and glyphs go away */
+static void glyph_prewarm_stop();
+
+struct PrewarmWorker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::vector<GlyphPrewarm *> queue;
+    GlyphPrewarm *running;
+    bool quit;
+    ~PrewarmWorker() { glyph_prewarm_stop(); }
+};
+
+static PrewarmWorker prewarm_worker;
+
+static void prewarm_worker_run() {
+    PrewarmWorker *w = &prewarm_worker;
+    std::unique_lock<std::mutex> lock(w->mutex);
+    for (;;) {
+        w->wake.wait(lock, [w] { return w->quit || !w->queue.empty(); });
+        if (w->quit) return;
+        GlyphPrewarm *pw = w->queue.front();
+        w->queue.erase(w->queue.begin());
+        w->running = pw;
+        lock.unlock();
+        glyph_prewarm_run(pw);
+        lock.lock();
+        w->running = NULL;
+        w->idle.notify_all();
+    }
+}
+
+static GlyphPrewarm *glyph_prewarm_start(RenFace *face, float scale) {
+    GlyphPrewarm *pw = new GlyphPrewarm();
+    pw->face = face;
+    pw->scale = scale;
+    PrewarmWorker *w = &prewarm_worker;
+    std::lock_guard<std::mutex> lock(w->mutex);
+    if (w->quit) {
+        pw->cancel = true;  // lt_fini is stopping the worker, the glyphs are rasterized on first draw
+        return pw;
+    }
+    if (!w->thread.joinable()) w->thread = std::thread(prewarm_worker_run);
+    w->queue.push_back(pw);
+    w->wake.notify_one();
+    return pw;
+}
+
+// once this returns the worker no longer touches pw
+static void glyph_prewarm_cancel(GlyphPrewarm *pw) {
+    PrewarmWorker *w = &prewarm_worker;
+    pw->cancel = true;
+    std::unique_lock<std::mutex> lock(w->mutex);
+    w->queue.erase(std::remove(w->queue.begin(), w->queue.end(), pw), w->queue.end());
+    w->idle.wait(lock, [w, pw] { return w->running != pw; });
+}
+
+// drops the queued sizes and joins the worker, the next new size starts it again
+static void glyph_prewarm_stop() {
+    PrewarmWorker *w = &prewarm_worker;
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        for (GlyphPrewarm *pw : w->queue) pw->cancel = true;
+        w->queue.clear();
+        if (w->running) w->running->cancel = true;
+        w->quit = true;
+        thread = std::move(w->thread);
+    }
+    w->wake.notify_all();
+    if (thread.joinable()) thread.join();
+    std::lock_guard<std::mutex> lock(w->mutex);
+    w->quit = false;
+}
+
+// the staged bitmap of a latin glyph if the prewarm worker has it, NULL to rasterize it here
+static const uint8_t *glyph_prewarm_take(GlyphPrewarm *pw, int cp, const Glyph *g) {
+    if (!pw) return NULL;
+    uint8_t state = PREWARM_FREE;
+    if (pw->state[cp].compare_exchange_strong(state, PREWARM_TAKEN) || state != PREWARM_READY) return NULL;
+    const std::vector<uint8_t> &bitmap = pw->bitmaps[cp];
+    return bitmap.size() == (size_t)g->w * g->h ? bitmap.data() : NULL;
+}
+
+// makes sure the glyph bitmap is resident in the atlas
+static bool glyph_rasterize(RenFontSize *font, Glyph *g) {
+    if (g->w <= 0 || g->h <= 0) return false;
+    if (g->shelf < 0) {
+        int shelf = atlas_alloc(font, g->w, g->h);
+        if (shelf < 0) return false;
+        GlyphAtlas *atlas = &font->atlas;
+        GlyphShelf *sh = &atlas->shelves[shelf];
+        g->x = sh->x;
+        g->y = sh->y;
+        g->shelf = shelf;
+        sh->x += g->w + GLYPH_PADDING;
+        uint8_t *dst = atlas->pixels + g->x + (size_t)g->y * atlas->width;
+        const uint8_t *staged = g >= font->latin && g < font->latin + 256 ? glyph_prewarm_take(font->prewarm, (int)(g - font->latin), g) : NULL;
+        if (staged) {
+            for (int y = 0; y < g->h; y++) lt_memcpy(dst + (size_t)y * atlas->width, staged + (size_t)y * g->w, g->w);
+        } else {
+            stbtt_MakeGlyphBitmap(&font->face->info, dst, g->w, g->h, atlas->width, font->scale, font->scale, g->index);
+        }
+    }
+    font->atlas.shelves[g->shelf].last_use = rstate->glyph_clock;
+    return true;
+}
+
+// sizes are shared per context by (face, size). released sizes stay cached so that
+// zooming back and forth reuses their glyphs instead of rasterizing them again
+#define REN_FONT_CACHE_SIZE 8
+
+static RenFontSize *ren_load_size(const char *filename, float size) {
+    std::string key = lt_file_key(filename);
+    if (rstate) {
+        for (RenFontSize *f : rstate->sizes) {
+            if (f->size == size && f->face->key == key) {
+                f->refs++;
+                return f;
+            }
+        }
+    }
+
+    // the parsed face is shared with other sizes and contexts
+    RenFace *face = ren_acquire_face(filename, key);
+    if (!face) return NULL;
+
+    // init font
+    RenFontSize *font = (RenFontSize *)lt_calloc(1, sizeof(RenFontSize));
+    font->face = face;
+    font->size = size;
+    font->refs = 1;
+    font->glyphs = new std::unordered_map<unsigned, Glyph>();
 
     // get height and scale
+    const stbtt_fontinfo *info = &face->info;
     int ascent, descent, linegap;
-    stbtt_GetFontVMetrics(&font->stbfont, &ascent, &descent, &linegap);
-    float scale = stbtt_ScaleForMappingEmToPixels(&font->stbfont, size);
+    stbtt_GetFontVMetrics(info, &ascent, &descent, &linegap);
+    float scale = stbtt_ScaleForMappingEmToPixels(info, size);
     font->height = (ascent - descent + linegap) * scale + 0.5;
+    font->ascent = ascent * scale + 0.5;
 
-    // make tab and newline glyphs invisible
-    stbtt_bakedchar *g = get_glyphset(font, '\n')->glyphs;
-    g['\t'].x1 = g['\t'].x0;
-    g['\n'].x1 = g['\n'].x0;
+    // rasterization scale, same as stbtt_BakeFontBitmap used for the em-size
+    float s = stbtt_ScaleForMappingEmToPixels(info, 1) / stbtt_ScaleForPixelHeight(info, 1);
+    font->scale = stbtt_ScaleForPixelHeight(info, size * s);
+    font->prewarm = glyph_prewarm_start(face, font->scale);
 
+    // glyph boxes are rounded out to whole pixels and pen positions are floored, hence the extra pixel on the right
+    font->ink_left = NEKO_MAX(0, -(int)floor(face->ink_x0 * font->scale));
+    font->ink_right = NEKO_MAX(0, (int)ceil(face->ink_over * font->scale) + 1);
+    font->ink_top = NEKO_MAX(0, -(font->ascent + (int)floor(-face->ink_y1 * font->scale)));
+    font->ink_bottom = NEKO_MAX(0, font->ascent + (int)ceil(-face->ink_y0 * font->scale) - font->height);
+
+    get_glyph(font, '\t');
+    get_glyph(font, '\n');
+
+    if (rstate) {
+        font->owner = rstate;
+        rstate->sizes.push_back(font);
+    }
     return font;
 }
 
-void ren_free_font(RenFont *font) {
-    for (int i = 0; i < MAX_GLYPHSET; i++) {
-        GlyphSet *set = font->sets[i];
-        if (set) {
-            ren_free_image(set->image);
-            lt_free(set);
-        }
-    }
-    lt_free(font->data);
+RenFont *ren_load_font(const char *filename, float size) {
+    RenFontSize *shared = ren_load_size(filename, size);
+    if (!shared) return NULL;
+    RenFont *font = (RenFont *)lt_malloc(sizeof(RenFont));
+    font->shared = shared;
+    font->tab_width = get_glyph(shared, '\t')->xadvance;
+    return font;
+}
+
+static void text_cache_purge_font(RenFontSize *font);
+
+static void ren_destroy_size(RenFontSize *font) {
+    text_cache_purge_font(font);
+    glyph_prewarm_cancel(font->prewarm);
+    delete font->prewarm;
+    lt_free(font->atlas.pixels);
+    lt_free(font->atlas.shelves);
+    delete font->glyphs;
+    ren_release_face(font->face);
     lt_free(font);
 }
 
-void ren_set_font_tab_width(RenFont *font, int n) {
-    GlyphSet *set = get_glyphset(font, '\t');
-    set->glyphs['\t'].xadvance = n;
+// drops a reference; the size then waits in its context's size cache until it is reused or evicted
+static void ren_release_size(RenFontSize *font) {
+    if (--font->refs > 0) return;
+    RenState *owner = font->owner;
+    if (!owner) {
+        ren_destroy_size(font);
+        return;
+    }
+    font->released = ++owner->font_clock;
+    int cached = 0;
+    for (RenFontSize *f : owner->sizes) cached += f->refs == 0;
+    while (cached-- > REN_FONT_CACHE_SIZE) {
+        auto oldest = owner->sizes.end();
+        for (auto it = owner->sizes.begin(); it != owner->sizes.end(); ++it) {
+            if ((*it)->refs == 0 && (oldest == owner->sizes.end() || (*it)->released < (*oldest)->released)) oldest = it;
+        }
+        RenFontSize *f = *oldest;
+        owner->sizes.erase(oldest);
+        ren_destroy_size(f);
+    }
 }
 
-int ren_get_font_tab_width(RenFont *font) {
-    GlyphSet *set = get_glyphset(font, '\t');
-    return set->glyphs['\t'].xadvance;
+void ren_free_font(RenFont *font) {
+    ren_release_size(font->shared);
+    lt_free(font);
 }
 
+void ren_set_font_tab_width(RenFont *font, int n) { font->tab_width = n; }
+
+int ren_get_font_tab_width(RenFont *font) { return font->tab_width; }
+
 int ren_get_font_width(RenFont *font, const char *text) {
     int x = 0;
     const char *p = text;
     unsigned codepoint;
     while (*p) {
         p = utf8_to_codepoint_(p, &codepoint);
-        GlyphSet *set = get_glyphset(font, codepoint);
-        stbtt_bakedchar *g = &set->glyphs[codepoint & 0xff];
-        x += g->xadvance;
+        x += codepoint == '\t' ? font->tab_width : get_glyph(font->shared, codepoint)->xadvance;
     }
     return x;
 }
 
-int ren_get_font_height(RenFont *font) { return font->height; }
-
-static inline RenColor blend_pixel(RenColor dst, RenColor src) {
-    int ia = 0xff - src.a;
-    dst.r = ((src.r * src.a) + (dst.r * ia)) >> 8;
-    dst.g = ((src.g * src.a) + (dst.g * ia)) >> 8;
-    dst.b = ((src.b * src.a) + (dst.b * ia)) >> 8;
-    return dst;
-}
-
-static inline RenColor blend_pixel2(RenColor dst, RenColor src, RenColor color) {
-    src.a = (src.a * color.a) >> 8;
-    int ia = 0xff - src.a;
-    dst.r = ((src.r * color.r * src.a) >> 16) + ((dst.r * ia) >> 8);
-    dst.g = ((src.g * color.g * src.a) >> 16) + ((dst.g * ia) >> 8);
-    dst.b = ((src.b * color.b * src.a) >> 16) + ((dst.b * ia) >> 8);
-    return dst;
-}
-
-#define rect_draw_loop(expr)            \
-    for (int j = y1; j < y2; j++) {     \
-        for (int i = x1; i < x2; i++) { \
-            *d = expr;                  \
-            d++;                        \
-        }                               \
-        d += dr;                        \
-    }
+int ren_get_font_height(RenFont *font) { return font->shared->height; }
 
-void ren_draw_rect(RenRect rect, RenColor color) {
+static void draw_rect_clipped(const RenClip *clip, RenRect rect, RenColor color) {
     if (color.a == 0) {
         return;
     }
 
-    int x1 = rect.x < lt_clip.left ? lt_clip.left : rect.x;
-    int y1 = rect.y < lt_clip.top ? lt_clip.top : rect.y;
+    int x1 = rect.x < clip->left ? clip->left : rect.x;
+    int y1 = rect.y < clip->top ? clip->top : rect.y;
     int x2 = rect.x + rect.width;
     int y2 = rect.y + rect.height;
-    x2 = x2 > lt_clip.right ? lt_clip.right : x2;
-    y2 = y2 > lt_clip.bottom ? lt_clip.bottom : y2;
+    x2 = x2 > clip->right ? clip->right : x2;
+    y2 = y2 > clip->bottom ? clip->bottom : y2;
+    if (x2 <= x1 || y2 <= y1) {
+        return;
+    }
 
-    lt_surface *surf = lt_getsurface(lt_window());
+    lt_surface *surf = lt_current->target;
     RenColor *d = (RenColor *)surf->pixels;
     d += x1 + y1 * surf->w;
-    int dr = surf->w - (x2 - x1);
+    int n = x2 - x1;
 
     if (color.a == 0xff) {
-        rect_draw_loop(color);
+        for (int j = y1; j < y2; j++, d += surf->w) fill_span(d, n, color);
     } else {
-        rect_draw_loop(blend_pixel(*d, color));
+        for (int j = y1; j < y2; j++, d += surf->w) blend_rect_span(d, n, color);
     }
 }
 
+void ren_draw_rect(RenRect rect, RenColor color) { draw_rect_clipped(&rstate->clip, rect, color); }
+
 void ren_draw_image(RenImage *image, RenRect *sub, int x, int y, RenColor color) {
     if (color.a == 0) {
         return;
@@ -719,20 +1945,20 @@ void ren_draw_image(RenImage *image, RenRect *sub, int x, int y, RenColor color)
 
     // clip
     int n;
-    if ((n = lt_clip.left - x) > 0) {
+    if ((n = rstate->clip.left - x) > 0) {
         sub->width -= n;
         sub->x += n;
         x += n;
     }
-    if ((n = lt_clip.top - y) > 0) {
+    if ((n = rstate->clip.top - y) > 0) {
         sub->height -= n;
         sub->y += n;
         y += n;
     }
-    if ((n = x + sub->width - lt_clip.right) > 0) {
+    if ((n = x + sub->width - rstate->clip.right) > 0) {
         sub->width -= n;
     }
-    if ((n = y + sub->height - lt_clip.bottom) > 0) {
+    if ((n = y + sub->height - rstate->clip.bottom) > 0) {
         sub->height -= n;
     }
 
@@ -741,41 +1967,360 @@ void ren_draw_image(RenImage *image, RenRect *sub, int x, int y, RenColor color)
     }
 
     // draw
-    lt_surface *surf = lt_getsurface(lt_window());
+    lt_surface *surf = lt_current->target;
     RenColor *s = image->pixels;
     RenColor *d = (RenColor *)surf->pixels;
     s += sub->x + sub->y * image->width;
     d += x + y * surf->w;
-    int sr = image->width - sub->width;
-    int dr = surf->w - sub->width;
 
     for (int j = 0; j < sub->height; j++) {
-        for (int i = 0; i < sub->width; i++) {
-            *d = blend_pixel2(*d, *s, color);
-            d++;
-            s++;
-        }
-        d += dr;
-        s += sr;
+        blend_image_span(d, s, sub->width, color);
+        d += surf->w;
+        s += image->width;
     }
 }
 
-int ren_draw_text(RenFont *font, const char *text, int x, int y, RenColor color) {
-    RenRect rect;
-    const char *p = text;
-    unsigned codepoint;
-    while (*p) {
-        p = utf8_to_codepoint_(p, &codepoint);
-        GlyphSet *set = get_glyphset(font, codepoint);
-        stbtt_bakedchar *g = &set->glyphs[codepoint & 0xff];
-        rect.x = g->x0;
-        rect.y = g->y0;
-        rect.width = g->x1 - g->x0;
-        rect.height = g->y1 - g->y0;
-        ren_draw_image(set->image, &rect, x + g->xoff, y + g->yoff, color);
-        x += g->xadvance;
+static void draw_coverage_clipped(const RenClip *clip, RenFontSize *font, RenRect sub, int x, int y, RenColor color) {
+    // clip
+    int n;
+    if ((n = clip->left - x) > 0) {
+        sub.width -= n;
+        sub.x += n;
+        x += n;
     }
-    return x;
+    if ((n = clip->top - y) > 0) {
+        sub.height -= n;
+        sub.y += n;
+        y += n;
+    }
+    if ((n = x + sub.width - clip->right) > 0) {
+        sub.width -= n;
+    }
+    if ((n = y + sub.height - clip->bottom) > 0) {
+        sub.height -= n;
+    }
+
+    if (sub.width <= 0 || sub.height <= 0) {
+        return;
+    }
+
+    // draw
+    lt_surface *surf = lt_current->target;
+    const uint8_t *s = font->atlas.pixels + sub.x + (size_t)sub.y * font->atlas.width;
+    RenColor *d = (RenColor *)surf->pixels + x + y * surf->w;
+
+    for (int j = 0; j < sub.height; j++) {
+        blend_coverage_span(d, s, sub.width, color);
+        d += surf->w;
+        s += font->atlas.width;
+    }
+}
+
+/* 64 bit hash for the text cache and rencache, consumes a word at a time with
+** xxhash64 style rounds. hash_word is order dependent, so folding commands into
+** a cell one after another also captures their order */
+#define HASH_SEED 0x27d4eb2f165667c5ull
+
+static inline uint64_t hash_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t hash_word(uint64_t h, uint64_t v) {
+    h ^= hash_rotl(v * 0xc2b2ae3d27d4eb4full, 31) * 0x9e3779b185ebca87ull;
+    return hash_rotl(h, 27) * 0x9e3779b185ebca87ull + 0x85ebca77c2b2ae63ull;
+}
+
+static inline uint64_t hash_pair(uint64_t h, int a, int b) { return hash_word(h, (uint64_t)(uint32_t)a << 32 | (uint32_t)b); }
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = hash_word(h, v);
+    }
+    if (size) {
+        uint64_t v = 0;
+        memcpy(&v, p, size);
+        h = hash_word(h, v ^ (uint64_t)size << 56);
+    }
+    return h;
+}
+
+static inline uint64_t hash_final(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xc2b2ae3d27d4eb4full;
+    h ^= h >> 29;
+    h *= 0x165667b19e3779f9ull;
+    return h ^ (h >> 32);
+}
+
+/* text runs: the decoded glyphs of a string for one font and tab width. they
+** are cached by (font, tab width, text) so that the width computed by
+** rencache_draw_text and every replay of the command for each dirty rect
+** share a single utf8 decode. a run keeps its glyphs' atlas rects, which stay
+** valid until the atlas evicts something and bumps its generation */
+
+#define TEXT_RUN_CACHE_MAX 8192
+
+typedef struct {
+    const Glyph *g;
+    int dx, dy;        // glyph origin relative to the run origin
+    short x, y, w, h;  // coverage rect inside the atlas
+    short shelf;
+} RunGlyph;
+
+struct TextRun {
+    TextRun *next;
+    RenFontSize *font;
+    uint64_t hash;
+    int tab_width;
+    int len;
+    int width;
+    int count;
+    unsigned generation;  // atlas generation the glyph rects were resolved against
+    unsigned last_frame;
+    RunGlyph *glyphs;
+    char *text;
+};
+
+static uint64_t text_run_hash(RenFontSize *font, int tab_width, const char *text, int len) {
+    uint64_t h = hash_bytes(HASH_SEED, text, len);
+    h = hash_word(h, (uintptr_t)font);
+    h = hash_word(h, (uint64_t)(uint32_t)tab_width);
+    return hash_final(h);
+}
+
+static void text_cache_rehash(int size) {
+    TextRun **slots = (TextRun **)lt_calloc(size, sizeof(TextRun *));
+    for (int i = 0; i < rstate->text_cache.size; i++) {
+        for (TextRun *run = rstate->text_cache.slots[i], *next; run; run = next) {
+            next = run->next;
+            TextRun **slot = &slots[run->hash & (size - 1)];
+            run->next = *slot;
+            *slot = run;
+        }
+    }
+    lt_free(rstate->text_cache.slots);
+    rstate->text_cache.slots = slots;
+    rstate->text_cache.size = size;
+}
+
+static TextRun *text_run_build(RenFontSize *font, const char *text, int len, uint64_t hash, int tab_width) {
+    static thread_local std::vector<RunGlyph> scratch;
+    scratch.clear();
+
+    // decode once, invisible glyphs only advance the pen
+    int x = 0;
+    const char *p = text;
+    unsigned codepoint;
+    while (*p) {
+        p = utf8_to_codepoint_(p, &codepoint);
+        const Glyph *g = get_glyph(font, codepoint);
+        if (g->w > 0 && g->h > 0) {
+            RunGlyph rg = {};
+            rg.g = g;
+            rg.dx = x + g->xoff;
+            rg.dy = g->yoff;
+            scratch.push_back(rg);
+        }
+        x += codepoint == '\t' ? tab_width : g->xadvance;
+    }
+
+    int count = (int)scratch.size();
+    TextRun *run = (TextRun *)lt_malloc(sizeof(TextRun) + sizeof(RunGlyph) * count + len + 1);
+    run->next = NULL;
+    run->font = font;
+    run->hash = hash;
+    run->tab_width = tab_width;
+    run->len = len;
+    run->width = x;
+    run->count = count;
+    run->generation = ~0u;
+    run->glyphs = (RunGlyph *)(run + 1);
+    run->text = (char *)(run->glyphs + count);
+    if (count) lt_memcpy(run->glyphs, scratch.data(), sizeof(RunGlyph) * count);
+    lt_memcpy(run->text, text, len);
+    run->text[len] = '\0';
+    return run;
+}
+
+// runs are shared by the handles of a size that have the same tab width
+TextRun *ren_get_text_run(RenFont *handle, const char *text) {
+    RenFontSize *font = handle->shared;
+    int len = strlen(text);
+    int tab_width = handle->tab_width;
+    uint64_t hash = text_run_hash(font, tab_width, text, len);
+
+    if (rstate->text_cache.size) {
+        for (TextRun *run = rstate->text_cache.slots[hash & (rstate->text_cache.size - 1)]; run; run = run->next) {
+            if (run->hash == hash && run->font == font && run->tab_width == tab_width && run->len == len && !memcmp(run->text, text, len)) {
+                run->last_frame = rstate->text_cache.frame;
+                rstate->text_cache.hits++;
+                return run;
+            }
+        }
+    }
+
+    rstate->text_cache.misses++;
+    if (rstate->text_cache.count >= rstate->text_cache.size) {
+        text_cache_rehash(rstate->text_cache.size ? rstate->text_cache.size * 2 : 1024);
+    }
+    TextRun *run = text_run_build(font, text, len, hash, tab_width);
+    run->last_frame = rstate->text_cache.frame;
+    TextRun **slot = &rstate->text_cache.slots[hash & (rstate->text_cache.size - 1)];
+    run->next = *slot;
+    *slot = run;
+    rstate->text_cache.count++;
+    return run;
+}
+
+int ren_get_text_run_width(TextRun *run) { return run->width; }
+
+// the advance box of a run drawn at x, y grown by whatever its font's glyphs can overhang
+RenRect ren_get_text_run_ink(TextRun *run, int x, int y) {
+    RenFontSize *f = run->font;
+    return RenRect{x - f->ink_left, y - f->ink_top, run->width + f->ink_left + f->ink_right, f->height + f->ink_top + f->ink_bottom};
+}
+
+// resolves the atlas rects of every glyph, rasterizing as needed
+static bool text_run_prepare(TextRun *run) {
+    RenFontSize *font = run->font;
+    GlyphAtlas *atlas = &font->atlas;
+    if (run->generation == atlas->generation) {
+        for (int i = 0; i < run->count; i++) {
+            if (run->glyphs[i].w) atlas->shelves[run->glyphs[i].shelf].last_use = rstate->glyph_clock;
+        }
+        return true;
+    }
+    // an eviction while resolving invalidates the rects resolved before it, try again once
+    for (int attempt = 0; attempt < 2; attempt++) {
+        unsigned generation = atlas->generation;
+        for (int i = 0; i < run->count; i++) {
+            RunGlyph *rg = &run->glyphs[i];
+            Glyph *g = (Glyph *)rg->g;
+            if (glyph_rasterize(font, g)) {
+                rg->x = g->x, rg->y = g->y, rg->w = g->w, rg->h = g->h;
+                rg->shelf = g->shelf;
+            } else {
+                rg->w = 0;
+            }
+        }
+        if (generation == atlas->generation) {
+            run->generation = generation;
+            return true;
+        }
+    }
+    return false;
+}
+
+// draws a prepared run, only reads the atlas so it is safe to call from raster workers
+static void draw_text_run_clipped(const RenClip *clip, const TextRun *run, int x, int y, RenColor color) {
+    if (color.a == 0) {
+        return;
+    }
+    for (int i = 0; i < run->count; i++) {
+        const RunGlyph *rg = &run->glyphs[i];
+        if (rg->w) draw_coverage_clipped(clip, run->font, RenRect{rg->x, rg->y, rg->w, rg->h}, x + rg->dx, y + rg->dy, color);
+    }
+}
+
+void ren_draw_text_run(TextRun *run, int x, int y, RenColor color) {
+    if (color.a == 0) {
+        return;
+    }
+    RenFontSize *font = run->font;
+    rstate->glyph_clock++;
+    if (text_run_prepare(run)) {
+        draw_text_run_clipped(&rstate->clip, run, x, y, color);
+        return;
+    }
+    // the run does not fit in the atlas at once: rasterize and draw glyph by glyph
+    for (int i = 0; i < run->count; i++) {
+        const RunGlyph *rg = &run->glyphs[i];
+        Glyph *g = (Glyph *)rg->g;
+        if (glyph_rasterize(font, g)) draw_coverage_clipped(&rstate->clip, font, RenRect{g->x, g->y, g->w, g->h}, x + rg->dx, y + rg->dy, color);
+    }
+}
+
+// resolves the glyphs of every run drawn in a frame before the frame is replayed, returns
+// false if the atlas could not hold them all at once
+bool ren_prepare_text_runs(TextRun **runs, int count) {
+    rstate->glyph_clock++;
+    for (int i = 0; i < count; i++) {
+        if (!text_run_prepare(runs[i])) return false;
+    }
+    // a full atlas reset while preparing invalidates runs prepared before it
+    for (int i = 0; i < count; i++) {
+        if (runs[i]->generation != runs[i]->font->atlas.generation) return false;
+    }
+    return true;
+}
+
+// drops runs that were not used during the frame once the cache is over budget
+void ren_text_cache_end_frame(void) {
+    if (rstate->text_cache.count > TEXT_RUN_CACHE_MAX) {
+        for (int i = 0; i < rstate->text_cache.size; i++) {
+            for (TextRun **pp = &rstate->text_cache.slots[i]; *pp;) {
+                TextRun *run = *pp;
+                if (run->last_frame != rstate->text_cache.frame) {
+                    *pp = run->next;
+                    lt_free(run);
+                    rstate->text_cache.count--;
+                } else {
+                    pp = &run->next;
+                }
+            }
+        }
+    }
+    rstate->text_cache.frame++;
+}
+
+static void text_cache_purge_font(RenFontSize *font) {
+    if (!rstate) {
+        return;  // fonts collected after lt_fini, the runs are already gone
+    }
+    for (int i = 0; i < rstate->text_cache.size; i++) {
+        for (TextRun **pp = &rstate->text_cache.slots[i]; *pp;) {
+            TextRun *run = *pp;
+            if (run->font == font) {
+                *pp = run->next;
+                lt_free(run);
+                rstate->text_cache.count--;
+            } else {
+                pp = &run->next;
+            }
+        }
+    }
+}
+
+static void ren_free_state(RenState *state) {
+    // fonts still referenced from lua are freed when the lua_State is closed
+    for (RenFontSize *font : state->sizes) {
+        if (font->refs == 0) {
+            ren_destroy_size(font);
+        } else {
+            font->owner = NULL;
+        }
+    }
+    for (int i = 0; i < state->text_cache.size; i++) {
+        for (TextRun *run = state->text_cache.slots[i], *next; run; run = next) {
+            next = run->next;
+            lt_free(run);
+        }
+    }
+    lt_free(state->text_cache.slots);
+    delete state;
+}
+
+void ren_get_text_cache_stats(unsigned *hits, unsigned *misses, unsigned *count) {
+    *hits = rstate->text_cache.hits;
+    *misses = rstate->text_cache.misses;
+    *count = rstate->text_cache.count;
+}
+
+int ren_draw_text(RenFont *font, const char *text, int x, int y, RenColor color) {
+    TextRun *run = ren_get_text_run(font, text);
+    ren_draw_text_run(run, x, y, color);
+    return x + run->width;
 }
 
 // ----------------------------------------------------------------------------
@@ -790,573 +2335,3060 @@ static int f_load(lua_State *L) {
     if (!*self) {
         luaL_error(L, "failed to load font");
     }
-    return 1;
+    return 1;
+}
+
+static int f_set_tab_width(lua_State *L) {
+    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
+    int n = luaL_checknumber(L, 2);
+    ren_set_font_tab_width(*self, n);
+    return 0;
+}
+
+static int f_GC(lua_State *L) {
+    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
+    if (*self) {
+        rencache_free_font(*self);
+    }
+    return 0;
+}
+
+static int f_get_width(lua_State *L) {
+    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
+    const char *text = luaL_checkstring(L, 2);
+    lua_pushnumber(L, ren_get_font_width(*self, text));
+    return 1;
+}
+
+static int f_get_height(lua_State *L) {
+    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
+    lua_pushnumber(L, ren_get_font_height(*self));
+    return 1;
+}
+
+int luaopen_renderer_font(lua_State *L) {
+    static const luaL_Reg lib[] = {{"__gc", f_GC}, {"load", f_load}, {"set_tab_width", f_set_tab_width}, {"get_width", f_get_width}, {"get_height", f_get_height}, {NULL, NULL}};
+    luaL_newmetatable(L, API_TYPE_FONT);
+    luaL_setfuncs(L, lib, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+// lite/renderer_api.c
+
+static RenColor checkcolor(lua_State *L, int idx, int def) {
+    RenColor color;
+    if (lua_isnoneornil(L, idx)) {
+        return RenColor{(uint8_t)def, (uint8_t)def, (uint8_t)def, 255};
+    }
+    lua_rawgeti(L, idx, 1);
+    lua_rawgeti(L, idx, 2);
+    lua_rawgeti(L, idx, 3);
+    lua_rawgeti(L, idx, 4);
+    color.r = luaL_checknumber(L, -4);
+    color.g = luaL_checknumber(L, -3);
+    color.b = luaL_checknumber(L, -2);
+    color.a = luaL_optnumber(L, -1, 255);
+    lua_pop(L, 4);
+    return color;
+}
+
+static int f_scroll_region(lua_State *L) {
+    RenRect rect;
+    rect.x = luaL_checknumber(L, 1);
+    rect.y = luaL_checknumber(L, 2);
+    rect.width = luaL_checknumber(L, 3);
+    rect.height = luaL_checknumber(L, 4);
+    rencache_scroll_region(rect, luaL_checknumber(L, 5));
+    return 0;
+}
+
+static int f_set_cell_size(lua_State *L) {
+    rencache_set_cell_size(luaL_checknumber(L, 1));
+    return 0;
+}
+
+static int f_show_debug(lua_State *L) {
+    luaL_checkany(L, 1);
+    rencache_show_debug(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int f_get_size(lua_State *L) {
+    int w, h;
+    ren_get_size(&w, &h);
+    lua_pushnumber(L, w);
+    lua_pushnumber(L, h);
+    return 2;
+}
+
+static int f_get_text_cache_stats(lua_State *L) {
+    unsigned hits, misses, count;
+    ren_get_text_cache_stats(&hits, &misses, &count);
+    lua_pushnumber(L, hits);
+    lua_pushnumber(L, misses);
+    lua_pushnumber(L, count);
+    return 3;
+}
+
+static int f_get_stats(lua_State *L) {
+    RenCacheStats st;
+    rencache_get_stats(&st);
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, st.commands);
+    lua_setfield(L, -2, "commands");
+    lua_pushnumber(L, st.command_bytes);
+    lua_setfield(L, -2, "command_bytes");
+    lua_pushnumber(L, st.dirty_rects);
+    lua_setfield(L, -2, "dirty_rects");
+    lua_pushnumber(L, st.dirty_pixels);
+    lua_setfield(L, -2, "dirty_pixels");
+    lua_pushnumber(L, st.upload_bytes);
+    lua_setfield(L, -2, "upload_bytes");
+    lua_pushnumber(L, st.end_frame_ms);
+    lua_setfield(L, -2, "end_frame_ms");
+    return 1;
+}
+
+static int f_begin_frame(lua_State *L) {
+    lt_current->draw_start = std::chrono::steady_clock::now();
+    rencache_begin_frame();
+    return 0;
+}
+
+static int f_end_frame(lua_State *L) {
+    rencache_end_frame();
+    lt_current->tick.draw_ms += ms_since(lt_current->draw_start);
+    return 0;
+}
+
+static int f_set_clip_rect(lua_State *L) {
+    RenRect rect;
+    rect.x = luaL_checknumber(L, 1);
+    rect.y = luaL_checknumber(L, 2);
+    rect.width = luaL_checknumber(L, 3);
+    rect.height = luaL_checknumber(L, 4);
+    rencache_set_clip_rect(rect);
+    return 0;
+}
+
+static int f_draw_rect(lua_State *L) {
+    RenRect rect;
+    rect.x = luaL_checknumber(L, 1);
+    rect.y = luaL_checknumber(L, 2);
+    rect.width = luaL_checknumber(L, 3);
+    rect.height = luaL_checknumber(L, 4);
+    RenColor color = checkcolor(L, 5, 255);
+    rencache_draw_rect(rect, color);
+    return 0;
+}
+
+static int f_draw_text(lua_State *L) {
+    RenFont **font = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
+    const char *text = luaL_checkstring(L, 2);
+    int x = luaL_checknumber(L, 3);
+    int y = luaL_checknumber(L, 4);
+    RenColor color = checkcolor(L, 5, 255);
+    x = rencache_draw_text(*font, text, x, y, color);
+    lua_pushnumber(L, x);
+    return 1;
+}
+
+int luaopen_renderer(lua_State *L) {
+    static const luaL_Reg lib[] = {{"show_debug", f_show_debug},
+                                   {"set_cell_size", f_set_cell_size},
+                                   {"scroll_region", f_scroll_region},
+                                   {"get_size", f_get_size},
+                                   {"get_text_cache_stats", f_get_text_cache_stats},
+                                   {"get_stats", f_get_stats},
+                                   {"begin_frame", f_begin_frame},
+                                   {"end_frame", f_end_frame},
+                                   {"set_clip_rect", f_set_clip_rect},
+                                   {"draw_rect", f_draw_rect},
+                                   {"draw_text", f_draw_text},
+                                   {NULL, NULL}};
+    luaL_newlib(L, lib);
+    luaopen_renderer_font(L);
+    lua_setfield(L, -2, "font");
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+// lite/rencache.c
+
+/* a cache over the software renderer -- all drawing operations are stored as
+** commands when issued. At the end of the frame we write the commands to a grid
+** of hash values, take the cells that have changed since the previous frame,
+** merge them into dirty rectangles and redraw only those regions */
+
+#define CELL_SIZE_DEFAULT 32
+#define CELL_SIZE_MIN 8
+#define CELL_SIZE_MAX 256
+#define COMMAND_CHUNK_SIZE (1024 * 64)
+#define COMMAND_SHRINK_FRAMES 600
+
+enum { SET_CLIP, DRAW_TEXT, DRAW_RECT };
+
+typedef struct {
+    int type, size;
+    RenRect rect;
+    RenColor color;
+    RenFont *font;
+    TextRun *run;
+    int tab_width;
+    uint64_t hash;  // payload hash, see seal_command
+} Command;
+
+/* commands live in a chunked arena: chunks are appended as a frame needs them
+** and reused by the next frames, so command pointers stay valid for the whole
+** frame. chunks above the high-water mark of the last COMMAND_SHRINK_FRAMES
+** frames are freed */
+typedef struct CommandChunk {
+    struct CommandChunk *next;
+    int used;
+    alignas(8) char data[COMMAND_CHUNK_SIZE];
+} CommandChunk;
+
+typedef struct {
+    CommandChunk *chunk;
+    int offset;
+} CommandIter;
+
+typedef struct {
+    CommandChunk *head;
+    CommandChunk *tail;  // chunk being filled this frame
+    int chunk_count;
+    unsigned count;
+    size_t bytes;
+    size_t high_water;
+    int frames;
+} CommandArena;
+
+/* command bins: while hashing, each visible command is also appended to the
+** list of every cell it touches, along with the clip in effect. a dirty rect
+** then replays only the commands binned into its cells, in submission order */
+typedef struct {
+    Command *cmd;
+    RenRect clip, bounds;
+} BinCommand;
+
+typedef struct {
+    int cmd, next;
+} BinEntry;
+
+typedef struct {
+    std::vector<BinCommand> cmds;
+    std::vector<BinEntry> entries;
+    std::vector<int> head;
+    std::vector<int> tail;
+    std::vector<int> mark;
+    std::vector<int> list;        // command indices of each dirty rect
+    std::vector<int> list_start;  // rect i owns list[list_start[i] .. list_start[i + 1])
+} CommandBins;
+
+/* scroll regions: a view declares its rect and how far its content moved since
+** its last frame. commands clipped inside a region skip the cells and are hashed
+** into tiles anchored to the content instead, so a tile that only moved keeps
+** its hash. those tiles are shifted on the surface rather than redrawn and only
+** the tiles that changed or scrolled into view are replayed */
+#define SCROLL_REGIONS_MAX 8
+
+typedef struct ScrollRegion {
+    RenRect rect;
+    int dy;
+    int scroll;  // content y of rect's top edge
+    int row0, rows, cols;
+    std::vector<uint64_t> tiles;
+    RenRect taint;  // drawn over by commands from outside the region
+    struct ScrollRegion *prev;
+} ScrollRegion;
+
+typedef struct {
+    ScrollRegion cur[SCROLL_REGIONS_MAX];
+    ScrollRegion prev[SCROLL_REGIONS_MAX];
+    int count, prev_count;
+} ScrollRegions;
+
+// worker pool for the replay, see raster_dispatch
+#define RASTER_BAND_HEIGHT 32
+#define RASTER_MAX_WORKERS 16
+
+typedef struct {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    unsigned job;
+    int busy;
+    bool quit;
+
+    RenRect *rects;
+    int rect_count;
+    std::vector<int> bands;
+    std::atomic<int> next_band;
+    std::vector<TextRun *> runs;
+} RasterPool;
+
+// per context rencache state, see lt_makecurrent
+typedef struct RenCache {
+    // the grid covers screen_rect and is resized with it
+    int cell_size = CELL_SIZE_DEFAULT;
+    int cells_x, cells_y;
+    std::vector<uint64_t> cells_buf1;
+    std::vector<uint64_t> cells_buf2;
+    uint64_t *cells_prev;
+    uint64_t *cells;
+    std::vector<RenRect> rect_buf;
+
+    CommandArena command_arena;
+    RenCacheStats stats;
+    RenRect screen_rect;
+    bool show_debug;
+    CommandBins bins;
+    ScrollRegions regions;
+    RasterPool raster;
+} RenCache;
+
+static thread_local RenCache *rcache;
+
+#define HASH_INITIAL HASH_SEED
+
+static inline int cell_idx(int x, int y) { return x + y * rcache->cells_x; }
+
+static inline bool rects_overlap(RenRect a, RenRect b) { return b.x + b.width >= a.x && b.x <= a.x + a.width && b.y + b.height >= a.y && b.y <= a.y + a.height; }
+
+static inline bool rects_intersect(RenRect a, RenRect b) { return b.x + b.width > a.x && b.x < a.x + a.width && b.y + b.height > a.y && b.y < a.y + a.height; }
+
+static inline bool rects_equal(RenRect a, RenRect b) { return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height; }
+
+static inline bool rect_contains(RenRect a, RenRect b) { return b.x >= a.x && b.y >= a.y && b.x + b.width <= a.x + a.width && b.y + b.height <= a.y + a.height; }
+
+static RenRect intersect_rects(RenRect a, RenRect b) {
+    int x1 = NEKO_MAX(a.x, b.x);
+    int y1 = NEKO_MAX(a.y, b.y);
+    int x2 = NEKO_MIN(a.x + a.width, b.x + b.width);
+    int y2 = NEKO_MIN(a.y + a.height, b.y + b.height);
+    return RenRect{x1, y1, NEKO_MAX(0, x2 - x1), NEKO_MAX(0, y2 - y1)};
+}
+
+static RenRect merge_rects(RenRect a, RenRect b) {
+    int x1 = NEKO_MIN(a.x, b.x);
+    int y1 = NEKO_MIN(a.y, b.y);
+    int x2 = NEKO_MAX(a.x + a.width, b.x + b.width);
+    int y2 = NEKO_MAX(a.y + a.height, b.y + b.height);
+    return RenRect{x1, y1, x2 - x1, y2 - y1};
+}
+
+static Command *push_command(int type, int size) {
+    size_t alignment = 7;                    // alignof(max_align_t) - 1; //< C11 https://github.com/rxi/lite/pull/292/commits/ad1bdf56e3f212446e1c61fd45de8b94de5e2bc3
+    size = (size + alignment) & ~alignment;  //< https://github.com/rxi/lite/pull/292/commits/ad1bdf56e3f212446e1c61fd45de8b94de5e2bc3
+    CommandChunk *c = rcache->command_arena.tail;
+    if (!c || c->used + size > COMMAND_CHUNK_SIZE) {
+        CommandChunk *next = c ? c->next : rcache->command_arena.head;
+        if (!next) {
+            next = (CommandChunk *)lt_malloc(sizeof(CommandChunk));
+            next->next = NULL;
+            if (c) {
+                c->next = next;
+            } else {
+                rcache->command_arena.head = next;
+            }
+            rcache->command_arena.chunk_count++;
+        }
+        next->used = 0;
+        rcache->command_arena.tail = c = next;
+    }
+    Command *cmd = (Command *)(c->data + c->used);
+    c->used += size;
+    rcache->command_arena.count++;
+    rcache->command_arena.bytes += size;
+    lt_memset(cmd, 0, sizeof(Command));
+    cmd->type = type;
+    cmd->size = size;
+    return cmd;
+}
+
+static Command *next_command(CommandIter *it) {
+    while (it->chunk) {
+        if (it->offset < it->chunk->used) {
+            Command *cmd = (Command *)(it->chunk->data + it->offset);
+            it->offset += cmd->size;
+            return cmd;
+        }
+        if (it->chunk == rcache->command_arena.tail) {
+            break;
+        }
+        it->chunk = it->chunk->next;
+        it->offset = 0;
+    }
+    return NULL;
+}
+
+static void reset_commands() {
+    rcache->command_arena.high_water = NEKO_MAX(rcache->command_arena.high_water, rcache->command_arena.bytes);
+    if (++rcache->command_arena.frames >= COMMAND_SHRINK_FRAMES) {
+        // keep one spare chunk above what the busiest recent frame needed
+        int keep = (int)(rcache->command_arena.high_water / COMMAND_CHUNK_SIZE) + 2;
+        CommandChunk **link = &rcache->command_arena.head;
+        for (int i = 0; *link && i < keep; i++) {
+            link = &(*link)->next;
+        }
+        while (*link) {
+            CommandChunk *c = *link;
+            *link = c->next;
+            lt_free(c);
+            rcache->command_arena.chunk_count--;
+        }
+        rcache->command_arena.high_water = 0;
+        rcache->command_arena.frames = 0;
+    }
+    rcache->command_arena.tail = rcache->command_arena.head;
+    if (rcache->command_arena.tail) {
+        rcache->command_arena.tail->used = 0;
+    }
+    rcache->command_arena.count = 0;
+    rcache->command_arena.bytes = 0;
+}
+
+void rencache_get_stats(RenCacheStats *out) { *out = rcache->stats; }
+
+void rencache_show_debug(bool enable) { rcache->show_debug = enable; }
+
+void rencache_free_font(RenFont *font) { ren_free_font(font); }
+
+/* hashes everything a command draws except its vertical placement: rect.y, and
+** rect.height for rects. end_frame mixes those back in for the screen cells
+** while scroll regions take them relative to their tiles. text is covered by
+** the run, whose hash already includes the font, tab width and string */
+static void seal_command(Command *cmd) {
+    uint32_t color;
+    memcpy(&color, &cmd->color, sizeof(color));
+    uint64_t h = hash_pair(HASH_SEED, cmd->type, cmd->rect.x);
+    h = hash_pair(h, cmd->rect.width, cmd->type == DRAW_RECT ? 0 : cmd->rect.height);
+    h = hash_pair(h, color, cmd->tab_width);
+    if (cmd->run) {
+        h = hash_word(h, (uintptr_t)cmd->run);
+        h = hash_word(h, cmd->run->hash);
+    }
+    cmd->hash = h;
+}
+
+void rencache_set_clip_rect(RenRect rect) {
+    Command *cmd = push_command(SET_CLIP, sizeof(Command));
+    if (cmd) {
+        cmd->rect = intersect_rects(rect, rcache->screen_rect);
+        seal_command(cmd);
+    }
+}
+
+void rencache_draw_rect(RenRect rect, RenColor color) {
+    if (!rects_overlap(rcache->screen_rect, rect)) {
+        return;
+    }
+    Command *cmd = push_command(DRAW_RECT, sizeof(Command));
+    if (cmd) {
+        cmd->rect = rect;
+        cmd->color = color;
+        seal_command(cmd);
+    }
+}
+
+int rencache_draw_text(RenFont *font, const char *text, int x, int y, RenColor color) {
+    RenRect rect;
+    rect.x = x;
+    rect.y = y;
+    TextRun *run = ren_get_text_run(font, text);
+    rect.width = ren_get_text_run_width(run);
+    rect.height = ren_get_font_height(font);
+
+    if (rects_overlap(rcache->screen_rect, ren_get_text_run_ink(run, x, y))) {
+        Command *cmd = push_command(DRAW_TEXT, sizeof(Command));
+        if (cmd) {
+            cmd->color = color;
+            cmd->font = font;
+            cmd->run = run;
+            cmd->rect = rect;
+            cmd->tab_width = run->tab_width;
+            seal_command(cmd);
+        }
+    }
+
+    return x + rect.width;
+}
+
+void rencache_invalidate(void) {
+    if (rcache->cells_prev) {
+        lt_memset(rcache->cells_prev, 0xff, rcache->cells_buf1.size() * sizeof(uint64_t));
+    }
+    rcache->regions.prev_count = 0;
+}
+
+static void resize_cells() {
+    // one extra row and column for rects ending on the screen edge
+    rcache->cells_x = rcache->screen_rect.width / rcache->cell_size + 1;
+    rcache->cells_y = rcache->screen_rect.height / rcache->cell_size + 1;
+    size_t n = (size_t)rcache->cells_x * rcache->cells_y;
+    rcache->cells_buf1.assign(n, HASH_INITIAL);
+    rcache->cells_buf2.assign(n, HASH_INITIAL);
+    rcache->cells_prev = rcache->cells_buf1.data();
+    rcache->cells = rcache->cells_buf2.data();
+    rcache->rect_buf.reserve(n);
+    rcache->bins.head.resize(n);
+    rcache->bins.tail.resize(n);
+}
+
+void rencache_set_cell_size(int size) {
+    size = NEKO_MAX(CELL_SIZE_MIN, NEKO_MIN(size, CELL_SIZE_MAX));
+    if (size != rcache->cell_size) {
+        rcache->cell_size = size;
+        resize_cells();
+        rencache_invalidate();
+    }
+}
+
+void rencache_begin_frame(void) {
+    // reset all cells if the screen width/height has changed
+    int w, h;
+    ren_get_size(&w, &h);
+    if (rcache->screen_rect.width != w || h != rcache->screen_rect.height || !rcache->cells) {
+        rcache->screen_rect.width = w;
+        rcache->screen_rect.height = h;
+        resize_cells();
+        rencache_invalidate();
+    }
+    rcache->regions.count = 0;
+}
+
+// dy is how far the content of rect moved down since the region's last frame
+void rencache_scroll_region(RenRect rect, int dy) {
+    rect = intersect_rects(rect, rcache->screen_rect);
+    if (rect.width == 0 || rect.height == 0 || rcache->regions.count == SCROLL_REGIONS_MAX) {
+        return;
+    }
+    for (int i = 0; i < rcache->regions.count; i++) {
+        if (rects_intersect(rcache->regions.cur[i].rect, rect)) {
+            return;
+        }
+    }
+    rcache->regions.cur[rcache->regions.count].rect = rect;
+    rcache->regions.cur[rcache->regions.count].dy = dy;
+    rcache->regions.count++;
+}
+
+// the area a command can touch. rect is the advance box for text, whose glyphs may reach outside of it
+static inline RenRect command_bounds(Command *cmd) { return cmd->type == DRAW_TEXT ? ren_get_text_run_ink(cmd->run, cmd->rect.x, cmd->rect.y) : cmd->rect; }
+
+static void update_overlapping_cells(RenRect r, uint64_t h) {
+    int x1 = NEKO_MAX(r.x / rcache->cell_size, 0);
+    int y1 = NEKO_MAX(r.y / rcache->cell_size, 0);
+    int x2 = NEKO_MIN((r.x + r.width) / rcache->cell_size, rcache->cells_x - 1);
+    int y2 = NEKO_MIN((r.y + r.height) / rcache->cell_size, rcache->cells_y - 1);
+
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            int idx = cell_idx(x, y);
+            rcache->cells[idx] = hash_word(rcache->cells[idx], h);
+        }
+    }
+}
+
+static void bin_command(RenRect r, int cmd) {
+    int x1 = NEKO_MAX(r.x / rcache->cell_size, 0);
+    int y1 = NEKO_MAX(r.y / rcache->cell_size, 0);
+    int x2 = NEKO_MIN((r.x + r.width) / rcache->cell_size, rcache->cells_x - 1);
+    int y2 = NEKO_MIN((r.y + r.height) / rcache->cell_size, rcache->cells_y - 1);
+
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            int idx = cell_idx(x, y);
+            int e = (int)rcache->bins.entries.size();
+            rcache->bins.entries.push_back(BinEntry{cmd, -1});
+            if (rcache->bins.tail[idx] < 0) {
+                rcache->bins.head[idx] = e;
+            } else {
+                rcache->bins.entries[rcache->bins.tail[idx]].next = e;
+            }
+            rcache->bins.tail[idx] = e;
+        }
+    }
+}
+
+// collects the commands binned into the cells under rect, sorted back into submission order
+static void gather_rect_commands(int index, RenRect rect) {
+    size_t start = rcache->bins.list.size();
+    int x1 = NEKO_MAX(rect.x / rcache->cell_size, 0);
+    int y1 = NEKO_MAX(rect.y / rcache->cell_size, 0);
+    int x2 = NEKO_MIN((rect.x + rect.width - 1) / rcache->cell_size, rcache->cells_x - 1);
+    int y2 = NEKO_MIN((rect.y + rect.height - 1) / rcache->cell_size, rcache->cells_y - 1);
+    for (int y = y1; rect.height > 0 && y <= y2; y++) {
+        for (int x = x1; rect.width > 0 && x <= x2; x++) {
+            for (int e = rcache->bins.head[cell_idx(x, y)]; e >= 0; e = rcache->bins.entries[e].next) {
+                int c = rcache->bins.entries[e].cmd;
+                if (rcache->bins.mark[c] != index) {
+                    rcache->bins.mark[c] = index;
+                    rcache->bins.list.push_back(c);
+                }
+            }
+        }
+    }
+    std::sort(rcache->bins.list.begin() + start, rcache->bins.list.end());
+    rcache->bins.list_start[index + 1] = (int)rcache->bins.list.size();
+}
+
+/* replay. dirty rects may overlap, so for parallel replay the surface is cut
+** into horizontal bands of RASTER_BAND_HEIGHT pixels: a band is only touched
+** by the worker that took it, which replays every dirty rect crossing it in
+** order, exactly like the serial loop would. workers carry their own clip
+** instead of the global renderer clip */
+
+// replays the commands of dirty rect index that touch r, a part of that rect
+static void replay_rect(int index, RenRect r) {
+    const int *it = rcache->bins.list.data() + rcache->bins.list_start[index];
+    const int *end = rcache->bins.list.data() + rcache->bins.list_start[index + 1];
+    for (; it != end; it++) {
+        const BinCommand *bc = &rcache->bins.cmds[*it];
+        if (!rects_overlap(bc->bounds, r)) {
+            continue;
+        }
+        RenClip clip = clip_from_rect(intersect_rects(bc->clip, r));
+        Command *cmd = bc->cmd;
+        if (cmd->type == DRAW_RECT) {
+            draw_rect_clipped(&clip, cmd->rect, cmd->color);
+        } else {
+            draw_text_run_clipped(&clip, cmd->run, cmd->rect.x, cmd->rect.y, cmd->color);
+        }
+    }
+}
+
+static void replay_rect_serial(int index, RenRect r) {
+    const int *it = rcache->bins.list.data() + rcache->bins.list_start[index];
+    const int *end = rcache->bins.list.data() + rcache->bins.list_start[index + 1];
+    for (; it != end; it++) {
+        const BinCommand *bc = &rcache->bins.cmds[*it];
+        ren_set_clip_rect(intersect_rects(bc->clip, r));
+        Command *cmd = bc->cmd;
+        if (cmd->type == DRAW_RECT) {
+            ren_draw_rect(cmd->rect, cmd->color);
+        } else {
+            ren_draw_text_run(cmd->run, cmd->rect.x, cmd->rect.y, cmd->color);
+        }
+    }
+}
+
+// rasterizes every glyph of the frame up front so replay only reads the atlases
+static bool prepare_frame_text() {
+    rcache->raster.runs.clear();
+    for (const BinCommand &bc : rcache->bins.cmds) {
+        if (bc.cmd->type == DRAW_TEXT && bc.cmd->run->count > 0) {
+            rcache->raster.runs.push_back(bc.cmd->run);
+        }
+    }
+    return ren_prepare_text_runs(rcache->raster.runs.data(), (int)rcache->raster.runs.size());
+}
+
+static void raster_run_bands() {
+    int count = (int)rcache->raster.bands.size();
+    for (int i; (i = rcache->raster.next_band.fetch_add(1)) < count;) {
+        RenRect band = {0, rcache->raster.bands[i] * RASTER_BAND_HEIGHT, rcache->screen_rect.width, RASTER_BAND_HEIGHT};
+        for (int j = 0; j < rcache->raster.rect_count; j++) {
+            RenRect r = intersect_rects(rcache->raster.rects[j], band);
+            if (r.width > 0 && r.height > 0) {
+                replay_rect(j, r);
+            }
+        }
+    }
+}
+
+static void raster_worker(lt_context *ctx) {
+    lt_makecurrent(ctx);
+    unsigned seen = 0;
+    for (;;) {
+        std::unique_lock<std::mutex> lock(rcache->raster.mutex);
+        rcache->raster.wake.wait(lock, [&] { return rcache->raster.quit || rcache->raster.job != seen; });
+        if (rcache->raster.quit) {
+            return;
+        }
+        seen = rcache->raster.job;
+        lock.unlock();
+
+        raster_run_bands();
+
+        lock.lock();
+        if (--rcache->raster.busy == 0) {
+            rcache->raster.done.notify_one();
+        }
+    }
+}
+
+static void raster_dispatch() {
+    // collect the bands crossed by any dirty rect
+    rcache->raster.bands.clear();
+    int band_count = (rcache->screen_rect.height + RASTER_BAND_HEIGHT - 1) / RASTER_BAND_HEIGHT;
+    for (int b = 0; b < band_count; b++) {
+        for (int j = 0; j < rcache->raster.rect_count; j++) {
+            RenRect *r = &rcache->raster.rects[j];
+            if (r->y < (b + 1) * RASTER_BAND_HEIGHT && r->y + r->height > b * RASTER_BAND_HEIGHT) {
+                rcache->raster.bands.push_back(b);
+                break;
+            }
+        }
+    }
+    rcache->raster.next_band = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(rcache->raster.mutex);
+        rcache->raster.busy = (int)rcache->raster.threads.size();
+        rcache->raster.job++;
+    }
+    rcache->raster.wake.notify_all();
+
+    // the calling thread takes bands too
+    raster_run_bands();
+
+    std::unique_lock<std::mutex> lock(rcache->raster.mutex);
+    rcache->raster.done.wait(lock, [] { return rcache->raster.busy == 0; });
+}
+
+// count extra threads besides the caller, 0 replays on the calling thread only
+void rencache_set_workers(int count) {
+    if (count < 0) {
+        count = (int)std::thread::hardware_concurrency() - 1;
+    }
+    count = NEKO_MAX(0, NEKO_MIN(count, RASTER_MAX_WORKERS));
+    if (count == (int)rcache->raster.threads.size()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(rcache->raster.mutex);
+        rcache->raster.quit = true;
+    }
+    rcache->raster.wake.notify_all();
+    for (auto &t : rcache->raster.threads) {
+        t.join();
+    }
+    rcache->raster.threads.clear();
+    rcache->raster.quit = false;
+    rcache->raster.job = 0;
+
+    for (int i = 0; i < count; i++) {
+        rcache->raster.threads.emplace_back(raster_worker, lt_current);
+    }
+}
+
+static void rencache_free_state(RenCache *cache) {
+    for (CommandChunk *c = cache->command_arena.head, *next; c; c = next) {
+        next = c->next;
+        lt_free(c);
+    }
+    delete cache;
+}
+
+static void push_rect(RenRect r) {
+    // try to merge with existing rectangle
+    for (int i = (int)rcache->rect_buf.size() - 1; i >= 0; i--) {
+        RenRect *rp = &rcache->rect_buf[i];
+        if (rects_overlap(*rp, r)) {
+            *rp = merge_rects(*rp, r);
+            return;
+        }
+    }
+    // couldn't merge with previous rectangle: push
+    rcache->rect_buf.push_back(r);
+}
+
+static inline int floor_div(int a, int b) { return a >= 0 ? a / b : -((b - 1 - a) / b); }
+
+static ScrollRegion *region_of(RenRect clip) {
+    if (clip.width == 0 || clip.height == 0) {
+        return NULL;
+    }
+    for (int i = 0; i < rcache->regions.count; i++) {
+        if (rect_contains(rcache->regions.cur[i].rect, clip)) {
+            return &rcache->regions.cur[i];
+        }
+    }
+    return NULL;
+}
+
+static void begin_regions() {
+    for (int i = 0; i < rcache->regions.count; i++) {
+        ScrollRegion *g = &rcache->regions.cur[i];
+        g->prev = NULL;
+        for (int j = 0; j < rcache->regions.prev_count; j++) {
+            if (rects_equal(rcache->regions.prev[j].rect, g->rect)) {
+                g->prev = &rcache->regions.prev[j];
+                break;
+            }
+        }
+        g->scroll = g->prev ? g->prev->scroll - g->dy : 0;
+        g->row0 = floor_div(g->scroll, rcache->cell_size);
+        g->rows = floor_div(g->scroll + g->rect.height - 1, rcache->cell_size) - g->row0 + 1;
+        g->cols = (g->rect.width + rcache->cell_size - 1) / rcache->cell_size;
+        g->tiles.assign((size_t)g->rows * g->cols, HASH_INITIAL);
+        g->taint = RenRect{0, 0, 0, 0};
+    }
+}
+
+// hashes a command into the content tiles under r. vertical positions are taken
+// relative to each tile, and a rect only contributes the part inside the tile,
+// so a background spanning the region hashes the same wherever it is scrolled to
+static void update_region_tiles(ScrollRegion *g, Command *cmd, RenRect cr, RenRect r) {
+    uint64_t h0 = hash_pair(cmd->hash, cr.x, cr.width);
+
+    int off = g->scroll - g->rect.y;
+    int top = r.y + off, bottom = r.y + r.height + off;
+    int k1 = floor_div(top, rcache->cell_size), k2 = floor_div(bottom - 1, rcache->cell_size);
+    int c1 = (r.x - g->rect.x) / rcache->cell_size, c2 = (r.x + r.width - 1 - g->rect.x) / rcache->cell_size;
+    for (int k = k1; k <= k2; k++) {
+        int t = k * rcache->cell_size;
+        uint64_t h = hash_pair(h0, NEKO_MAX(top, t) - t, NEKO_MIN(bottom, t + rcache->cell_size) - t);
+        if (cmd->type == DRAW_TEXT) {
+            h = hash_pair(h, cmd->rect.y + off - t, 0);
+        }
+        for (int x = c1; x <= c2; x++) {
+            uint64_t *tile = &g->tiles[(k - g->row0) * g->cols + x];
+            *tile = hash_word(*tile, h);
+        }
+    }
+}
+
+// a plain rect from outside looks the same wherever it lands in a tile and is hashed
+// like the region's own commands, anything else marks the area it covers
+static void overlap_regions(Command *cmd, RenRect cr, RenRect r) {
+    for (int i = 0; i < rcache->regions.count; i++) {
+        ScrollRegion *g = &rcache->regions.cur[i];
+        RenRect t = intersect_rects(r, g->rect);
+        if (t.width == 0 || t.height == 0) {
+            continue;
+        }
+        if (cmd->type == DRAW_RECT) {
+            update_region_tiles(g, cmd, cr, t);
+        } else {
+            g->taint = g->taint.width ? merge_rects(g->taint, t) : t;
+        }
+    }
+}
+
+// pushes the tiles that have to be replayed and shifts the pixels of the ones that moved
+static void end_regions() {
+    // regions gone since the last frame are redrawn whole
+    for (int j = 0; j < rcache->regions.prev_count; j++) {
+        bool alive = false;
+        for (int i = 0; i < rcache->regions.count; i++) {
+            alive |= rcache->regions.cur[i].prev == &rcache->regions.prev[j];
+        }
+        if (!alive) {
+            push_rect(intersect_rects(rcache->regions.prev[j].rect, rcache->screen_rect));
+        }
+    }
+
+    for (int i = 0; i < rcache->regions.count; i++) {
+        ScrollRegion *g = &rcache->regions.cur[i];
+        ScrollRegion *p = g->prev;
+        if (!p) {
+            push_rect(g->rect);
+            continue;
+        }
+        int off = g->scroll - g->rect.y;
+        int prev_off = p->scroll - p->rect.y;
+        bool moved = false;
+        for (int k = g->row0; k < g->row0 + g->rows; k++) {
+            int t = k * rcache->cell_size;
+            // the visible part of a kept tile must have been visible last frame
+            bool inside = NEKO_MAX(t, g->scroll) >= NEKO_MAX(t, p->scroll) && NEKO_MIN(t + rcache->cell_size, g->scroll + g->rect.height) <= NEKO_MIN(t + rcache->cell_size, p->scroll + p->rect.height);
+            for (int x = 0; x < g->cols; x++) {
+                RenRect tile = {g->rect.x + x * rcache->cell_size, t - off, rcache->cell_size, rcache->cell_size};
+                RenRect prev_tile = {tile.x, t - prev_off, rcache->cell_size, rcache->cell_size};
+                if (inside && g->tiles[(k - g->row0) * g->cols + x] == p->tiles[(k - p->row0) * p->cols + x] && !rects_intersect(tile, g->taint) &&
+                    !rects_intersect(prev_tile, p->taint)) {
+                    moved |= g->dy != 0;
+                } else {
+                    push_rect(intersect_rects(tile, g->rect));
+                }
+            }
+        }
+        if (moved && !ren_scroll_rect(g->rect, g->dy)) {
+            push_rect(g->rect);
+        }
+    }
+
+    for (int i = 0; i < rcache->regions.count; i++) {
+        std::swap(rcache->regions.cur[i], rcache->regions.prev[i]);
+    }
+    rcache->regions.prev_count = rcache->regions.count;
+}
+
+void rencache_end_frame(void) {
+    auto start = std::chrono::steady_clock::now();
+
+    // update cells from commands and bin the drawing ones
+    rcache->bins.cmds.clear();
+    rcache->bins.entries.clear();
+    std::fill(rcache->bins.head.begin(), rcache->bins.head.end(), -1);
+    std::fill(rcache->bins.tail.begin(), rcache->bins.tail.end(), -1);
+    begin_regions();
+    CommandIter it = {rcache->command_arena.head, 0};
+    Command *cmd;
+    RenRect cr = rcache->screen_rect;
+    ScrollRegion *region = region_of(cr);
+    while ((cmd = next_command(&it))) {
+        if (cmd->type == SET_CLIP) {
+            cr = cmd->rect;
+            region = region_of(cr);
+        }
+        RenRect r = intersect_rects(command_bounds(cmd), cr);
+        if (r.width == 0 || r.height == 0) {
+            continue;
+        }
+        if (cmd->type != SET_CLIP) {
+            bin_command(r, (int)rcache->bins.cmds.size());
+            rcache->bins.cmds.push_back(BinCommand{cmd, cr, r});
+        }
+        if (region) {
+            if (cmd->type != SET_CLIP) {
+                update_region_tiles(region, cmd, cr, r);
+            }
+            continue;
+        }
+        update_overlapping_cells(r, hash_pair(cmd->hash, cmd->rect.y, cmd->rect.height));
+        if (cmd->type != SET_CLIP) {
+            overlap_regions(cmd, cr, r);
+        }
+    }
+
+    // push rects for all cells changed from last frame, reset cells
+    rcache->rect_buf.clear();
+    for (int y = 0; y < rcache->cells_y; y++) {
+        for (int x = 0; x < rcache->cells_x; x++) {
+            // compare previous and current cell for change
+            int idx = cell_idx(x, y);
+            if (rcache->cells[idx] != rcache->cells_prev[idx]) {
+                push_rect(RenRect{x, y, 1, 1});
+            }
+            rcache->cells_prev[idx] = HASH_INITIAL;
+        }
+    }
+
+    // expand rects from cells to pixels
+    for (RenRect &r : rcache->rect_buf) {
+        r.x *= rcache->cell_size;
+        r.y *= rcache->cell_size;
+        r.width *= rcache->cell_size;
+        r.height *= rcache->cell_size;
+        r = intersect_rects(r, rcache->screen_rect);
+    }
+
+    // add the tiles of scroll regions
+    end_regions();
+
+    // gather the commands of each rect
+    int rect_count = (int)rcache->rect_buf.size();
+    rcache->bins.list.clear();
+    rcache->bins.mark.assign(rcache->bins.cmds.size(), -1);
+    rcache->bins.list_start.resize(rect_count + 1);
+    rcache->bins.list_start[0] = 0;
+    for (int i = 0; i < rect_count; i++) {
+        gather_rect_commands(i, rcache->rect_buf[i]);
+    }
+
+    // redraw updated regions
+    rcache->raster.rects = rcache->rect_buf.data();
+    rcache->raster.rect_count = rect_count;
+    if (rect_count > 0 && !prepare_frame_text()) {
+        // glyphs can't all be resident at once: replay serially, rasterizing as we go
+        for (int i = 0; i < rect_count; i++) {
+            replay_rect_serial(i, rcache->rect_buf[i]);
+        }
+    } else if (rect_count > 0 && rcache->raster.threads.size() > 0) {
+        raster_dispatch();
+    } else {
+        for (int i = 0; i < rect_count; i++) {
+            replay_rect(i, rcache->rect_buf[i]);
+        }
+    }
+
+    if (rcache->show_debug) {
+        for (int i = 0; i < rect_count; i++) {
+            RenColor color = {(uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand(), 50};
+            ren_set_clip_rect(rcache->rect_buf[i]);
+            ren_draw_rect(rcache->rect_buf[i], color);
+        }
+    }
+
+    // update dirty rects
+    ren_update_rects(rcache->rect_buf.data(), rect_count);
+
+    // swap cell buffer and reset
+    uint64_t *tmp = rcache->cells;
+    rcache->cells = rcache->cells_prev;
+    rcache->cells_prev = tmp;
+    ren_text_cache_end_frame();
+
+    rcache->stats.commands = rcache->command_arena.count;
+    rcache->stats.command_bytes = rcache->command_arena.bytes;
+    rcache->stats.dirty_rects = rect_count;
+    rcache->stats.dirty_pixels = 0;
+    for (int i = 0; i < rect_count; i++) {
+        rcache->stats.dirty_pixels += (size_t)rcache->rect_buf[i].width * rcache->rect_buf[i].height;
+    }
+    rcache->stats.upload_bytes = lt_current->target->upload_bytes;
+    rcache->stats.end_frame_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    reset_commands();
+}
+
+// ----------------------------------------------------------------------------
+// lite/system.c
+
+static int f_set_cursor(lua_State *L) {
+    static const char *cursor_opts[] = {"arrow", "ibeam", "sizeh", "sizev", "hand", NULL};
+    int n = luaL_checkoption(L, 1, "arrow", cursor_opts);
+    lt_setcursor(n);
+    return 0;
+}
+
+static int f_set_window_title(lua_State *L) {
+    const char *title = luaL_checkstring(L, 1);
+    lt_setwindowtitle(title);
+    return 0;
+}
+static int f_set_window_mode(lua_State *L) {
+    static const char *window_opts[] = {"normal", "maximized", "fullscreen", 0};
+    enum { WIN_NORMAL, WIN_MAXIMIZED, WIN_FULLSCREEN };
+    int n = luaL_checkoption(L, 1, "normal", window_opts);
+    lt_setwindowmode(n);
+    return 0;
+}
+static int f_window_has_focus(lua_State *L) {
+    unsigned flags = lt_haswindowfocus();
+    lua_pushboolean(L, flags);
+    return 1;
+}
+
+static int f_show_confirm_dialog(lua_State *L) {
+    const char *title = luaL_checkstring(L, 1);
+    const char *msg = luaL_checkstring(L, 2);
+    int id = lt_prompt(msg, title);  // 0:no, 1:yes
+    lua_pushboolean(L, !!id);
+    return 1;
+}
+
+static int f_chdir(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    int err = neko_os_chdir(path);
+    if (err) {
+        luaL_error(L, "chdir() failed");
+    }
+    return 0;
+}
+static int f_list_dir(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    lua_newtable(L);
+    lt_globpath(L, path);
+    return 1;
+}
+static int f_absolute_path(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    char *res = lt_realpath(path, NULL);
+    if (!res) {
+        return 0;
+    }
+    lua_pushstring(L, res);
+    lt_realpath_free(res);
+    return 1;
+}
+static int f_get_file_info(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+
+    struct stat s;
+    int err = stat(path, &s);
+    if (err < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_newtable(L);
+    lua_pushnumber(L, s.st_mtime);
+    lua_setfield(L, -2, "modified");
+
+    lua_pushnumber(L, s.st_size);
+    lua_setfield(L, -2, "size");
+
+    if (S_ISREG(s.st_mode)) {
+        lua_pushstring(L, "file");
+    } else if (S_ISDIR(s.st_mode)) {
+        lua_pushstring(L, "dir");
+    } else {
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "type");
+
+    return 1;
+}
+
+/* system.scan_dir(path [, options]) -> { { filename, type, size, modified }, ... } | nil, err
+** one pass over the directory with the metadata of each entry, so callers no longer
+** list names and then stat them one by one. directories come first, each followed by
+** its contents when recursive, then files; both sorted by name. options:
+**   ignore      pattern or list of patterns, entries whose name matches are skipped
+**   size_limit  entries of this many bytes or more are skipped
+**   max_files   entries kept per directory, counted in listing order
+**   recursive   also list subdirectories, filenames are then relative to path
+**   max_depth   levels listed when recursive, 0 for no limit */
+#ifdef NEKO_IS_WIN32
+#define SCAN_PATHSEP '\\'
+#else
+#define SCAN_PATHSEP '/'
+#endif
+
+typedef struct ScanEntry {
+    std::string name;
+    bool dir;
+    bool link;  // windows: a reparse point, not followed when recursive
+    double size, modified;
+    uint64_t dev, ino;  // posix: identifies directories reached again through links
+} ScanEntry;
+
+typedef struct ScanOptions {
+    std::vector<std::string> ignore;
+    double size_limit;
+    size_t max_files;
+    bool recursive;
+    int max_depth;
+    std::string error;  // a malformed ignore pattern, raised once the scan has closed its handles
+} ScanOptions;
+
+static ptrdiff_t search_pattern(const char *text, size_t len, const char *p, size_t plen);
+static const char *lpat_last_error();
+
+// patterns are matched without the lua state: a malformed one must not longjmp out past an open directory
+static bool scan_ignored(ScanOptions *opt, const char *name, size_t len) {
+    for (const std::string &p : opt->ignore) {
+        ptrdiff_t at = search_pattern(name, len, p.data(), p.size());
+        if (at == -2) opt->error = "bad ignore pattern '" + p + "': " + lpat_last_error();
+        if (at != -1) return true;
+    }
+    return false;
+}
+
+// entries of one directory, unsorted; false if it cannot be opened or an ignore pattern is malformed
+static bool scan_read_dir(const std::string &path, ScanOptions *opt, std::vector<ScanEntry> &out) {
+#ifdef NEKO_IS_WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE find = FindFirstFileExA((path + "\\*").c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (find == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        errno = (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND) ? ENOENT : EACCES;
+        return false;
+    }
+    do {
+        const char *name = fd.cFileName;
+        if (!strcmp(name, ".") || !strcmp(name, "..") || scan_ignored(opt, name, strlen(name))) continue;
+        ScanEntry e = {};
+        e.dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        e.link = (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+        e.size = e.dir ? 0 : (double)(((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow);
+        // FILETIME 是 1601 年起的 100ns 数
+        uint64_t t = ((uint64_t)fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime;
+        e.modified = (double)((t - 116444736000000000ULL) / 10000000ULL);
+        if (e.size >= opt->size_limit) continue;
+        e.name = name;
+        out.push_back(std::move(e));
+    } while (out.size() < opt->max_files && opt->error.empty() && FindNextFileA(find, &fd));
+    FindClose(find);
+#else
+    DIR *dir = opendir(path.c_str());
+    if (!dir) return false;
+    int dfd = dirfd(dir);
+    struct dirent *ent;
+    while (out.size() < opt->max_files && opt->error.empty() && (ent = readdir(dir))) {
+        const char *name = ent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") || scan_ignored(opt, name, strlen(name))) continue;
+        struct stat st;
+        if (fstatat(dfd, name, &st, 0) < 0) continue;  // 断开的链接之类
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) continue;
+        if ((double)st.st_size >= opt->size_limit) continue;
+        ScanEntry e = {};
+        e.name = name;
+        e.dir = S_ISDIR(st.st_mode);
+        e.size = (double)st.st_size;
+        e.modified = (double)st.st_mtime;
+        e.dev = (uint64_t)st.st_dev;
+        e.ino = (uint64_t)st.st_ino;
+        out.push_back(std::move(e));
+    }
+    closedir(dir);
+#endif
+    return opt->error.empty();
+}
+
+static void scan_push(lua_State *L, const ScanEntry &e, const std::string &filename, lua_Integer *n) {
+    lua_createtable(L, 0, 4);
+    lua_pushlstring(L, filename.data(), filename.size());
+    lua_setfield(L, -2, "filename");
+    lua_pushstring(L, e.dir ? "dir" : "file");
+    lua_setfield(L, -2, "type");
+    lua_pushnumber(L, e.size);
+    lua_setfield(L, -2, "size");
+    lua_pushnumber(L, e.modified);
+    lua_setfield(L, -2, "modified");
+    lua_rawseti(L, -2, ++*n);
+}
+
+// appends the entries of path (and below, when recursive) to the table on top of the stack.
+// parents holds the directories being listed, so a link back up is not followed
+static bool scan_dir(lua_State *L, const std::string &path, const std::string &prefix, int depth, ScanOptions *opt, std::vector<const ScanEntry *> &parents, lua_Integer *n) {
+    std::vector<ScanEntry> entries;
+    if (!scan_read_dir(path, opt, entries)) return false;
+    std::stable_partition(entries.begin(), entries.end(), [](const ScanEntry &e) { return e.dir; });
+    auto files = std::find_if(entries.begin(), entries.end(), [](const ScanEntry &e) { return !e.dir; });
+    auto by_name = [](const ScanEntry &a, const ScanEntry &b) { return a.name < b.name; };
+    std::sort(entries.begin(), files, by_name);
+    std::sort(files, entries.end(), by_name);
+
+    bool descend = opt->recursive && (opt->max_depth <= 0 || depth + 1 < opt->max_depth);
+    for (const ScanEntry &e : entries) {
+        std::string filename = prefix + e.name;
+        scan_push(L, e, filename, n);
+        if (!e.dir || !descend || e.link) continue;
+        bool loop = false;
+        for (const ScanEntry *p : parents) loop = loop || (e.ino && p->dev == e.dev && p->ino == e.ino);
+        if (loop) continue;
+        parents.push_back(&e);
+        // a subdirectory that can't be opened is left out, a bad pattern ends the scan
+        bool ok = scan_dir(L, path + SCAN_PATHSEP + e.name, filename + SCAN_PATHSEP, depth + 1, opt, parents, n);
+        parents.pop_back();
+        if (!ok && !opt->error.empty()) return false;
+    }
+    return true;
+}
+
+static int f_scan_dir(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    // options are checked before anything lives on the c++ side, a lua error raised
+    // while the scan holds its vectors would longjmp past their destructors
+    lua_settop(L, 2);
+    lua_Number size_limit = HUGE_VAL;
+    lua_Integer max_files = 0, max_depth = 0;
+    bool recursive = false;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "size_limit");
+        size_limit = luaL_optnumber(L, -1, HUGE_VAL);
+        lua_getfield(L, 2, "max_files");
+        max_files = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 2, "recursive");
+        recursive = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "max_depth");
+        max_depth = luaL_optinteger(L, -1, 0);
+        lua_pop(L, 4);
+        lua_getfield(L, 2, "ignore");
+        if (lua_istable(L, -1)) {
+            for (lua_Integer i = 1, len = (lua_Integer)lua_rawlen(L, -1); i <= len; i++) {
+                lua_rawgeti(L, -1, i);
+                luaL_checkstring(L, -1);
+                lua_pop(L, 1);
+            }
+        }
+    } else {
+        lua_pushnil(L);
+    }
+    lua_newtable(L);
+
+    bool ok, bad_pattern;
+    {
+        ScanOptions opt;
+        opt.size_limit = size_limit;
+        opt.max_files = max_files > 0 ? (size_t)max_files : SIZE_MAX;
+        opt.recursive = recursive;
+        opt.max_depth = (int)max_depth;
+        if (lua_isstring(L, 3)) {
+            opt.ignore.emplace_back(lua_tostring(L, 3));
+        } else if (lua_istable(L, 3)) {
+            for (lua_Integer i = 1, len = (lua_Integer)lua_rawlen(L, 3); i <= len; i++) {
+                lua_rawgeti(L, 3, i);
+                opt.ignore.emplace_back(lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+        lua_Integer n = 0;
+        std::vector<const ScanEntry *> parents;
+        ok = scan_dir(L, path, "", 0, &opt, parents, &n);
+        bad_pattern = !opt.error.empty();
+        if (bad_pattern) {
+            luaL_where(L, 1);
+            lua_pushstring(L, opt.error.c_str());
+            lua_concat(L, 2);
+        } else if (!ok) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+        }
+    }
+    // every handle is closed and every vector freed by now
+    if (bad_pattern) return lua_error(L);
+    return ok ? 1 : 2;
+}
+
+static int f_get_clipboard(lua_State *L) {
+    const char *text = lt_getclipboard(lt_window());
+    if (!text) {
+        return 0;
+    }
+    lua_pushstring(L, text);
+    return 1;
+}
+static int f_set_clipboard(lua_State *L) {
+    const char *text = luaL_checkstring(L, 1);
+    lt_setclipboard(lt_window(), text);
+    return 0;
+}
+
+static int f_get_time(lua_State *L) {
+    double ss = lt_time_ms() / 1000.0;
+    lua_pushnumber(L, ss);
+    return 1;
+}
+static int f_sleep(lua_State *L) {
+    double ss = luaL_checknumber(L, 1);
+    lt_sleep_ms(ss * 1000);
+    return 0;
+}
+
+static int f_exec(lua_State *L) {
+    size_t len;
+    const char *cmd = luaL_checklstring(L, 1, &len);
+    char *buf = (char *)lt_malloc(len + 32);
+    if (!buf) {
+        luaL_error(L, "buffer allocation failed");
+    }
+#if _WIN32
+    sprintf(buf, "cmd /c \"%s\"", cmd);
+    WinExec(buf, SW_HIDE);
+#else
+    sprintf(buf, "%s &", cmd);
+    int res = system(buf);
+#endif
+    lt_free(buf);
+    return 0;
+}
+
+static int f_fuzzy_match(lua_State *L) {
+    const char *str = luaL_checkstring(L, 1);
+    const char *ptn = luaL_checkstring(L, 2);
+    int score = 0;
+    int run = 0;
+
+    while (*str && *ptn) {
+        while (*str == ' ') {
+            str++;
+        }
+        while (*ptn == ' ') {
+            ptn++;
+        }
+        if (tolower(*str) == tolower(*ptn)) {
+            score += run * 10 - (*str != *ptn);
+            run++;
+            ptn++;
+        } else {
+            score -= 10;
+            run = 0;
+        }
+        str++;
+    }
+    if (*ptn) {
+        return 0;
+    }
+
+    lua_pushnumber(L, score - (int)strlen(str));
+    return 1;
+}
+
+static int f_poll_event(lua_State *L) {
+    auto start = std::chrono::steady_clock::now();
+    int rc = lt_poll_event(L);
+    lt_current->tick.poll_ms += ms_since(start);
+    return rc;
+}
+
+static int f_poll_events(lua_State *L) {  // init.lua > core.step() 每帧一次取完所有事件
+    luaL_checktype(L, 1, LUA_TTABLE);
+    auto start = std::chrono::steady_clock::now();
+    lua_pushinteger(L, lt_poll_events(L, 1));
+    lt_current->tick.poll_ms += ms_since(start);
+    return 1;
+}
+
+int luaopen_system(lua_State *L) {
+    static const luaL_Reg lib[] = {{"poll_event", f_poll_event},
+                                   {"poll_events", f_poll_events},
+                                   {"set_cursor", f_set_cursor},
+                                   {"set_window_title", f_set_window_title},
+                                   {"set_window_mode", f_set_window_mode},
+                                   {"window_has_focus", f_window_has_focus},
+                                   {"show_confirm_dialog", f_show_confirm_dialog},
+                                   {"chdir", f_chdir},
+                                   {"list_dir", f_list_dir},
+                                   {"absolute_path", f_absolute_path},
+                                   {"get_file_info", f_get_file_info},
+                                   {"scan_dir", f_scan_dir},
+                                   {"get_clipboard", f_get_clipboard},
+                                   {"set_clipboard", f_set_clipboard},
+                                   {"get_time", f_get_time},
+                                   {"sleep", f_sleep},
+                                   {"exec", f_exec},
+                                   {"fuzzy_match", f_fuzzy_match},
+                                   {NULL, NULL}};
+    luaL_newlib(L, lib);
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+// lite/lexer.c
+
+/* lua pattern matching, ported from lstrlib.c (lua 5.4) so syntax patterns can
+** be matched without building a "^" .. pattern string per attempt */
+
+#define LPAT_MAXCAPTURES 32
+#define LPAT_MAXCCALLS 200
+#define LPAT_ESC '%'
+#define LPAT_SPECIALS "^$*+?.([%-"
+#define LPAT_CAP_UNFINISHED (-1)
+#define LPAT_CAP_POSITION (-2)
+
+typedef struct {
+    const char *src_init;
+    const char *src_end;
+    const char *p_end;
+    lua_State *L;     // NULL on search threads, errors jump to bail instead
+    jmp_buf *bail;
+    int matchdepth;
+    unsigned char level;
+    struct {
+        const char *init;
+        ptrdiff_t len;
+    } capture[LPAT_MAXCAPTURES];
+} LPatState;
+
+static const char *lpat_match(LPatState *ms, const char *s, const char *p);
+
+static thread_local char lpat_errmsg[128];
+
+// the message of the last malformed pattern matched without a lua state
+static const char *lpat_last_error() { return lpat_errmsg; }
+
+static int lpat_error(LPatState *ms, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (!ms->L) {
+        vsnprintf(lpat_errmsg, sizeof(lpat_errmsg), fmt, ap);
+        va_end(ap);
+        longjmp(*ms->bail, 1);
+    }
+    luaL_where(ms->L, 1);
+    lua_pushvfstring(ms->L, fmt, ap);
+    va_end(ap);
+    lua_concat(ms->L, 2);
+    return lua_error(ms->L);
+}
+
+static int lpat_check_capture(LPatState *ms, int l) {
+    l -= '1';
+    if (l < 0 || l >= ms->level || ms->capture[l].len == LPAT_CAP_UNFINISHED) return lpat_error(ms, "invalid capture index %%%d", l + 1);
+    return l;
+}
+
+static int lpat_capture_to_close(LPatState *ms) {
+    int level = ms->level;
+    for (level--; level >= 0; level--)
+        if (ms->capture[level].len == LPAT_CAP_UNFINISHED) return level;
+    return lpat_error(ms, "invalid pattern capture");
+}
+
+static const char *lpat_class_end(LPatState *ms, const char *p) {
+    switch (*p++) {
+        case LPAT_ESC:
+            if (p == ms->p_end) lpat_error(ms, "malformed pattern (ends with '%%')");
+            return p + 1;
+        case '[':
+            if (*p == '^') p++;
+            do {  // look for a ']'
+                if (p == ms->p_end) lpat_error(ms, "malformed pattern (missing ']')");
+                if (*(p++) == LPAT_ESC && p < ms->p_end) p++;  // skip escapes (e.g. '%]')
+            } while (*p != ']');
+            return p + 1;
+        default:
+            return p;
+    }
+}
+
+static int lpat_match_class(int c, int cl) {
+    int res;
+    switch (tolower(cl)) {
+        case 'a': res = isalpha(c); break;
+        case 'c': res = iscntrl(c); break;
+        case 'd': res = isdigit(c); break;
+        case 'g': res = isgraph(c); break;
+        case 'l': res = islower(c); break;
+        case 'p': res = ispunct(c); break;
+        case 's': res = isspace(c); break;
+        case 'u': res = isupper(c); break;
+        case 'w': res = isalnum(c); break;
+        case 'x': res = isxdigit(c); break;
+        default: return cl == c;
+    }
+    if (isupper(cl)) res = !res;
+    return res;
+}
+
+static int lpat_match_bracket_class(int c, const char *p, const char *ec) {
+    int sig = 1;
+    if (*(p + 1) == '^') {
+        sig = 0;
+        p++;  // skip the '^'
+    }
+    while (++p < ec) {
+        if (*p == LPAT_ESC) {
+            p++;
+            if (lpat_match_class(c, (unsigned char)*p)) return sig;
+        } else if (*(p + 1) == '-' && p + 2 < ec) {
+            p += 2;
+            if ((unsigned char)*(p - 2) <= c && c <= (unsigned char)*p) return sig;
+        } else if ((unsigned char)*p == c) {
+            return sig;
+        }
+    }
+    return !sig;
+}
+
+// does byte c match the single item [p, ep)
+static int lpat_item_matches(int c, const char *p, const char *ep) {
+    switch (*p) {
+        case '.': return 1;
+        case LPAT_ESC: return lpat_match_class(c, (unsigned char)*(p + 1));
+        case '[': return lpat_match_bracket_class(c, p, ep - 1);
+        default: return (unsigned char)*p == c;
+    }
+}
+
+static int lpat_single_match(LPatState *ms, const char *s, const char *p, const char *ep) {
+    return s < ms->src_end && lpat_item_matches((unsigned char)*s, p, ep);
+}
+
+static const char *lpat_match_balance(LPatState *ms, const char *s, const char *p) {
+    if (p >= ms->p_end - 1) lpat_error(ms, "malformed pattern (missing arguments to '%%b')");
+    if (s >= ms->src_end || *s != *p) return NULL;
+    int b = *p, e = *(p + 1), cont = 1;
+    while (++s < ms->src_end) {
+        if (*s == e) {
+            if (--cont == 0) return s + 1;
+        } else if (*s == b) {
+            cont++;
+        }
+    }
+    return NULL;  // string ends out of balance
+}
+
+static const char *lpat_max_expand(LPatState *ms, const char *s, const char *p, const char *ep) {
+    ptrdiff_t i = 0;
+    while (lpat_single_match(ms, s + i, p, ep)) i++;
+    // keeps trying to match with the maximum repetitions
+    while (i >= 0) {
+        const char *res = lpat_match(ms, s + i, ep + 1);
+        if (res) return res;
+        i--;
+    }
+    return NULL;
+}
+
+static const char *lpat_min_expand(LPatState *ms, const char *s, const char *p, const char *ep) {
+    for (;;) {
+        const char *res = lpat_match(ms, s, ep + 1);
+        if (res != NULL) return res;
+        if (!lpat_single_match(ms, s, p, ep)) return NULL;
+        s++;  // try with one more repetition
+    }
+}
+
+static const char *lpat_start_capture(LPatState *ms, const char *s, const char *p, int what) {
+    int level = ms->level;
+    if (level >= LPAT_MAXCAPTURES) lpat_error(ms, "too many captures");
+    ms->capture[level].init = s;
+    ms->capture[level].len = what;
+    ms->level = level + 1;
+    const char *res = lpat_match(ms, s, p);
+    if (res == NULL) ms->level--;  // undo capture
+    return res;
+}
+
+static const char *lpat_end_capture(LPatState *ms, const char *s, const char *p) {
+    int l = lpat_capture_to_close(ms);
+    ms->capture[l].len = s - ms->capture[l].init;  // close capture
+    const char *res = lpat_match(ms, s, p);
+    if (res == NULL) ms->capture[l].len = LPAT_CAP_UNFINISHED;  // undo capture
+    return res;
+}
+
+static const char *lpat_match_capture(LPatState *ms, const char *s, int l) {
+    l = lpat_check_capture(ms, l);
+    size_t len = ms->capture[l].len;
+    if ((size_t)(ms->src_end - s) >= len && memcmp(ms->capture[l].init, s, len) == 0) return s + len;
+    return NULL;
+}
+
+static const char *lpat_match(LPatState *ms, const char *s, const char *p) {
+    if (ms->matchdepth-- == 0) lpat_error(ms, "pattern too complex");
+init:  // using goto's to optimize tail recursion
+    if (p != ms->p_end) {
+        switch (*p) {
+            case '(':  // start capture
+                if (*(p + 1) == ')')
+                    s = lpat_start_capture(ms, s, p + 2, LPAT_CAP_POSITION);
+                else
+                    s = lpat_start_capture(ms, s, p + 1, LPAT_CAP_UNFINISHED);
+                break;
+            case ')':  // end capture
+                s = lpat_end_capture(ms, s, p + 1);
+                break;
+            case '$':
+                if (p + 1 != ms->p_end) goto dflt;  // not the last char of the pattern
+                s = (s == ms->src_end) ? s : NULL;
+                break;
+            case LPAT_ESC:
+                switch (*(p + 1)) {
+                    case 'b':  // balanced string
+                        s = lpat_match_balance(ms, s, p + 2);
+                        if (s != NULL) {
+                            p += 4;
+                            goto init;
+                        }
+                        break;
+                    case 'f': {  // frontier
+                        p += 2;
+                        if (*p != '[') lpat_error(ms, "missing '[' after '%%f' in pattern");
+                        const char *ep = lpat_class_end(ms, p);
+                        int previous = (s == ms->src_init) ? '\0' : (unsigned char)*(s - 1);
+                        int current = (s < ms->src_end) ? (unsigned char)*s : '\0';
+                        if (!lpat_match_bracket_class(previous, p, ep - 1) && lpat_match_bracket_class(current, p, ep - 1)) {
+                            p = ep;
+                            goto init;
+                        }
+                        s = NULL;
+                        break;
+                    }
+                    case '0': case '1': case '2': case '3': case '4':
+                    case '5': case '6': case '7': case '8': case '9':  // capture results (%0-%9)
+                        s = lpat_match_capture(ms, s, (unsigned char)*(p + 1));
+                        if (s != NULL) {
+                            p += 2;
+                            goto init;
+                        }
+                        break;
+                    default:
+                        goto dflt;
+                }
+                break;
+            default:
+            dflt: {  // pattern class plus optional suffix
+                const char *ep = lpat_class_end(ms, p);
+                if (!lpat_single_match(ms, s, p, ep)) {
+                    if (*ep == '*' || *ep == '?' || *ep == '-') {  // accept empty
+                        p = ep + 1;
+                        goto init;
+                    }
+                    s = NULL;  // '+' or no suffix
+                } else {
+                    switch (*ep) {
+                        case '?': {
+                            const char *res = lpat_match(ms, s + 1, ep + 1);
+                            if (res != NULL) {
+                                s = res;
+                            } else {
+                                p = ep + 1;
+                                goto init;
+                            }
+                            break;
+                        }
+                        case '+':
+                            s++;  // 1 match already done
+                            // fallthrough
+                        case '*':
+                            s = lpat_max_expand(ms, s, p, ep);
+                            break;
+                        case '-':
+                            s = lpat_min_expand(ms, s, p, ep);
+                            break;
+                        default:
+                            s++;
+                            p = ep;
+                            goto init;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    ms->matchdepth++;
+    return s;
+}
+
+static bool lpat_has_specials(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (p[i] && strchr(LPAT_SPECIALS, p[i])) return true;
+    return false;
+}
+
+// end of the match of p anchored at text + i, or -1
+static ptrdiff_t lpat_match_at(lua_State *L, const char *text, size_t len, size_t i, const char *p, size_t plen) {
+    LPatState ms;
+    ms.src_init = text;
+    ms.src_end = text + len;
+    ms.p_end = p + plen;
+    ms.L = L;
+    ms.bail = NULL;
+    ms.matchdepth = LPAT_MAXCCALLS;
+    ms.level = 0;
+    const char *e = lpat_match(&ms, text + i, p);
+    return e ? e - text : -1;
+}
+
+// string.find(text, p, i + 1) with 0-based results, false if there is no match
+static bool lpat_find(lua_State *L, const char *text, size_t len, size_t i, const char *p, size_t plen, bool plain, size_t *s, size_t *e) {
+    if (i > len) return false;
+    if (plain) {
+        if (plen == 0) return *s = *e = i, true;
+        for (const char *at = text + i; (size_t)(text + len - at) >= plen; at++) {
+            at = (const char *)memchr(at, p[0], text + len - at - plen + 1);
+            if (!at) break;
+            if (memcmp(at + 1, p + 1, plen - 1) == 0) return *s = at - text, *e = at - text + plen, true;
+        }
+        return false;
+    }
+    bool anchor = plen > 0 && *p == '^';
+    if (anchor) p++, plen--;
+    do {
+        ptrdiff_t end = lpat_match_at(L, text, len, i, p, plen);
+        if (end >= 0) return *s = i, *e = end, true;
+    } while (i++ < len && !anchor);
+    return false;
+}
+
+// bytes an anchored match of p can start with, false when it may match empty or is not simple enough to tell
+static bool lpat_first_bytes(const char *p, size_t plen, bool set[256]) {
+    const char *pe = p + plen;
+    while (p < pe && *p == '(') p += (p + 1 < pe && p[1] == ')') ? 2 : 1;
+    if (p == pe || *p == ')' || *p == '$') return false;
+    const char *ep = p + 1;
+    if (*p == LPAT_ESC) {
+        if (p + 1 == pe) return false;
+        if (p[1] == 'b') {
+            if (p + 2 >= pe) return false;
+            memset(set, 0, 256);
+            set[(unsigned char)p[2]] = true;
+            return true;
+        }
+        if (p[1] == 'f' || isdigit((unsigned char)p[1])) return false;
+        ep = p + 2;
+    } else if (*p == '[') {
+        ep = p + 1;
+        if (ep < pe && *ep == '^') ep++;
+        do {
+            if (ep >= pe) return false;
+            if (*(ep++) == LPAT_ESC && ep < pe) ep++;
+        } while (ep < pe && *ep != ']');
+        if (ep >= pe) return false;
+        ep++;
+    }
+    if (ep < pe && (*ep == '*' || *ep == '?' || *ep == '-')) return false;
+    for (int c = 0; c < 256; c++) set[c] = lpat_item_matches(c, p, ep);
+    return true;
+}
+
+/* a syntax compiled for the tokenizer: patterns keep their order, each byte has the list of
+** patterns whose match could start with it so most positions try a handful instead of all */
+
+typedef struct {
+    std::string start, end;  // end 为空时不是起止对
+    bool pair;
+    bool plain_end;
+    int esc;  // 转义字符 没有时 -1
+    int type;
+} LexPattern;
+
+typedef struct {
+    std::vector<LexPattern> patterns;
+    std::vector<std::pair<std::string, int>> symbol_names;
+    std::unordered_map<std::string_view, int> symbols;  // 指向 symbol_names
+    std::vector<int> candidates;                        // 按首字节分组的 pattern 下标
+    int candidates_at[257];
+    int types_ref;  // lua 数组 type id -> 名字
+    int normal;
+} LexSyntax;
+
+typedef struct {
+    int type;
+    size_t end;
+    bool blank;  // 文本全是空白
+} LexSpan;
+
+static int lex_intern_type(lua_State *L, int types, std::unordered_map<std::string, int> &ids, const char *name) {
+    auto it = ids.find(name);
+    if (it != ids.end()) return it->second;
+    int id = (int)ids.size() + 1;
+    ids.emplace(name, id);
+    lua_pushstring(L, name);
+    lua_rawseti(L, types, id);
+    return id;
+}
+
+static void lex_check_string(lua_State *L, int idx, int i, const char *field) {
+    if (!lua_isstring(L, idx)) luaL_error(L, "syntax pattern %d: %s is %s, not a string", i, field, luaL_typename(L, idx));
+}
+
+// 编译前先用 lua api 把 syntax 表整个检查一遍, 报错时还没有要析构的 C++ 对象
+static void lex_check_syntax(lua_State *L, int syntax) {
+    if (lua_getfield(L, syntax, "patterns") != LUA_TTABLE) luaL_error(L, "syntax has no patterns table");
+    int n = (int)lua_rawlen(L, -1);
+    for (int i = 1; i <= n; i++) {
+        if (lua_rawgeti(L, -1, i) != LUA_TTABLE) luaL_error(L, "syntax pattern %d is not a table", i);
+        lua_getfield(L, -1, "type");
+        lex_check_string(L, -1, i, "type");
+        if (lua_getfield(L, -2, "pattern") == LUA_TTABLE) {
+            lua_rawgeti(L, -1, 1);
+            lex_check_string(L, -1, i, "pattern[1]");
+            lua_rawgeti(L, -2, 2);
+            lex_check_string(L, -1, i, "pattern[2]");
+            if (lua_rawgeti(L, -3, 3) != LUA_TNIL) lex_check_string(L, -1, i, "pattern[3]");
+            lua_pop(L, 3);
+        } else {
+            lex_check_string(L, -1, i, "pattern");
+        }
+        lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, syntax, "symbols") == LUA_TTABLE) {
+        for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+            if (lua_type(L, -2) == LUA_TSTRING && !lua_isstring(L, -1))
+                luaL_error(L, "syntax symbol '%s' is %s, not a string", lua_tostring(L, -2), luaL_typename(L, -1));
+        }
+    }
+    lua_pop(L, 1);
+}
+
+// 只在 lex_check_syntax 检查过的值上用, 不会出错
+static std::string lex_field_string(lua_State *L, int idx) {
+    size_t len;
+    const char *s = lua_tolstring(L, idx, &len);
+    return std::string(s, len);
+}
+
+static void lex_compile(lua_State *L, int syntax, LexSyntax *lx) {
+    std::unordered_map<std::string, int> ids;
+    lua_newtable(L);
+    int types = lua_gettop(L);
+    lx->normal = lex_intern_type(L, types, ids, "normal");
+
+    lua_getfield(L, syntax, "patterns");
+    int n = (int)lua_rawlen(L, -1);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, -1, i);
+        LexPattern lp = {};
+        lua_getfield(L, -1, "type");
+        lp.type = lex_intern_type(L, types, ids, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "pattern");
+        lp.esc = -1;
+        if (lua_istable(L, -1)) {
+            lp.pair = true;
+            lua_rawgeti(L, -1, 1);
+            lp.start = lex_field_string(L, -1);
+            lua_rawgeti(L, -2, 2);
+            lp.end = lex_field_string(L, -1);
+            lua_rawgeti(L, -3, 3);
+            if (!lua_isnil(L, -1)) lp.esc = (unsigned char)*lua_tostring(L, -1);
+            lua_pop(L, 3);
+            lp.plain_end = !lpat_has_specials(lp.end.data(), lp.end.size());
+        } else {
+            lp.start = lex_field_string(L, -1);
+        }
+        lua_pop(L, 2);
+        lx->patterns.push_back(std::move(lp));
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, syntax, "symbols");
+    if (lua_istable(L, -1)) {
+        for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+            if (lua_type(L, -2) != LUA_TSTRING) continue;
+            lx->symbol_names.emplace_back(lex_field_string(L, -2), lex_intern_type(L, types, ids, lua_tostring(L, -1)));
+        }
+    }
+    lua_pop(L, 1);
+    for (auto &sym : lx->symbol_names) lx->symbols.emplace(sym.first, sym.second);
+
+    // 每个首字节可能命中的 pattern 保持原来的顺序
+    std::vector<std::vector<int>> by_byte(256);
+    for (int i = 0; i < (int)lx->patterns.size(); i++) {
+        bool set[256];
+        bool known = lpat_first_bytes(lx->patterns[i].start.data(), lx->patterns[i].start.size(), set);
+        for (int c = 0; c < 256; c++)
+            if (!known || set[c]) by_byte[c].push_back(i);
+    }
+    for (int c = 0; c < 256; c++) {
+        lx->candidates_at[c] = (int)lx->candidates.size();
+        lx->candidates.insert(lx->candidates.end(), by_byte[c].begin(), by_byte[c].end());
+    }
+    lx->candidates_at[256] = (int)lx->candidates.size();
+
+    lx->types_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static bool lex_blank(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (!isspace((unsigned char)s[i])) return false;
+    return true;
+}
+
+// push_token() of the old tokenizer.lua: runs of one type, and blanks, merge into the next token
+static void lex_push(std::vector<LexSpan> &spans, int type, const char *text, size_t s, size_t e) {
+    bool blank = lex_blank(text + s, e - s);
+    if (!spans.empty() && (spans.back().type == type || spans.back().blank)) {
+        spans.back().type = type;
+        spans.back().end = e;
+        spans.back().blank = spans.back().blank && blank;
+        return;
+    }
+    spans.push_back(LexSpan{type, e, blank});
+}
+
+static bool lex_escaped(const char *text, size_t idx, int esc) {
+    size_t count = 0;
+    while (idx > 0 && (unsigned char)text[idx - 1] == esc) idx--, count++;
+    return count % 2 == 1;
+}
+
+// same tokens as tokenizer.lua, as (type, end) spans. state is the 1-based pattern of an open pair, 0 for none
+static int lex_tokenize(lua_State *L, const LexSyntax *lx, const char *text, size_t len, int state, std::vector<LexSpan> &spans) {
+    spans.clear();
+    if (lx->patterns.empty()) {
+        spans.push_back(LexSpan{lx->normal, len, false});
+        return 0;
+    }
+
+    size_t i = 0;
+    while (i < len) {
+        // continue trying to match the end pattern of a pair if we have a state set
+        if (state) {
+            const LexPattern &p = lx->patterns[state - 1];
+            size_t s, e, from = i;
+            bool found;
+            while ((found = lpat_find(L, text, len, from, p.end.data(), p.end.size(), p.plain_end, &s, &e)) && p.esc >= 0 && lex_escaped(text, s, p.esc)) {
+                from = e > s ? e : e + 1;
+            }
+            if (!found) {
+                lex_push(spans, p.type, text, i, len);
+                break;
+            }
+            lex_push(spans, p.type, text, i, e);
+            state = 0;
+            i = e;
+        }
+
+        // find matching pattern, only those that can start with this byte
+        const int *cand = lx->candidates.data(), *cand_end = cand;
+        if (i < len) {
+            cand += lx->candidates_at[(unsigned char)text[i]];
+            cand_end = lx->candidates.data() + lx->candidates_at[(unsigned char)text[i] + 1];
+        }
+        bool matched = false;
+        for (int k = 0; i == len ? k < (int)lx->patterns.size() : cand + k < cand_end; k++) {
+            int n = i == len ? k : cand[k];
+            const LexPattern &p = lx->patterns[n];
+            ptrdiff_t e = lpat_match_at(L, text, len, i, p.start.data(), p.start.size());
+            if (e < 0 || ((size_t)e == i && !p.pair)) continue;  // an empty token would never advance
+
+            auto sym = lx->symbols.find(std::string_view(text + i, e - i));
+            lex_push(spans, sym != lx->symbols.end() ? sym->second : p.type, text, i, e);
+            if (p.pair) state = n + 1;
+            i = e;
+            matched = true;
+            break;
+        }
+
+        // consume character if we didn't match
+        if (!matched) {
+            lex_push(spans, lx->normal, text, i, i < len ? i + 1 : i);
+            i++;
+        }
+    }
+    return state;
 }
 
-static int f_set_tab_width(lua_State *L) {
-    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
-    int n = luaL_checknumber(L, 2);
-    ren_set_font_tab_width(*self, n);
-    return 0;
+static int f_lexer_compile(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lex_check_syntax(L, 1);
+    LexSyntax **self = (LexSyntax **)lua_newuserdata(L, sizeof(LexSyntax *));
+    *self = NULL;
+    luaL_setmetatable(L, API_TYPE_LEXER);
+    LexSyntax *lx = new LexSyntax();
+    lx->types_ref = LUA_NOREF;
+    *self = lx;  // 出错时也能被 __gc 回收
+    lex_compile(L, 1, lx);
+    return 1;
 }
 
-static int f_GC(lua_State *L) {
-    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
+static int f_lexer_gc(lua_State *L) {
+    LexSyntax **self = (LexSyntax **)luaL_checkudata(L, 1, API_TYPE_LEXER);
     if (*self) {
-        rencache_free_font(*self);
+        luaL_unref(L, LUA_REGISTRYINDEX, (*self)->types_ref);
+        delete *self;
     }
+    *self = NULL;
     return 0;
 }
 
-static int f_get_width(lua_State *L) {
-    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
-    const char *text = luaL_checkstring(L, 2);
-    lua_pushnumber(L, ren_get_font_width(*self, text));
-    return 1;
+// lexer.tokenize(compiled, text, state) -> { type, end, type, end, ... }, state
+static int f_lexer_tokenize(lua_State *L) {
+    LexSyntax *lx = *(LexSyntax **)luaL_checkudata(L, 1, API_TYPE_LEXER);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    int state = (int)luaL_optinteger(L, 3, 0);
+    if (state < 0 || state > (int)lx->patterns.size()) state = 0;
+
+    static thread_local std::vector<LexSpan> spans;
+    state = lex_tokenize(L, lx, text, len, state, spans);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lx->types_ref);
+    lua_createtable(L, (int)spans.size() * 2, 0);
+    for (size_t i = 0; i < spans.size(); i++) {
+        lua_rawgeti(L, -2, spans[i].type);
+        lua_rawseti(L, -2, (lua_Integer)i * 2 + 1);
+        lua_pushinteger(L, (lua_Integer)spans[i].end);
+        lua_rawseti(L, -2, (lua_Integer)i * 2 + 2);
+    }
+    if (state)
+        lua_pushinteger(L, state);
+    else
+        lua_pushnil(L);
+    return 2;
 }
 
-static int f_get_height(lua_State *L) {
-    RenFont **self = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
-    lua_pushnumber(L, ren_get_font_height(*self));
-    return 1;
-}
+int luaopen_lexer(lua_State *L) {
+    static const luaL_Reg meta[] = {{"__gc", f_lexer_gc}, {NULL, NULL}};
+    luaL_newmetatable(L, API_TYPE_LEXER);
+    luaL_setfuncs(L, meta, 0);
+    lua_pop(L, 1);
 
-int luaopen_renderer_font(lua_State *L) {
-    static const luaL_Reg lib[] = {{"__gc", f_GC}, {"load", f_load}, {"set_tab_width", f_set_tab_width}, {"get_width", f_get_width}, {"get_height", f_get_height}, {NULL, NULL}};
-    luaL_newmetatable(L, API_TYPE_FONT);
-    luaL_setfuncs(L, lib, 0);
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -2, "__index");
+    static const luaL_Reg lib[] = {{"compile", f_lexer_compile}, {"tokenize", f_lexer_tokenize}, {NULL, NULL}};
+    luaL_newlib(L, lib);
     return 1;
 }
 
 // ----------------------------------------------------------------------------
-// lite/renderer_api.c
-
-static RenColor checkcolor(lua_State *L, int idx, int def) {
-    RenColor color;
-    if (lua_isnoneornil(L, idx)) {
-        return RenColor{(uint8_t)def, (uint8_t)def, (uint8_t)def, 255};
+// lite/buffer.c
+
+/* 文档缓冲: 文本切成不超过 BUF_CHUNK_MAX 字节的块挂在一棵隐式 treap 上,
+** 每个节点记录子树的字节数和换行数, 按行号或偏移定位都是 O(log n).
+** 行号从 1 开始, 与 Doc 的 line/col 一致.
+**
+** 大文件模式下块直接引用文件映射, 换行数由后台线程分块统计, 主线程在
+** sync 时把统计完的块接到树尾; 只有编辑产生的块才持有自己的内存 */
+
+#define BUF_CHUNK_MAX 2048
+#define BUF_CHUNK_FILL 1536       // 新建块的大小, 留出原地插入的余量
+#define BUF_MAP_BLOCK 16384       // 映射块大小, 也是后台索引的粒度
+#define BUF_MAP_SYNC_BLOCKS 64    // 打开时同步索引的块数, 首屏不用等后台线程
+
+typedef struct BufNode {
+    BufNode *l, *r;
+    uint32_t prio;
+    uint32_t nl;          // 本块换行数
+    size_t len;           // 本块字节数
+    size_t size, lines;  // 子树合计
+    bool mapped;          // 引用文件映射 [moff, moff + len) 而不是 text
+    size_t moff;
+    std::string text;
+} BufNode;
+
+typedef struct TextBuffer {
+    BufNode *root;
+    uint32_t seed;
+    lt_filemap map;
+    std::string path;
+    size_t absorbed;  // 已接入树中的映射字节数
+    std::vector<uint32_t> block_nl;
+    std::atomic<size_t> indexed;  // 后台已统计完的块数
+    std::atomic<bool> cancel;
+    std::thread indexer;
+    bool raw;   // 映射打开的文档: 树里是文件原样的字节, 行尾 \r\n 的 \r 不给 lua 看到
+    bool crlf;  // raw 文档的行尾是 \r\n, 插入的换行也写成 \r\n
+} TextBuffer;
+
+static size_t buf_count_nl(const char *s, size_t n) {
+    size_t count = 0, i = 0;
+#if defined(LT_ARCH_X86)
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (i + 16 <= n) {
+        // 每字节计数器最多累加 255 次, 再用 sad 横向求和
+        __m128i acc = _mm_setzero_si128();
+        size_t end = std::min(n & ~(size_t)15, i + 255 * 16);
+        for (; i < end; i += 16) acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), nl));
+        __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si32(sum) + (size_t)_mm_extract_epi16(sum, 4);
     }
-    lua_rawgeti(L, idx, 1);
-    lua_rawgeti(L, idx, 2);
-    lua_rawgeti(L, idx, 3);
-    lua_rawgeti(L, idx, 4);
-    color.r = luaL_checknumber(L, -4);
-    color.g = luaL_checknumber(L, -3);
-    color.b = luaL_checknumber(L, -2);
-    color.a = luaL_optnumber(L, -1, 255);
-    lua_pop(L, 4);
-    return color;
+#elif defined(LT_ARCH_NEON)
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    while (i + 16 <= n) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        size_t end = std::min(n & ~(size_t)15, i + 255 * 16);
+        for (; i < end; i += 16) acc = vsubq_u8(acc, vceqq_u8(vld1q_u8((const uint8_t *)s + i), nl));
+        uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc)));
+        count += (size_t)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+    }
+#endif
+    for (; i < n; i++) count += s[i] == '\n';
+    return count;
 }
 
-static int f_show_debug(lua_State *L) {
-    luaL_checkany(L, 1);
-    rencache_show_debug(lua_toboolean(L, 1));
-    return 0;
+// 第 k 个 (k >= 1) 换行的位置, 调用方保证存在
+static const char *buf_find_nl(const char *s, size_t n, size_t k) {
+    size_t i = 0;
+#if defined(LT_ARCH_X86)
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), nl));
+        size_t c = (size_t)std::popcount(mask);
+        if (c < k) {
+            k -= c;
+            continue;
+        }
+        while (--k) mask &= mask - 1;
+        return s + i + std::countr_zero(mask);
+    }
+#endif
+    for (;; i++) {
+        if (s[i] == '\n' && --k == 0) return s + i;
+    }
 }
 
-static int f_get_size(lua_State *L) {
-    int w, h;
-    ren_get_size(&w, &h);
-    lua_pushnumber(L, w);
-    lua_pushnumber(L, h);
-    return 2;
-}
+static size_t buf_size(BufNode *t) { return t ? t->size : 0; }
+static size_t buf_lines(BufNode *t) { return t ? t->lines : 0; }
 
-static int f_begin_frame(lua_State *L) {
-    rencache_begin_frame();
-    return 0;
+static void buf_update(BufNode *t) {
+    t->size = buf_size(t->l) + t->len + buf_size(t->r);
+    t->lines = buf_lines(t->l) + t->nl + buf_lines(t->r);
 }
 
-static int f_end_frame(lua_State *L) {
-    rencache_end_frame();
-    return 0;
-}
+static const char *buf_data(TextBuffer *b, BufNode *t) { return t->mapped ? b->map.data + t->moff : t->text.data(); }
 
-static int f_set_clip_rect(lua_State *L) {
-    RenRect rect;
-    rect.x = luaL_checknumber(L, 1);
-    rect.y = luaL_checknumber(L, 2);
-    rect.width = luaL_checknumber(L, 3);
-    rect.height = luaL_checknumber(L, 4);
-    rencache_set_clip_rect(rect);
-    return 0;
+static BufNode *buf_alloc(TextBuffer *b) {
+    BufNode *t = new BufNode();
+    b->seed ^= b->seed << 13;
+    b->seed ^= b->seed >> 17;
+    b->seed ^= b->seed << 5;
+    t->prio = b->seed;
+    return t;
 }
 
-static int f_draw_rect(lua_State *L) {
-    RenRect rect;
-    rect.x = luaL_checknumber(L, 1);
-    rect.y = luaL_checknumber(L, 2);
-    rect.width = luaL_checknumber(L, 3);
-    rect.height = luaL_checknumber(L, 4);
-    RenColor color = checkcolor(L, 5, 255);
-    rencache_draw_rect(rect, color);
-    return 0;
+static BufNode *buf_newnode(TextBuffer *b, const char *s, size_t n) {
+    BufNode *t = buf_alloc(b);
+    t->text.assign(s, n);
+    t->len = n;
+    t->nl = (uint32_t)buf_count_nl(s, n);
+    buf_update(t);
+    return t;
 }
 
-static int f_draw_text(lua_State *L) {
-    RenFont **font = (RenFont **)luaL_checkudata(L, 1, API_TYPE_FONT);
-    const char *text = luaL_checkstring(L, 2);
-    int x = luaL_checknumber(L, 3);
-    int y = luaL_checknumber(L, 4);
-    RenColor color = checkcolor(L, 5, 255);
-    x = rencache_draw_text(*font, text, x, y, color);
-    lua_pushnumber(L, x);
-    return 1;
+static BufNode *buf_mapnode(TextBuffer *b, size_t off, size_t n, uint32_t nl) {
+    BufNode *t = buf_alloc(b);
+    t->mapped = true;
+    t->moff = off;
+    t->len = n;
+    t->nl = nl;
+    buf_update(t);
+    return t;
 }
 
-int luaopen_renderer(lua_State *L) {
-    static const luaL_Reg lib[] = {{"show_debug", f_show_debug},       {"get_size", f_get_size},   {"begin_frame", f_begin_frame}, {"end_frame", f_end_frame},
-                                   {"set_clip_rect", f_set_clip_rect}, {"draw_rect", f_draw_rect}, {"draw_text", f_draw_text},     {NULL, NULL}};
-    luaL_newlib(L, lib);
-    luaopen_renderer_font(L);
-    lua_setfield(L, -2, "font");
-    return 1;
+// 要改动映射块的内容时先复制出来
+static void buf_materialize(TextBuffer *b, BufNode *t) {
+    if (!t->mapped) return;
+    t->text.assign(b->map.data + t->moff, t->len);
+    t->mapped = false;
 }
 
-// ----------------------------------------------------------------------------
-// lite/rencache.c
-
-/* a cache over the software renderer -- all drawing operations are stored as
-** commands when issued. At the end of the frame we write the commands to a grid
-** of hash values, take the cells that have changed since the previous frame,
-** merge them into dirty rectangles and redraw only those regions */
-
-#define CELLS_X 80
-#define CELLS_Y 50
-#define CELL_SIZE 96
-#define COMMAND_BUF_SIZE (1024 * 512)
-
-enum { SET_CLIP, DRAW_TEXT, DRAW_RECT };
-
-typedef struct {
-    int type, size;
-    RenRect rect;
-    RenColor color;
-    RenFont *font;
-    int tab_width;
-    char text[0];
-} Command;
-
-static unsigned cells_buf1[CELLS_X * CELLS_Y];
-static unsigned cells_buf2[CELLS_X * CELLS_Y];
-static unsigned *cells_prev = cells_buf1;
-static unsigned *cells = cells_buf2;
-static RenRect rect_buf[CELLS_X * CELLS_Y / 2];
-static char command_buf[COMMAND_BUF_SIZE];
-static int command_buf_idx;
-static RenRect screen_rect;
-static bool show_debug;
+static void buf_free(BufNode *t) {
+    if (!t) return;
+    buf_free(t->l);
+    buf_free(t->r);
+    delete t;
+}
 
-// 32bit fnv-1a hash
-#define HASH_INITIAL 2166136261
+static BufNode *buf_merge(BufNode *a, BufNode *c) {
+    if (!a) return c;
+    if (!c) return a;
+    if (a->prio > c->prio) {
+        a->r = buf_merge(a->r, c);
+        buf_update(a);
+        return a;
+    }
+    c->l = buf_merge(a, c->l);
+    buf_update(c);
+    return c;
+}
 
-static void hash(unsigned *h, const void *data, int size) {
-    const unsigned char *p = (unsigned char *)data;
-    while (size--) {
-        *h = (*h ^ *p++) * 16777619;
+// 按字节偏移拆成 [0, off) 和 [off, size), 落在块中间时把块切开
+static void buf_split(TextBuffer *b, BufNode *t, size_t off, BufNode **a, BufNode **c) {
+    if (!t) {
+        *a = *c = NULL;
+        return;
+    }
+    size_t left = buf_size(t->l);
+    if (off <= left) {
+        buf_split(b, t->l, off, a, &t->l);
+        buf_update(t);
+        *c = t;
+    } else if (off >= left + t->len) {
+        buf_split(b, t->r, off - left - t->len, &t->r, c);
+        buf_update(t);
+        *a = t;
+    } else {
+        size_t k = off - left;
+        BufNode *tail;
+        if (t->mapped) {
+            tail = buf_mapnode(b, t->moff + k, t->len - k, (uint32_t)buf_count_nl(b->map.data + t->moff + k, t->len - k));
+        } else {
+            tail = buf_newnode(b, t->text.data() + k, t->len - k);
+            t->text.resize(k);
+        }
+        BufNode *l = t->l, *r = t->r;
+        t->len = k;
+        t->nl -= tail->nl;
+        t->l = t->r = NULL;
+        buf_update(t);
+        *a = buf_merge(l, t);
+        *c = buf_merge(tail, r);
     }
 }
 
-static inline int cell_idx(int x, int y) { return x + y * CELLS_X; }
+static BufNode *buf_pop_first(BufNode *t) {
+    if (!t->l) {
+        BufNode *r = t->r;
+        delete t;
+        return r;
+    }
+    t->l = buf_pop_first(t->l);
+    buf_update(t);
+    return t;
+}
 
-static inline bool rects_overlap(RenRect a, RenRect b) { return b.x + b.width >= a.x && b.x <= a.x + a.width && b.y + b.height >= a.y && b.y <= a.y + a.height; }
+static void buf_append_last(TextBuffer *b, BufNode *t, BufNode *from) {
+    if (t->r) {
+        buf_append_last(b, t->r, from);
+    } else {
+        buf_materialize(b, t);
+        t->text.append(buf_data(b, from), from->len);
+        t->len += from->len;
+        t->nl += from->nl;
+    }
+    buf_update(t);
+}
 
-static RenRect intersect_rects(RenRect a, RenRect b) {
-    int x1 = NEKO_MAX(a.x, b.x);
-    int y1 = NEKO_MAX(a.y, b.y);
-    int x2 = NEKO_MIN(a.x + a.width, b.x + b.width);
-    int y2 = NEKO_MIN(a.y + a.height, b.y + b.height);
-    return RenRect{x1, y1, NEKO_MAX(0, x2 - x1), NEKO_MAX(0, y2 - y1)};
+// 拼接两棵树, 接缝两侧的块都很小时并成一块, 避免反复编辑后碎片化
+static BufNode *buf_join(TextBuffer *b, BufNode *a, BufNode *c) {
+    if (a && c) {
+        BufNode *last = a, *first = c;
+        while (last->r) last = last->r;
+        while (first->l) first = first->l;
+        if (last->len + first->len <= BUF_CHUNK_MAX) {
+            buf_append_last(b, a, first);
+            c = buf_pop_first(c);
+        }
+    }
+    return buf_merge(a, c);
 }
 
-static RenRect merge_rects(RenRect a, RenRect b) {
-    int x1 = NEKO_MIN(a.x, b.x);
-    int y1 = NEKO_MIN(a.y, b.y);
-    int x2 = NEKO_MAX(a.x + a.width, b.x + b.width);
-    int y2 = NEKO_MAX(a.y + a.height, b.y + b.height);
-    return RenRect{x1, y1, x2 - x1, y2 - y1};
+static BufNode *buf_build(TextBuffer *b, const char *s, size_t n) {
+    BufNode *t = NULL;
+    for (size_t i = 0; i < n; i += BUF_CHUNK_FILL) {
+        t = buf_merge(t, buf_newnode(b, s + i, std::min((size_t)BUF_CHUNK_FILL, n - i)));
+    }
+    return t;
 }
 
-static Command *push_command(int type, int size) {
-    size_t alignment = 7;                    // alignof(max_align_t) - 1; //< C11 https://github.com/rxi/lite/pull/292/commits/ad1bdf56e3f212446e1c61fd45de8b94de5e2bc3
-    size = (size + alignment) & ~alignment;  //< https://github.com/rxi/lite/pull/292/commits/ad1bdf56e3f212446e1c61fd45de8b94de5e2bc3
-    Command *cmd = (Command *)(command_buf + command_buf_idx);
-    int n = command_buf_idx + size;
-    if (n > COMMAND_BUF_SIZE) {
-        fprintf(stderr, "Warning: (" __FILE__ "): exhausted command buffer\n");
-        return NULL;
+static bool buf_insert_inplace(TextBuffer *b, BufNode *t, size_t off, const char *s, size_t n) {
+    if (!t) return false;
+    size_t left = buf_size(t->l);
+    bool ok;
+    if (off < left) {
+        ok = buf_insert_inplace(b, t->l, off, s, n);
+    } else if (off > left + t->len) {
+        ok = buf_insert_inplace(b, t->r, off - left - t->len, s, n);
+    } else {
+        if (t->len + n > BUF_CHUNK_MAX) return false;
+        buf_materialize(b, t);
+        t->text.insert(off - left, s, n);
+        t->len += n;
+        t->nl += (uint32_t)buf_count_nl(s, n);
+        ok = true;
     }
-    command_buf_idx = n;
-    lt_memset(cmd, 0, sizeof(Command));
-    cmd->type = type;
-    cmd->size = size;
-    return cmd;
+    if (ok) buf_update(t);
+    return ok;
 }
 
-static bool next_command(Command **prev) {
-    if (*prev == NULL) {
-        *prev = (Command *)command_buf;
+static bool buf_remove_inplace(TextBuffer *b, BufNode *t, size_t off, size_t n) {
+    if (!t) return false;
+    size_t left = buf_size(t->l);
+    bool ok;
+    if (off + n <= left) {
+        ok = buf_remove_inplace(b, t->l, off, n);
+    } else if (off >= left + t->len) {
+        ok = buf_remove_inplace(b, t->r, off - left - t->len, n);
     } else {
-        *prev = (Command *)(((char *)*prev) + (*prev)->size);
+        // 跨块或删空整块时走拆分
+        if (off < left || off + n > left + t->len || n == t->len) return false;
+        size_t k = off - left;
+        uint32_t nl = (uint32_t)buf_count_nl(buf_data(b, t) + k, n);
+        if (!t->mapped) {
+            t->text.erase(k, n);
+        } else if (k == 0) {
+            t->moff += n;  // 映射块只能掐头去尾
+        } else if (k + n != t->len) {
+            return false;
+        }
+        t->len -= n;
+        t->nl -= nl;
+        ok = true;
     }
-    return *prev != ((Command *)(command_buf + command_buf_idx));
+    if (ok) buf_update(t);
+    return ok;
 }
 
-void rencache_show_debug(bool enable) { show_debug = enable; }
+static void buf_insert(TextBuffer *b, size_t off, const char *s, size_t n) {
+    if (n == 0 || buf_insert_inplace(b, b->root, off, s, n)) return;
+    BufNode *a, *c;
+    buf_split(b, b->root, off, &a, &c);
+    b->root = buf_join(b, buf_join(b, a, buf_build(b, s, n)), c);
+}
 
-void rencache_free_font(RenFont *font) { ren_free_font(font); }
+static void buf_remove(TextBuffer *b, size_t off, size_t n) {
+    if (n == 0 || buf_remove_inplace(b, b->root, off, n)) return;
+    BufNode *a, *m, *mid, *c;
+    buf_split(b, b->root, off + n, &m, &c);
+    buf_split(b, m, off, &a, &mid);
+    buf_free(mid);
+    b->root = buf_join(b, a, c);
+}
 
-void rencache_set_clip_rect(RenRect rect) {
-    Command *cmd = push_command(SET_CLIP, sizeof(Command));
-    if (cmd) {
-        cmd->rect = intersect_rects(rect, screen_rect);
-    }
+static size_t buf_line_count(TextBuffer *b) {
+    BufNode *t = b->root;
+    if (!t) return 0;
+    while (t->r) t = t->r;
+    return b->root->lines + (buf_data(b, t)[t->len - 1] != '\n');
 }
 
-void rencache_draw_rect(RenRect rect, RenColor color) {
-    if (!rects_overlap(screen_rect, rect)) {
-        return;
+// 第 line 行首的偏移; 超出末行时返回总长度
+static size_t buf_line_offset(TextBuffer *b, size_t line) {
+    size_t k = line - 1, base = 0;
+    if (k == 0) return 0;
+    BufNode *t = b->root;
+    while (t) {
+        size_t ln = buf_lines(t->l);
+        if (k <= ln) {
+            t = t->l;
+            continue;
+        }
+        k -= ln;
+        base += buf_size(t->l);
+        if (k <= t->nl) {
+            const char *s = buf_data(b, t);
+            return base + (buf_find_nl(s, t->len, k) - s) + 1;
+        }
+        k -= t->nl;
+        base += t->len;
+        t = t->r;
     }
-    Command *cmd = push_command(DRAW_RECT, sizeof(Command));
-    if (cmd) {
-        cmd->rect = rect;
-        cmd->color = color;
+    return base;
+}
+
+static void buf_copy(TextBuffer *b, BufNode *t, size_t off, size_t n, std::string &out) {
+    if (!t || n == 0) return;
+    size_t left = buf_size(t->l), end = off + n;
+    if (off < left) buf_copy(b, t->l, off, std::min(end, left) - off, out);
+    size_t s = std::max(off, left), e = std::min(end, left + t->len);
+    if (s < e) out.append(buf_data(b, t) + (s - left), e - s);
+    if (end > left + t->len) {
+        size_t r = std::max(off, left + t->len);
+        buf_copy(b, t->r, r - left - t->len, end - r, out);
     }
 }
 
-int rencache_draw_text(RenFont *font, const char *text, int x, int y, RenColor color) {
-    RenRect rect;
-    rect.x = x;
-    rect.y = y;
-    rect.width = ren_get_font_width(font, text);
-    rect.height = ren_get_font_height(font);
+template <typename F>
+static void buf_each_node(BufNode *t, F &&fn) {
+    if (!t) return;
+    buf_each_node(t->l, fn);
+    fn(t);
+    buf_each_node(t->r, fn);
+}
 
-    if (rects_overlap(screen_rect, rect)) {
-        int sz = strlen(text) + 1;
-        Command *cmd = push_command(DRAW_TEXT, sizeof(Command) + sz);
-        if (cmd) {
-            memcpy(cmd->text, text, sz);
-            cmd->color = color;
-            cmd->font = font;
-            cmd->rect = rect;
-            cmd->tab_width = ren_get_font_tab_width(font);
-        }
+static void buf_index_blocks(TextBuffer *b, size_t from) {
+    for (size_t i = from; i < b->block_nl.size() && !b->cancel.load(std::memory_order_relaxed); i++) {
+        size_t off = i * BUF_MAP_BLOCK;
+        b->block_nl[i] = (uint32_t)buf_count_nl(b->map.data + off, std::min((size_t)BUF_MAP_BLOCK, b->map.size - off));
+        b->indexed.store(i + 1, std::memory_order_release);
     }
+}
 
-    return x + rect.width;
+// 把后台统计完的块接到树尾, 整个文件都接入后返回 true
+static bool buf_absorb(TextBuffer *b) {
+    if (b->absorbed == b->map.size) return true;
+    size_t blocks = b->block_nl.size(), done = b->indexed.load(std::memory_order_acquire);
+    size_t cut = done == blocks ? b->map.size : done * BUF_MAP_BLOCK;
+    if (done < blocks) {
+        // 只接到最后一个完整的行, 保证每行都以 \n 结尾
+        while (cut > b->absorbed && b->map.data[cut - 1] != '\n') cut--;
+        if (cut == b->absorbed) return false;
+    }
+    for (size_t off = b->absorbed; off < cut;) {
+        size_t blk = off / BUF_MAP_BLOCK, end = std::min((blk + 1) * BUF_MAP_BLOCK, cut);
+        bool whole = off == blk * BUF_MAP_BLOCK && (end == (blk + 1) * BUF_MAP_BLOCK || end == b->map.size);
+        uint32_t nl = whole ? b->block_nl[blk] : (uint32_t)buf_count_nl(b->map.data + off, end - off);
+        b->root = buf_merge(b->root, buf_mapnode(b, off, end - off, nl));
+        off = end;
+    }
+    b->absorbed = cut;
+    if (cut < b->map.size) return false;
+    if (b->indexer.joinable()) b->indexer.join();
+    char last = b->map.data[b->map.size - 1];
+    if (last != '\n') {
+        const char *eol = b->crlf && last != '\r' ? "\r\n" : "\n";
+        b->root = buf_join(b, b->root, buf_newnode(b, eol, strlen(eol)));
+    }
+    return true;
 }
 
-void rencache_invalidate(void) { lt_memset(cells_prev, 0xff, sizeof(cells_buf1)); }
+static void buf_finish_index(TextBuffer *b) {
+    if (b->indexer.joinable()) b->indexer.join();
+    buf_absorb(b);
+}
 
-void rencache_begin_frame(void) {
-    // reset all cells if the screen width/height has changed
-    int w, h;
-    ren_get_size(&w, &h);
-    if (screen_rect.width != w || h != screen_rect.height) {
-        screen_rect.width = w;
-        screen_rect.height = h;
-        rencache_invalidate();
+static void buf_open_mapped(TextBuffer *b, lt_filemap *map, const char *filename) {
+    b->map = *map;
+    b->path = filename;
+    size_t blocks = (map->size + BUF_MAP_BLOCK - 1) / BUF_MAP_BLOCK, i = 0, nl = 0;
+    b->block_nl.resize(blocks);
+    for (; i < blocks && (i < BUF_MAP_SYNC_BLOCKS || nl == 0); i++) {
+        size_t off = i * BUF_MAP_BLOCK;
+        nl += b->block_nl[i] = (uint32_t)buf_count_nl(map->data + off, std::min((size_t)BUF_MAP_BLOCK, map->size - off));
     }
+    b->indexed = i;
+    // 行尾按同步索引的部分判断, 跟小文件一样有 \r\n 就算 crlf
+    b->raw = true;
+    b->crlf = std::string_view(map->data, std::min(i * BUF_MAP_BLOCK, map->size)).find("\r\n") != std::string_view::npos;
+    if (i < blocks) b->indexer = std::thread(buf_index_blocks, b, i);
+    buf_absorb(b);
 }
 
-static void update_overlapping_cells(RenRect r, unsigned h) {
-    int x1 = r.x / CELL_SIZE;
-    int y1 = r.y / CELL_SIZE;
-    int x2 = (r.x + r.width) / CELL_SIZE;
-    int y2 = (r.y + r.height) / CELL_SIZE;
-
-    for (int y = y1; y <= y2; y++) {
-        for (int x = x1; x <= x2; x++) {
-            int idx = cell_idx(x, y);
-            hash(&cells[idx], &h, sizeof(h));
+// 行尾统一成 \n, 末尾补 \n, 与原先 fp:lines() 逐行读取的结果一致
+static bool buf_load_text(TextBuffer *b, const char *text, size_t len) {
+    std::string norm;
+    norm.reserve(len + 1);
+    bool crlf = false;
+    for (size_t i = 0; i < len;) {
+        const char *cr = (const char *)memchr(text + i, '\r', len - i);
+        size_t n = cr ? cr - (text + i) : len - i;
+        norm.append(text + i, n);
+        i += n;
+        if (!cr) break;
+        if (i + 1 == len || text[i + 1] == '\n') {
+            crlf = true;  // 末尾没有 \n 的 \r 也当作行尾
+        } else {
+            norm += '\r';
         }
+        i++;
     }
+    if (norm.empty() || norm.back() != '\n') norm += '\n';
+    b->root = buf_build(b, norm.data(), norm.size());
+    return crlf;
 }
 
-static void push_rect(RenRect r, int *count) {
-    // try to merge with existing rectangle
-    for (int i = *count - 1; i >= 0; i--) {
-        RenRect *rp = &rect_buf[i];
-        if (rects_overlap(*rp, r)) {
-            *rp = merge_rects(*rp, r);
-            return;
+// raw 文档里已经是 \r\n 的行尾原样写出, 不再补 \r
+static bool buf_write(TextBuffer *b, const char *filename, bool crlf) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) return false;
+    bool ok = true;
+    char prev = 0;
+    buf_each_node(b->root, [&](BufNode *t) {
+        const char *data = buf_data(b, t), *s = data, *end = s + t->len;
+        while (ok && crlf && s < end) {
+            const char *nl = (const char *)memchr(s, '\n', end - s);
+            if (!nl) break;
+            if (b->raw && (nl > data ? nl[-1] : prev) == '\r') {
+                ok = fwrite(s, 1, nl + 1 - s, fp) == (size_t)(nl + 1 - s);
+            } else {
+                ok = fwrite(s, 1, nl - s, fp) == (size_t)(nl - s) && fwrite("\r\n", 1, 2, fp) == 2;
+            }
+            s = nl + 1;
         }
+        if (ok && s < end) ok = fwrite(s, 1, end - s, fp) == (size_t)(end - s);
+        if (t->len) prev = end[-1];
+    });
+    int err = errno;
+    if (fclose(fp) != 0 && ok) {
+        ok = false;
+        err = errno;
     }
-    // couldn't merge with previous rectangle: push
-    rect_buf[(*count)++] = r;
+    errno = err;
+    return ok;
 }
 
-void rencache_end_frame(void) {
-    // update cells from commands
-    Command *cmd = NULL;
-    RenRect cr = screen_rect;
-    while (next_command(&cmd)) {
-        if (cmd->type == SET_CLIP) {
-            cr = cmd->rect;
-        }
-        RenRect r = intersect_rects(cmd->rect, cr);
-        if (r.width == 0 || r.height == 0) {
-            continue;
-        }
-        unsigned h = HASH_INITIAL;
-        hash(&h, cmd, cmd->size);
-        update_overlapping_cells(r, h);
+// 映射着的文件不能原地改写: 写好的临时文件先换成新的映射, 再改名覆盖原文件
+static bool buf_replace_file(TextBuffer *b, const char *tmp, const char *filename, std::string &err) {
+#ifndef NEKO_IS_WIN32
+    struct stat st;
+    if (stat(filename, &st) == 0) chmod(tmp, st.st_mode & 07777);
+#endif
+    // 写出的字节和树里一样多, 说明行尾没有改写, 新文件可以直接换上
+    lt_filemap map;
+    if (lt_mapfile(&map, tmp) && map.size != buf_size(b->root)) lt_unmapfile(&map);
+    if (map.data) {
+        size_t off = 0;
+        buf_each_node(b->root, [&](BufNode *t) {
+            t->mapped = true;
+            t->moff = off;
+            std::string().swap(t->text);
+            off += t->len;
+        });
+    } else {
+        map = lt_filemap{};
+        buf_each_node(b->root, [&](BufNode *t) { buf_materialize(b, t); });
+    }
+    lt_unmapfile(&b->map);
+    b->map = map;
+    b->absorbed = map.size;
+    b->path = tmp;
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, filename, ec);
+    if (ec) {
+        err = ec.message();
+        return false;
     }
+    b->path = filename;
+    return true;
+}
 
-    // push rects for all cells changed from last frame, reset cells
-    int rect_count = 0;
-    int max_x = screen_rect.width / CELL_SIZE + 1;
-    int max_y = screen_rect.height / CELL_SIZE + 1;
-    for (int y = 0; y < max_y; y++) {
-        for (int x = 0; x < max_x; x++) {
-            // compare previous and current cell for change
-            int idx = cell_idx(x, y);
-            if (cells[idx] != cells_prev[idx]) {
-                push_rect(RenRect{x, y, 1, 1}, &rect_count);
-            }
-            cells_prev[idx] = HASH_INITIAL;
-        }
+static TextBuffer *buf_check(lua_State *L, int idx) {
+    TextBuffer *b = *(TextBuffer **)luaL_checkudata(L, idx, API_TYPE_BUFFER);
+    luaL_argcheck(L, b != NULL, idx, "buffer is freed");
+    return b;
+}
+
+static size_t buf_check_offset(lua_State *L, TextBuffer *b, int idx) {
+    lua_Integer line = luaL_checkinteger(L, idx);
+    lua_Integer col = luaL_checkinteger(L, idx + 1);
+    luaL_argcheck(L, line >= 1 && line <= (lua_Integer)buf_line_count(b), idx, "line out of range");
+    luaL_argcheck(L, col >= 1, idx + 1, "column out of range");
+    size_t start = buf_line_offset(b, (size_t)line), end = buf_line_offset(b, (size_t)line + 1);
+    // raw 文档行尾的 \r 不算列, 行尾之后的列都落到下一行行首
+    size_t hidden = 0;
+    if (b->raw && end - start >= 2) {
+        std::string cr;
+        buf_copy(b, b->root, end - 2, 1, cr);
+        hidden = cr[0] == '\r';
     }
+    size_t off = start + (size_t)col - 1;
+    return off < end - hidden ? off : end;
+}
 
-    // expand rects from cells to pixels
-    for (int i = 0; i < rect_count; i++) {
-        RenRect *r = &rect_buf[i];
-        r->x *= CELL_SIZE;
-        r->y *= CELL_SIZE;
-        r->width *= CELL_SIZE;
-        r->height *= CELL_SIZE;
-        *r = intersect_rects(*r, screen_rect);
+// raw 文档交给 lua 的文本去掉行尾的 \r
+static void buf_hide_cr(TextBuffer *b, std::string &s) {
+    if (!b->raw) return;
+    size_t j = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] != '\r' || i + 1 == s.size() || s[i + 1] != '\n') s[j++] = s[i];
     }
+    s.resize(j);
+}
 
-    // redraw updated regions
-    for (int i = 0; i < rect_count; i++) {
-        // draw
-        RenRect r = rect_buf[i];
-        ren_set_clip_rect(r);
-
-        cmd = NULL;
-        while (next_command(&cmd)) {
-            switch (cmd->type) {
-                case SET_CLIP:
-                    ren_set_clip_rect(intersect_rects(cmd->rect, r));
-                    break;
-                case DRAW_RECT:
-                    ren_draw_rect(cmd->rect, cmd->color);
-                    break;
-                case DRAW_TEXT:
-                    ren_set_font_tab_width(cmd->font, cmd->tab_width);
-                    ren_draw_text(cmd->font, cmd->text, cmd->rect.x, cmd->rect.y, cmd->color);
-                    break;
-            }
-        }
+static TextBuffer *buf_push_new(lua_State *L) {
+    TextBuffer **self = (TextBuffer **)lua_newuserdata(L, sizeof(TextBuffer *));
+    *self = NULL;
+    luaL_setmetatable(L, API_TYPE_BUFFER);
+    TextBuffer *b = new TextBuffer();
+    b->seed = 0x9e3779b9u;
+    *self = b;
+    return b;
+}
 
-        if (show_debug) {
-            RenColor color = {(uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand(), 50};
-            ren_draw_rect(r, color);
-        }
+// buffer.new(text) -> buffer, crlf
+static int f_buffer_new(lua_State *L) {
+    size_t len;
+    const char *text = luaL_optlstring(L, 1, "", &len);
+    TextBuffer *b = buf_push_new(L);
+    lua_pushboolean(L, buf_load_text(b, text, len));
+    return 2;
+}
+
+// buffer.load(filename [, large_size]) -> buffer, crlf, large | nil, err
+// 不小于 large_size 的文件直接映射, 换行在后台统计, 行尾的 \r\n 留在映射里
+static int f_buffer_load(lua_State *L) {
+    const char *filename = luaL_checkstring(L, 1);
+    lua_Number large_size = luaL_optnumber(L, 2, HUGE_VAL);
+    lt_filemap map;
+    if (!lt_mapfile(&map, filename)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+        return 2;
     }
-
-    // update dirty rects
-    if (rect_count > 0) {
-        ren_update_rects(rect_buf, rect_count);
+    TextBuffer *b = buf_push_new(L);
+    bool large = map.size > 0 && (lua_Number)map.size >= large_size;
+    if (large) {
+        buf_open_mapped(b, &map, filename);
+        lua_pushboolean(L, b->crlf);
+    } else {
+        lua_pushboolean(L, buf_load_text(b, map.data, map.size));
+        lt_unmapfile(&map);
     }
-
-    // swap cell buffer and reset
-    unsigned *tmp = cells;
-    cells = cells_prev;
-    cells_prev = tmp;
-    command_buf_idx = 0;
+    lua_pushboolean(L, large);
+    return 3;
 }
 
-// ----------------------------------------------------------------------------
-// lite/system.c
-
-static int f_set_cursor(lua_State *L) {
-    static const char *cursor_opts[] = {"arrow", "ibeam", "sizeh", "sizev", "hand", NULL};
-    int n = luaL_checkoption(L, 1, "arrow", cursor_opts);
-    lt_setcursor(n);
+static int f_buffer_gc(lua_State *L) {
+    TextBuffer **self = (TextBuffer **)luaL_checkudata(L, 1, API_TYPE_BUFFER);
+    TextBuffer *b = *self;
+    if (b) {
+        b->cancel = true;
+        if (b->indexer.joinable()) b->indexer.join();
+        buf_free(b->root);
+        lt_unmapfile(&b->map);
+        delete b;
+    }
+    *self = NULL;
     return 0;
 }
 
-static int f_set_window_title(lua_State *L) {
-    const char *title = luaL_checkstring(L, 1);
-    lt_setwindowtitle(title);
-    return 0;
-}
-static int f_set_window_mode(lua_State *L) {
-    static const char *window_opts[] = {"normal", "maximized", "fullscreen", 0};
-    enum { WIN_NORMAL, WIN_MAXIMIZED, WIN_FULLSCREEN };
-    int n = luaL_checkoption(L, 1, "normal", window_opts);
-    lt_setwindowmode(n);
-    return 0;
-}
-static int f_window_has_focus(lua_State *L) {
-    unsigned flags = lt_haswindowfocus();
-    lua_pushboolean(L, flags);
+// buffer[i] 取第 i 行(含 \n), 越界为 nil; 其它键查方法表
+static int f_buffer_index(lua_State *L) {
+    TextBuffer *b = buf_check(L, 1);
+    int isnum;
+    lua_Integer line = lua_tointegerx(L, 2, &isnum);
+    if (!isnum) {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        return 1;
+    }
+    if (line < 1 || line > (lua_Integer)buf_line_count(b)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    static thread_local std::string out;
+    size_t start = buf_line_offset(b, (size_t)line);
+    out.clear();
+    buf_copy(b, b->root, start, buf_line_offset(b, (size_t)line + 1) - start, out);
+    buf_hide_cr(b, out);
+    lua_pushlstring(L, out.data(), out.size());
     return 1;
 }
 
-static int f_show_confirm_dialog(lua_State *L) {
-    const char *title = luaL_checkstring(L, 1);
-    const char *msg = luaL_checkstring(L, 2);
-    int id = lt_prompt(msg, title);  // 0:no, 1:yes
-    lua_pushboolean(L, !!id);
+static int f_buffer_newindex(lua_State *L) { return luaL_error(L, "buffer lines are read-only, use Doc:insert() / Doc:remove()"); }
+
+static int f_buffer_len(lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)buf_line_count(buf_check(L, 1)));
     return 1;
 }
 
-static int f_chdir(lua_State *L) {
-    const char *path = luaL_checkstring(L, 1);
-    int err = neko_os_chdir(path);
-    if (err) {
-        luaL_error(L, "chdir() failed");
+// buffer:insert(line, col, text) -> 插入文本末尾的 line, col
+static int f_buffer_insert(lua_State *L) {
+    TextBuffer *b = buf_check(L, 1);
+    size_t off = buf_check_offset(L, b, 2), len;
+    const char *text = luaL_checklstring(L, 4, &len);
+    lua_Integer line = luaL_checkinteger(L, 2), col = (lua_Integer)(off - buf_line_offset(b, (size_t)line)) + 1;
+    if (b->crlf && memchr(text, '\n', len)) {
+        std::string eol;
+        for (size_t i = 0; i < len; i++) text[i] == '\n' ? eol += "\r\n" : eol += text[i];
+        buf_insert(b, off, eol.data(), eol.size());
+    } else {
+        buf_insert(b, off, text, len);
     }
+
+    const char *end = text + len, *last = NULL;
+    for (const char *p = text; (p = (const char *)memchr(p, '\n', end - p)) != NULL; p++) {
+        line++;
+        last = p;
+    }
+    lua_pushinteger(L, line);
+    lua_pushinteger(L, last ? (lua_Integer)(end - last) : col + (lua_Integer)len);
+    return 2;
+}
+
+// buffer:remove(line1, col1, line2, col2), 位置需已排好序
+static int f_buffer_remove(lua_State *L) {
+    TextBuffer *b = buf_check(L, 1);
+    size_t off1 = buf_check_offset(L, b, 2), off2 = buf_check_offset(L, b, 4);
+    if (off2 > off1) buf_remove(b, off1, off2 - off1);
     return 0;
 }
-static int f_list_dir(lua_State *L) {
-    const char *path = luaL_checkstring(L, 1);
-    lua_newtable(L);
-    lt_globpath(L, path);
+
+static int f_buffer_get_text(lua_State *L) {
+    TextBuffer *b = buf_check(L, 1);
+    size_t off1 = buf_check_offset(L, b, 2), off2 = buf_check_offset(L, b, 4);
+    std::string out;
+    if (off2 > off1) buf_copy(b, b->root, off1, off2 - off1, out);
+    buf_hide_cr(b, out);
+    lua_pushlstring(L, out.data(), out.size());
     return 1;
 }
-static int f_absolute_path(lua_State *L) {
-    const char *path = luaL_checkstring(L, 1);
-    char *res = lt_realpath(path, NULL);
-    if (!res) {
-        return 0;
-    }
-    lua_pushstring(L, res);
-    lt_realpath_free(res);
+
+// buffer:sync() -> 是否已索引完整个文件; 顺带接入后台新统计完的行
+static int f_buffer_sync(lua_State *L) {
+    lua_pushboolean(L, buf_absorb(buf_check(L, 1)));
     return 1;
 }
-static int f_get_file_info(lua_State *L) {
-    const char *path = luaL_checkstring(L, 1);
 
-    struct stat s;
-    int err = stat(path, &s);
-    if (err < 0) {
+// buffer:save(filename, crlf) -> true | nil, err
+static int f_buffer_save(lua_State *L) {
+    TextBuffer *b = buf_check(L, 1);
+    const char *filename = luaL_checkstring(L, 2);
+    bool crlf = lua_toboolean(L, 3);
+    buf_finish_index(b);
+
+    std::error_code ec;
+    bool replace = b->map.data && std::filesystem::equivalent(filename, b->path, ec);
+    std::string target = replace ? std::string(filename) + ".lite-save" : filename, err;
+    if (!buf_write(b, target.c_str(), crlf)) {
+        err = strerror(errno);
+        if (replace) remove(target.c_str());
+    } else if (replace) {
+        buf_replace_file(b, target.c_str(), filename, err);
+    }
+    if (!err.empty()) {
         lua_pushnil(L);
-        lua_pushstring(L, strerror(errno));
+        lua_pushfstring(L, "%s: %s", filename, err.c_str());
         return 2;
     }
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    lua_newtable(L);
-    lua_pushnumber(L, s.st_mtime);
-    lua_setfield(L, -2, "modified");
+int luaopen_buffer(lua_State *L) {
+    static const luaL_Reg methods[] = {
+            {"insert", f_buffer_insert}, {"remove", f_buffer_remove}, {"get_text", f_buffer_get_text}, {"sync", f_buffer_sync}, {"save", f_buffer_save}, {NULL, NULL}};
+    static const luaL_Reg meta[] = {{"__gc", f_buffer_gc}, {"__len", f_buffer_len}, {"__newindex", f_buffer_newindex}, {NULL, NULL}};
+    luaL_newmetatable(L, API_TYPE_BUFFER);
+    luaL_setfuncs(L, meta, 0);
+    luaL_newlib(L, methods);
+    lua_pushcclosure(L, f_buffer_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
 
-    lua_pushnumber(L, s.st_size);
-    lua_setfield(L, -2, "size");
+    static const luaL_Reg lib[] = {{"new", f_buffer_new}, {"load", f_buffer_load}, {NULL, NULL}};
+    luaL_newlib(L, lib);
+    return 1;
+}
 
-    if (S_ISREG(s.st_mode)) {
-        lua_pushstring(L, "file");
-    } else if (S_ISDIR(s.st_mode)) {
-        lua_pushstring(L, "dir");
-    } else {
-        lua_pushnil(L);
-    }
-    lua_setfield(L, -2, "type");
+// ----------------------------------------------------------------------------
+// lite/search.c
+
+/* project search. files are mapped read-only and scanned by a few threads;
+** every file keeps its own hits so lua receives them in project order */
+
+#define SEARCH_MAX_WORKERS 8
+#define SEARCH_CONTEXT 80     // bytes kept in front of a hit, like projectsearch.lua did
+#define SEARCH_TEXT_MAX 257   // line:sub(start, start + 256)
+
+typedef struct SearchHit {
+    int line, col;
+    std::string text;
+} SearchHit;
+
+typedef struct SearchJob {
+    std::vector<std::string> files;
+    std::string query;  // lowered when nocase
+    bool pattern, nocase;
+    std::vector<std::vector<SearchHit>> hits;  // per file, handed over through done
+    std::vector<uint8_t> done;                 // guarded by mutex
+    std::mutex mutex;
+    std::string error;  // guarded by mutex
+    std::atomic<size_t> next;
+    std::atomic<bool> cancel;
+    std::atomic<int> refs;  // the lua handle and each worker
+    size_t delivered;       // files whose hits went to lua, main thread only
+    size_t taken;           // hits of files[delivered] already handed over
+} SearchJob;
+
+static inline unsigned char search_lower(unsigned char c) { return (unsigned)(c - 'A') < 26 ? c + 32 : c; }
+
+#if defined(LT_ARCH_X86)
+static inline __m128i search_lower16(__m128i v) {
+    // 'A'..'Z' 平移到 -128..-103 后用有符号比较
+    __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char)(128 - 'A'))), _mm_set1_epi8((char)(-128 + 26)));
+    return _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#elif defined(LT_ARCH_NEON)
+static inline uint8x16_t search_lower16(uint8x16_t v) {
+    uint8x16_t upper = vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26));
+    return vaddq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+}
+#endif
 
-    return 1;
+static bool search_equal(const char *s, const char *p, size_t m, bool nocase) {
+    if (!nocase) return memcmp(s, p, m) == 0;
+    for (size_t i = 0; i < m; i++) {
+        if (search_lower(s[i]) != (unsigned char)p[i]) return false;
+    }
+    return true;
 }
 
-static int f_get_clipboard(lua_State *L) {
-    const char *text = lt_getclipboard(lt_window());
-    if (!text) {
-        return 0;
+// first occurrence of p (already lowered when nocase) in s. candidates must match
+// the first and the last byte of p, 16 positions at a time
+static const char *search_find(const char *s, size_t n, const char *p, size_t m, bool nocase) {
+    if (m == 0 || m > n) return NULL;
+    size_t i = 0, starts = n - m + 1;
+#if defined(LT_ARCH_X86)
+    const __m128i first = _mm_set1_epi8(p[0]), last = _mm_set1_epi8(p[m - 1]);
+    for (; i + 16 <= starts; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i)), b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+        if (nocase) a = search_lower16(a), b = search_lower16(b);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            size_t at = i + std::countr_zero(mask);
+            if (search_equal(s + at, p, m, nocase)) return s + at;
+        }
     }
-    lua_pushstring(L, text);
-    return 1;
+#elif defined(LT_ARCH_NEON)
+    const uint8x16_t first = vdupq_n_u8(p[0]), last = vdupq_n_u8(p[m - 1]);
+    for (; i + 16 <= starts; i += 16) {
+        uint8x16_t a = vld1q_u8((const uint8_t *)s + i), b = vld1q_u8((const uint8_t *)s + i + m - 1);
+        if (nocase) a = search_lower16(a), b = search_lower16(b);
+        uint8x16_t eq = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+        // 每字节压成 4 位
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        for (; mask; mask &= ~((uint64_t)0xf << (std::countr_zero(mask) & ~3))) {
+            size_t at = i + std::countr_zero(mask) / 4;
+            if (search_equal(s + at, p, m, nocase)) return s + at;
+        }
+    }
+#endif
+    for (; i < starts; i++) {
+        if ((nocase ? search_lower(s[i]) : (unsigned char)s[i]) == (unsigned char)p[0] && search_equal(s + i, p, m, nocase)) return s + i;
+    }
+    return NULL;
 }
-static int f_set_clipboard(lua_State *L) {
-    const char *text = luaL_checkstring(L, 1);
-    lt_setclipboard(lt_window(), text);
-    return 0;
+
+// line:find(p) on a line without its "\n": 0-based start, -1 without a match,
+// -2 when the pattern is malformed (the message is left in lpat_errmsg)
+static ptrdiff_t search_pattern(const char *text, size_t len, const char *p, size_t plen) {
+    jmp_buf bail;
+    LPatState ms;
+    ms.src_init = text;
+    ms.src_end = text + len;
+    ms.p_end = p + plen;
+    ms.L = NULL;
+    ms.bail = &bail;
+    if (setjmp(bail)) return -2;
+    bool anchor = plen > 0 && *p == '^';
+    if (anchor) p++;
+    size_t i = 0;
+    do {
+        ms.matchdepth = LPAT_MAXCCALLS;
+        ms.level = 0;
+        if (lpat_match(&ms, text + i, p)) return (ptrdiff_t)i;
+    } while (i++ < len && !anchor);
+    return -1;
 }
 
-static int f_get_time(lua_State *L) {
-    double ss = lt_time_ms() / 1000.0;
-    lua_pushnumber(L, ss);
-    return 1;
+static void search_add_hit(std::vector<SearchHit> &hits, size_t line, const char *text, size_t len, size_t col) {
+    size_t start = col > SEARCH_CONTEXT ? col - SEARCH_CONTEXT : 0;
+    SearchHit &hit = hits.emplace_back();
+    hit.line = (int)line;
+    hit.col = (int)col + 1;
+    if (start > 0) hit.text = "...";
+    hit.text.append(text + start, std::min(len - start, (size_t)SEARCH_TEXT_MAX));
 }
-static int f_sleep(lua_State *L) {
-    double ss = luaL_checknumber(L, 1);
-    lt_sleep_ms(ss * 1000);
-    return 0;
+
+// scans one file the way fp:lines() splits it: "\n" ends a line, "\r" stays in it.
+// only the first hit of a line is kept
+static bool search_text(SearchJob *job, const char *s, size_t n, std::vector<SearchHit> &hits) {
+    static thread_local std::string lowered;
+    size_t pos = 0, line = 1;  // pos is always the start of line
+    while (pos < n && !job->cancel.load(std::memory_order_relaxed)) {
+        if (job->pattern) {
+            const char *eol = (const char *)memchr(s + pos, '\n', n - pos);
+            size_t len = (eol ? eol - s : n) - pos;
+            const char *text = s + pos;
+            if (job->nocase) {
+                lowered.resize(len);
+                for (size_t i = 0; i < len; i++) lowered[i] = (char)search_lower(text[i]);
+                text = lowered.data();
+            }
+            ptrdiff_t col = search_pattern(text, len, job->query.data(), job->query.size());
+            if (col == -2) return false;
+            if (col >= 0) search_add_hit(hits, line, s + pos, len, (size_t)col);
+            pos += len + 1;
+            line++;
+            continue;
+        }
+        const char *at = search_find(s + pos, n - pos, job->query.data(), job->query.size(), job->nocase);
+        if (!at) break;
+        size_t start = at - s;
+        while (start > pos && s[start - 1] != '\n') start--;
+        line += buf_count_nl(s + pos, start - pos);
+        const char *eol = (const char *)memchr(at, '\n', s + n - at);
+        size_t len = (eol ? eol - s : n) - start;
+        search_add_hit(hits, line, s + start, len, at - s - start);
+        pos = start + len + 1;
+        line++;
+    }
+    return true;
 }
 
-static int f_exec(lua_State *L) {
-    size_t len;
-    const char *cmd = luaL_checklstring(L, 1, &len);
-    char *buf = (char *)lt_malloc(len + 32);
-    if (!buf) {
-        luaL_error(L, "buffer allocation failed");
+static void search_release(SearchJob *job) {
+    if (job->refs.fetch_sub(1) == 1) delete job;
+}
+
+static void search_worker(SearchJob *job) {
+    for (size_t i; !job->cancel && (i = job->next++) < job->files.size();) {
+        std::vector<SearchHit> hits;
+        lt_filemap map = {};
+        bool ok = true;
+        if (lt_mapfile(&map, job->files[i].c_str())) {
+            ok = search_text(job, map.data, map.size, hits);
+            lt_unmapfile(&map);
+        }
+        std::lock_guard<std::mutex> lock(job->mutex);
+        if (!ok) {
+            // 模式本身有错, 换哪个文件都一样
+            if (job->error.empty()) job->error = lpat_errmsg;
+            job->cancel = true;
+            break;
+        }
+        job->hits[i].swap(hits);
+        job->done[i] = 1;
     }
-#if _WIN32
-    sprintf(buf, "cmd /c \"%s\"", cmd);
-    WinExec(buf, SW_HIDE);
-#else
-    sprintf(buf, "%s &", cmd);
-    int res = system(buf);
-#endif
-    lt_free(buf);
-    return 0;
+    search_release(job);
 }
 
-static int f_fuzzy_match(lua_State *L) {
-    const char *str = luaL_checkstring(L, 1);
-    const char *ptn = luaL_checkstring(L, 2);
-    int score = 0;
-    int run = 0;
+static SearchJob *search_check(lua_State *L, int idx) { return *(SearchJob **)luaL_checkudata(L, idx, API_TYPE_SEARCH); }
 
-    while (*str && *ptn) {
-        while (*str == ' ') {
-            str++;
+// filesearch.start(files, text [, pattern [, nocase]]) -> search
+// text is searched like line:find(text, 1, true), or line:find(text) with pattern
+static int f_search_start(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    SearchJob **self = (SearchJob **)lua_newuserdata(L, sizeof(SearchJob *));
+    *self = NULL;
+    luaL_setmetatable(L, API_TYPE_SEARCH);
+
+    SearchJob *job = new SearchJob();
+    *self = job;
+    job->query.assign(text, len);
+    job->nocase = lua_toboolean(L, 4);
+    // 没有特殊字符的模式和纯文本一样, 走快速查找
+    job->pattern = lua_toboolean(L, 3) && lpat_has_specials(text, len);
+    if (job->nocase) {
+        // 模式里 % 后面的类名 (%A %S ...) 不能改
+        for (size_t i = 0; i < len; i++) {
+            if (job->pattern && job->query[i] == LPAT_ESC) {
+                i++;
+            } else {
+                job->query[i] = (char)search_lower(job->query[i]);
+            }
         }
-        while (*ptn == ' ') {
-            ptn++;
+    }
+    for (lua_Integer i = 1, n = luaL_len(L, 1); i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        job->files.emplace_back(luaL_checkstring(L, -1));
+        lua_pop(L, 1);
+    }
+    job->hits.resize(job->files.size());
+    job->done.resize(job->files.size());
+
+    // 纯文本不会跨行, 含 \n 的文本不可能命中
+    if (!job->pattern && (len == 0 || memchr(text, '\n', len))) {
+        std::fill(job->done.begin(), job->done.end(), 1);
+        job->refs = 1;
+        return 1;
+    }
+    int workers = NEKO_MAX(1, NEKO_MIN((int)std::thread::hardware_concurrency() - 1, SEARCH_MAX_WORKERS));
+    workers = NEKO_MIN(workers, NEKO_MAX((int)job->files.size(), 1));
+    job->refs = workers + 1;
+    for (int i = 0; i < workers; i++) std::thread(search_worker, job).detach();
+    return 1;
+}
+
+// search:poll(results [, max]) -> files done, finished, err
+// appends up to max (default 1000) { file, line, col, text } hits to results
+static int f_search_poll(lua_State *L) {
+    SearchJob *job = search_check(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer max = luaL_optinteger(L, 3, 1000);
+    lua_Integer n = luaL_len(L, 2);
+    for (lua_Integer pushed = 0; job->delivered < job->files.size() && pushed < max;) {
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (!job->done[job->delivered]) break;
         }
-        if (tolower(*str) == tolower(*ptn)) {
-            score += run * 10 - (*str != *ptn);
-            run++;
-            ptn++;
-        } else {
-            score -= 10;
-            run = 0;
+        std::vector<SearchHit> &hits = job->hits[job->delivered];
+        for (; job->taken < hits.size() && pushed < max; job->taken++, pushed++) {
+            SearchHit &hit = hits[job->taken];
+            lua_createtable(L, 0, 4);
+            lua_pushstring(L, job->files[job->delivered].c_str());
+            lua_setfield(L, -2, "file");
+            lua_pushlstring(L, hit.text.data(), hit.text.size());
+            lua_setfield(L, -2, "text");
+            lua_pushinteger(L, hit.line);
+            lua_setfield(L, -2, "line");
+            lua_pushinteger(L, hit.col);
+            lua_setfield(L, -2, "col");
+            lua_rawseti(L, 2, ++n);
         }
-        str++;
+        if (job->taken < hits.size()) break;
+        std::vector<SearchHit>().swap(hits);
+        job->delivered++;
+        job->taken = 0;
     }
-    if (*ptn) {
-        return 0;
+    std::string error;
+    bool finished;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        error = job->error;  // 与 cancel 一起读, 出错时不会只看到 finished
+        finished = job->delivered == job->files.size() || job->cancel;
     }
+    lua_pushinteger(L, (lua_Integer)job->delivered);
+    lua_pushboolean(L, finished);
+    if (error.empty()) return 2;
+    lua_pushstring(L, error.c_str());
+    return 3;
+}
 
-    lua_pushnumber(L, score - (int)strlen(str));
-    return 1;
+// stops the workers after the files they are on; poll then reports finished
+static int f_search_cancel(lua_State *L) {
+    search_check(L, 1)->cancel = true;
+    return 0;
 }
 
-static int f_poll_event(lua_State *L) {  // init.lua > core.step() wakes on mousemoved || inputtext
-    int rc = lt_poll_event(L);
-    return rc;
+static int f_search_gc(lua_State *L) {
+    SearchJob **self = (SearchJob **)luaL_checkudata(L, 1, API_TYPE_SEARCH);
+    if (*self) {
+        (*self)->cancel = true;
+        search_release(*self);
+    }
+    *self = NULL;
+    return 0;
 }
 
-int luaopen_system(lua_State *L) {
-    static const luaL_Reg lib[] = {{"poll_event", f_poll_event},
-                                   {"set_cursor", f_set_cursor},
-                                   {"set_window_title", f_set_window_title},
-                                   {"set_window_mode", f_set_window_mode},
-                                   {"window_has_focus", f_window_has_focus},
-                                   {"show_confirm_dialog", f_show_confirm_dialog},
-                                   {"chdir", f_chdir},
-                                   {"list_dir", f_list_dir},
-                                   {"absolute_path", f_absolute_path},
-                                   {"get_file_info", f_get_file_info},
-                                   {"get_clipboard", f_get_clipboard},
-                                   {"set_clipboard", f_set_clipboard},
-                                   {"get_time", f_get_time},
-                                   {"sleep", f_sleep},
-                                   {"exec", f_exec},
-                                   {"fuzzy_match", f_fuzzy_match},
-                                   {NULL, NULL}};
+int luaopen_filesearch(lua_State *L) {
+    static const luaL_Reg methods[] = {{"poll", f_search_poll}, {"cancel", f_search_cancel}, {NULL, NULL}};
+    luaL_newmetatable(L, API_TYPE_SEARCH);
+    lua_pushcfunction(L, f_search_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    static const luaL_Reg lib[] = {{"start", f_search_start}, {NULL, NULL}};
     luaL_newlib(L, lib);
     return 1;
 }
@@ -1365,7 +5397,7 @@ int luaopen_system(lua_State *L) {
 // lite/api/api.c
 
 void api_load_libs(lua_State *L) {
-    static const luaL_Reg libs[] = {{"system", luaopen_system}, {"renderer", luaopen_renderer}, {NULL, NULL}};
+    static const luaL_Reg libs[] = {{"system", luaopen_system}, {"renderer", luaopen_renderer}, {"lexer", luaopen_lexer}, {"buffer", luaopen_buffer}, {"filesearch", luaopen_filesearch}, {NULL, NULL}};
     for (int i = 0; libs[i].name; i++) {
         luaL_requiref(L, libs[i].name, libs[i].func, 1);
     }
@@ -1374,46 +5406,138 @@ void api_load_libs(lua_State *L) {
 // ----------------------------------------------------------------------------
 // lite/main.c
 
+// glfw input goes to the focused context of that window
+static lt_context *lt_input_target(GLFWwindow *window) {
+    lt_context *ctx = lt_focused;
+    return ctx && ctx->window == window ? ctx : NULL;
+}
+
 static void _key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
     ImGui_ImplGlfw_KeyCallback(window, key, scancode, action, mods);
+    lt_context *ctx = lt_input_target(window);
+    if (!ctx) return;
     switch (action) {
         case GLFW_PRESS:
-            lt_key_down((key), scancode, mods);
+            lt_key_down(&ctx->input, (key), scancode, mods);
             break;
         case GLFW_RELEASE:
-            lt_key_up((key), scancode, mods);
+            lt_key_up(&ctx->input, (key), scancode, mods);
             break;
     }
+    lt_poke(ctx);
 }
 
 static void _char_callback(GLFWwindow *window, unsigned int c) {
     ImGui_ImplGlfw_CharCallback(window, c);
-    lt_char_down(c);
+    lt_context *ctx = lt_input_target(window);
+    if (!ctx) return;
+    lt_char_down(&ctx->input, c);
+    lt_poke(ctx);
 }
 
 static void _mouse_callback(GLFWwindow *window, int mouse, int action, int mods) {
     ImGui_ImplGlfw_MouseButtonCallback(window, mouse, action, mods);
+    lt_context *ctx = lt_input_target(window);
+    if (!ctx) return;
     switch (action) {
         case GLFW_PRESS:
-            lt_mouse_down((mouse));
+            lt_mouse_down(&ctx->input, (mouse));
             break;
         case GLFW_RELEASE:
-            lt_mouse_up((mouse));
+            lt_mouse_up(&ctx->input, (mouse));
             break;
     }
+    lt_poke(ctx);
 }
 
 static void _cursor_pos_callback(GLFWwindow *window, double x, double y) {
     ImGui_ImplGlfw_CursorPosCallback(window, x, y);
-    lt_mouse_move(ImVec2(x, -y));
+    lt_context *ctx = lt_input_target(window);
+    if (!ctx) return;
+    lt_mouse_move(&ctx->input, ImVec2(x, -y));
+    lt_poke(ctx);
 }
 
 static void _scroll_callback(GLFWwindow *window, double x, double y) {
     ImGui_ImplGlfw_ScrollCallback(window, x, y);
-    lt_scroll(ImVec2(x, y));
+    lt_context *ctx = lt_input_target(window);
+    if (!ctx) return;
+    lt_scroll(&ctx->input, ImVec2(x, y));
+    lt_poke(ctx);
+}
+
+#define LT_TICK_INTERVAL_MS 16  // LT_INIT_THREADED_TICK 下两次 tick 的最小间隔
+
+// message handler of the lua entry points: report, let core save unsaved docs, quit
+static int lt_on_error(lua_State *L) {
+    printf("Error: %s\n", luaL_tolstring(L, 1, NULL));
+    luaL_traceback(L, L, NULL, 1);
+    printf("%s\n", lua_tostring(L, -1));
+    lua_settop(L, 1);
+    if (lua_getglobal(L, "core") == LUA_TTABLE && lua_getfield(L, -1, "on_error") == LUA_TFUNCTION) {
+        lua_pushvalue(L, 1);
+        lua_pcall(L, 1, 0, 0);
+    }
+    // os.exit may be wrapped (workspace plugin saves on exit)
+    lua_getglobal(L, "os");
+    lua_getfield(L, -1, "exit");
+    lua_pushinteger(L, 1);
+    lua_pcall(L, 1, 0, 0);
+    exit(1);
 }
 
-void lt_init(lua_State *L, void *handle, const char *pathdata, int argc, char **argv, float scale, const char *platform) {
+// compiles and runs chunk under lt_on_error, leaves nresults on the stack
+static int lt_pcall_chunk(lua_State *L, const char *chunk, int nresults) {
+    lua_pushcfunction(L, lt_on_error);
+    int handler = lua_gettop(L);
+    int rc = luaL_loadstring(L, chunk);
+    if (rc == LUA_OK) rc = lua_pcall(L, 0, nresults, handler);
+    lua_remove(L, handler);
+    return rc;
+}
+
+static int timed_run_threads(lua_State *L) {
+    auto start = std::chrono::steady_clock::now();
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_call(L, 0, 0);
+    lt_current->tick.threads_ms += ms_since(start);
+    return 0;
+}
+
+static void tick_thread(lt_context *ctx);
+
+// binds ctx to the calling thread and returns the context bound before
+static lt_context *lt_makecurrent(lt_context *ctx) {
+    lt_context *prev = lt_current;
+    lt_current = ctx;
+    rstate = ctx ? ctx->ren : NULL;
+    rcache = ctx ? ctx->rencache : NULL;
+    return prev;
+}
+
+lt_context *lt_init(lua_State *L, void *handle, const char *pathdata, int argc, char **argv, float scale, const char *platform, unsigned flags) {
+    lt_context *ctx = new lt_context();
+    ctx->L = L;
+    ctx->window = (GLFWwindow *)handle;
+    ctx->flags = flags & ~LT_INIT_THREADED_TICK;  // core.init() still runs on this thread
+    ctx->surface.ctx = ctx;
+    ctx->back.ctx = ctx;
+    ctx->target = (flags & LT_INIT_THREADED_TICK) ? &ctx->back : &ctx->surface;
+    ctx->ren = new RenState();
+    ctx->rencache = new RenCache();
+    lt_context *prev = lt_makecurrent(ctx);
+
+    // the first editor gets the input until the host moves it with lt_setfocus
+    lt_context *none = NULL;
+    lt_focused.compare_exchange_strong(none, ctx);
+
+    if (flags & LT_INIT_THREADED_RASTER) {
+        rencache_set_workers(-1);
+    }
+    if ((flags & LT_INIT_PBO_UPLOAD) && !pbo_supported()) {
+        fprintf(stderr, "Warning: (" __FILE__ "): pixel buffer streaming needs GL 4.4 or ARB_buffer_storage, using synchronous uploads\n");
+    }
+
     // setup renderer
     ren_init(handle);
 
@@ -1447,66 +5571,234 @@ void lt_init(lua_State *L, void *handle, const char *pathdata, int argc, char **
 
     // init lite
     luaL_dostring(L, "core = {}");
-    luaL_dostring(L,
-                  "xpcall(function()\n"
-                  "  SCALE = tonumber(os.getenv(\"LITE_SCALE\")) or SCALE\n"
-                  "  PATHSEP = package.config:sub(1, 1)\n"
-                  "  USERDIR = NEKO_LITE_DIR .. '/data/user/'\n"
-                  "  package.path = NEKO_LITE_DIR .. '/data/?.lua;' .. package.path\n"
-                  "  package.path = NEKO_LITE_DIR .. '/data/?/init.lua;' .. package.path\n"
-                  "  core = require('core')\n"
-                  "  core.init()\n"
-                  "end, function(err)\n"
-                  "  print('Error: ' .. tostring(err))\n"
-                  "  print(debug.traceback(nil, 2))\n"
-                  "  if core and core.on_error then\n"
-                  "    pcall(core.on_error, err)\n"
-                  "  end\n"
-                  "  os.exit(1)\n"
-                  "end)");
+    lt_pcall_chunk(L,
+                   "SCALE = tonumber(os.getenv(\"LITE_SCALE\")) or SCALE\n"
+                   "PATHSEP = package.config:sub(1, 1)\n"
+                   "USERDIR = NEKO_LITE_DIR .. '/data/user/'\n"
+                   "package.path = NEKO_LITE_DIR .. '/data/?.lua;' .. package.path\n"
+                   "package.path = NEKO_LITE_DIR .. '/data/?/init.lua;' .. package.path\n"
+                   "core = require('core')\n"
+                   "core.init()\n",
+                   0);
+
+    // tick 入口只编译一次 每帧查 core.run1 以便插件替换它
+    luaL_loadstring(L, "return core.run1()");
+    ctx->tick_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    // core.run_threads 包一层计时
+    lua_getglobal(L, "core");
+    lua_getfield(L, -1, "run_threads");
+    lua_pushcclosure(L, timed_run_threads, 1);
+    lua_setfield(L, -2, "run_threads");
+    lua_pop(L, 1);
 
 #if 1
-    glfwSetKeyCallback(glfw_window, _key_callback);
-    glfwSetCharCallback(glfw_window, _char_callback);
-    glfwSetMouseButtonCallback(glfw_window, _mouse_callback);
-    glfwSetCursorPosCallback(glfw_window, _cursor_pos_callback);
-    glfwSetScrollCallback(glfw_window, _scroll_callback);
+    glfwSetKeyCallback(ctx->window, _key_callback);
+    glfwSetCharCallback(ctx->window, _char_callback);
+    glfwSetMouseButtonCallback(ctx->window, _mouse_callback);
+    glfwSetCursorPosCallback(ctx->window, _cursor_pos_callback);
+    glfwSetScrollCallback(ctx->window, _scroll_callback);
 #endif
+
+    lt_makecurrent(prev);
+    if (flags & LT_INIT_THREADED_TICK) {
+        ctx->flags = flags;
+        ctx->mailbox.window_focused = glfwGetWindowAttrib(ctx->window, GLFW_FOCUSED);
+        ctx->handoff.thread = std::thread(tick_thread, ctx);
+    }
+    return ctx;
+}
+
+// runs one core.run1() on the calling thread, ctx must be current. returns the
+// system.get_time() at which it wants to run again
+static double run_tick(lt_context *ctx) {
+    lua_State *L = ctx->L;
+    lt_tick_stats *t = &ctx->tick;
+    *t = lt_tick_stats{};
+    auto start = std::chrono::steady_clock::now();
+
+    lua_pushcfunction(L, lt_on_error);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->tick_ref);
+    double wake = 0;
+    if (lua_pcall(L, 0, 2, -2) == LUA_OK) {
+        wake = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+
+    t->total_ms = ms_since(start);
+    t->update_ms = t->total_ms - t->poll_ms - t->draw_ms - t->threads_ms;
+    std::lock_guard<std::mutex> lock(ctx->handoff.mutex);
+    ctx->tick_stats = *t;
+    return wake;
+}
+
+void lt_gettickstats(lt_context *ctx, lt_tick_stats *stats) {
+    std::lock_guard<std::mutex> lock(ctx->handoff.mutex);
+    *stats = ctx->tick_stats;
+}
+
+static double lt_time_s() { return lt_time_ms() / 1000.0; }
+
+static void tick_thread(lt_context *ctx) {
+    lt_makecurrent(ctx);
+    lt_handoff *h = &ctx->handoff;
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        int want_w, want_h;
+        {
+            std::lock_guard<std::mutex> lock(h->mutex);
+            if (h->quit) break;
+            want_w = h->want_w, want_h = h->want_h;
+        }
+        ctx->poke = false;
+        surface_resize(&ctx->back, want_w, want_h, false);
+        double wake = run_tick(ctx);
+        ctx->wake_at = wake;
+
+        std::unique_lock<std::mutex> lock(h->mutex);
+        h->wake.wait_until(lock, start + std::chrono::milliseconds(LT_TICK_INTERVAL_MS), [&] { return h->quit; });
+        // 空闲时睡到 lua 要求的时间 lt_poke 提前叫醒
+        auto woken = [&] { return h->quit || ctx->poke; };
+        h->sleeping = true;
+        double wait = wake - lt_time_s();
+        if (wait > 3600) {
+            h->wake.wait(lock, woken);
+        } else if (wait > 0) {
+            h->wake.wait_for(lock, std::chrono::duration<double>(wait), woken);
+        }
+        h->sleeping = false;
+    }
+}
+
+// main thread side of the glfw calls requested by the tick thread
+static void serve_mailbox(lt_context *ctx) {
+    lt_mailbox *m = &ctx->mailbox;
+    bool focused = glfwGetWindowAttrib(ctx->window, GLFW_FOCUSED);
+    if (m->window_focused.exchange(focused) != focused) lt_poke(ctx);
+
+    std::lock_guard<std::mutex> lock(m->mutex);
+    if (m->answered != m->asked) {
+        const char *text = glfwGetClipboardString(ctx->window);
+        m->has_clipboard = text != NULL;
+        m->clipboard = text ? text : "";
+        m->answered = m->asked;
+        m->done.notify_all();
+    }
+    if (m->set_clipboard) {
+        glfwSetClipboardString(ctx->window, m->new_clipboard.c_str());
+        m->set_clipboard = false;
+    }
+    if (m->focus) {
+        glfwFocusWindow(ctx->window);
+        m->focus = false;
+    }
 }
 
-void lt_tick(struct lua_State *L) {
-    luaL_dostring(L,
-                  "xpcall(function()\n"
-                  "  core.run1()\n"
-                  "end, function(err)\n"
-                  "  print('Error: ' .. tostring(err))\n"
-                  "  print(debug.traceback(nil, 2))\n"
-                  "  if core and core.on_error then\n"
-                  "    pcall(core.on_error, err)\n"
-                  "  end\n"
-                  "  os.exit(1)\n"
-                  "end)");
+double lt_tick(lt_context *ctx) {
+    if (lt_threaded(ctx)) {
+        // lua runs on the tick thread, only upload what it finished
+        serve_mailbox(ctx);
+        surface_present(ctx);
+        return std::max(0.0, ctx->wake_at - lt_time_s());
+    }
+    // 没有输入 计时也没到 不进 lua
+    if (!ctx->poke.exchange(false) && lt_time_s() < ctx->wake_at) {
+        return ctx->wake_at - lt_time_s();
+    }
+    lt_context *prev = lt_makecurrent(ctx);
+    ctx->wake_at = run_tick(ctx);
+    lt_makecurrent(prev);
+    return std::max(0.0, ctx->wake_at - lt_time_s());
 }
 
-void lt_fini() {
-    auto s = lt_getsurface(lt_window());
+// the lua_State is left to the caller, close it after this
+void lt_fini(lt_context *ctx) {
+    if (ctx->handoff.thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(ctx->handoff.mutex);
+            ctx->handoff.quit = true;
+        }
+        ctx->handoff.wake.notify_all();
+        {
+            std::lock_guard<std::mutex> lock(ctx->mailbox.mutex);
+            ctx->mailbox.quit = true;
+        }
+        ctx->mailbox.done.notify_all();
+        ctx->handoff.thread.join();
+    }
+
+    lt_context *prev = lt_makecurrent(ctx);
+    lt_context *focused = ctx;
+    lt_focused.compare_exchange_strong(focused, NULL);
+
+    rencache_set_workers(0);
+    glyph_prewarm_stop();
+    lt_surface *s = lt_getsurface(ctx);
+    pbo_ring_destroy(s->pbo);
+    s->pbo = NULL;
+    scroll_scratch_destroy(&ctx->scroll_scratch);
+    if (s->t.id) destroy_texture(&s->t);
+    s->t.id = 0;
     lt_free(s->pixels);
+    lt_free(ctx->back.pixels);
+    ren_free_state(ctx->ren);
+    rencache_free_state(ctx->rencache);
+    luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->tick_ref);
+
+    lt_makecurrent(prev == ctx ? NULL : prev);
+    delete ctx;
 }
 
-INPUT_WRAP_event *input_wrap_new_event(event_queue *equeue) {
-    INPUT_WRAP_event *event = equeue->events + equeue->head;
-    equeue->head = (equeue->head + 1) % INPUT_WRAP_CAPACITY;
-    assert(equeue->head != equeue->tail);
-    memset(event, 0, sizeof(INPUT_WRAP_event));
-    return event;
+void lt_setfocus(lt_context *ctx) {
+    lt_context *prev = lt_focused.exchange(ctx);
+    if (prev == ctx) return;
+    // 光标和 window_has_focus() 在两边都会变
+    lt_poke(ctx);
+    if (prev) lt_poke(prev);
+}
+
+void lt_setwindowrect(lt_context *ctx, int x, int y, int w, int h) {
+    std::lock_guard<std::mutex> lock(ctx->input_mutex);
+    ctx->wx = x, ctx->wy = y, ctx->ww = w, ctx->wh = h;
+}
+
+void lt_setmouse(lt_context *ctx, int x, int y) {
+    std::lock_guard<std::mutex> lock(ctx->input_mutex);
+    ctx->mx = x, ctx->my = y;
+}
+
+void input_wrap_post(event_queue *equeue, const INPUT_WRAP_event *event) {
+    if (!equeue->spilling.load(std::memory_order_acquire)) {
+        size_t head = equeue->head.load(std::memory_order_relaxed);
+        if (head - equeue->tail.load(std::memory_order_acquire) < INPUT_WRAP_CAPACITY) {
+            equeue->events[head % INPUT_WRAP_CAPACITY] = *event;
+            equeue->head.store(head + 1, std::memory_order_release);
+            return;
+        }
+    }
+    // ring 满了 之后的事件都排在 spill 里 直到消费者读空
+    std::lock_guard<std::mutex> lock(equeue->spill_mutex);
+    equeue->spill.push_back(*event);
+    equeue->spilling.store(true, std::memory_order_release);
 }
 
 int input_wrap_next_e(event_queue *equeue, INPUT_WRAP_event *event) {
     memset(event, 0, sizeof(INPUT_WRAP_event));
 
-    if (equeue->head != equeue->tail) {
-        *event = equeue->events[equeue->tail];
-        equeue->tail = (equeue->tail + 1) % INPUT_WRAP_CAPACITY;
+    size_t tail = equeue->tail.load(std::memory_order_relaxed);
+    if (tail != equeue->head.load(std::memory_order_acquire)) {
+        *event = equeue->events[tail % INPUT_WRAP_CAPACITY];
+        equeue->tail.store(tail + 1, std::memory_order_release);
+    } else if (equeue->spilling.load(std::memory_order_acquire)) {
+        // ring 已空且生产者仍在写 spill 这里的事件都比 ring 里的新
+        std::lock_guard<std::mutex> lock(equeue->spill_mutex);
+        if (equeue->spill_next < equeue->spill.size()) *event = equeue->spill[equeue->spill_next++];
+        if (equeue->spill_next == equeue->spill.size()) {
+            equeue->spill.clear();
+            equeue->spill_next = 0;
+            equeue->spilling.store(false, std::memory_order_release);
+        }
     }
 
     return event->type != INPUT_WRAP_NONE;
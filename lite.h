@@ -15,6 +15,10 @@ extern "C" {
 
 #include <imgui.h>
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 // opengl
 #include <GL/glew.h>
 
@@ -49,8 +53,6 @@ extern "C" {
 #define DIR_MAX 260
 #endif
 
-#define LT_DATAPATH "./"
-
 #define lt_assert(x) assert(x)
 
 #define lt_realpath(p, q) file_pathabs(p)
@@ -69,7 +71,7 @@ extern "C" {
 #define lt_getclipboard(w) window_clipboard()
 #define lt_setclipboard(w, s) window_setclipboard(s)
 
-#define lt_window() glfw_window
+#define lt_window() (lt_current->window)
 // #define lt_setwindowmode(m) window_fullscreen(m == 2), (m < 2 && (window_maximize(m), 1))  // 0:normal,1:maximized,2:fullscreen
 #define lt_setwindowmode(m)
 
@@ -87,22 +89,34 @@ typedef struct LT_Texture {
     int components;
 } LT_Texture;
 
+typedef struct lt_rect {
+    int x, y, width, height;
+} lt_rect;
+
+#define LT_SURFACE_MAX_SCROLLS 8
+
+typedef struct lt_context lt_context;
+
 typedef struct lt_surface {
+    struct lt_context *ctx;  // 所属的编辑器实例
     int w, h;
     void *pixels;
     LT_Texture t;
+    size_t upload_bytes;      // 上一帧上传到 t 的字节数
+    struct lt_pbo_ring *pbo;  // 非空时经由 PBO 环异步上传
+    int scroll_count;         // 已在 pixels 中完成 尚未应用到 t 的滚动
+    struct {
+        lt_rect rect;
+        int dy;
+    } scrolls[LT_SURFACE_MAX_SCROLLS];
 } lt_surface;
 
-typedef struct lt_rect {
-    int x, y, width, height;
-} lt_rect;
-
-extern int lt_mx, lt_my, lt_wx, lt_wy, lt_ww, lt_wh;
-
-lt_surface *lt_getsurface(void *window);
+lt_surface *lt_getsurface(lt_context *ctx);
 
 int lt_resizesurface(lt_surface *s, int ww, int wh);
 
+bool lt_scrollsurface(lt_surface *s, lt_rect rect, int dy);
+
 // ----------------------------------------------------------------------------
 
 #ifndef S_ISDIR
@@ -117,12 +131,16 @@ int lt_resizesurface(lt_surface *s, int ww, int wh);
 // lite/api.h
 
 #define API_TYPE_FONT "Font"
+#define API_TYPE_LEXER "Lexer"
+#define API_TYPE_BUFFER "Buffer"
+#define API_TYPE_SEARCH "FileSearch"
 
 // ----------------------------------------------------------------------------
 // lite/renderer.h
 
 typedef struct RenImage RenImage;
 typedef struct RenFont RenFont;
+typedef struct TextRun TextRun;
 
 typedef struct {
     uint8_t b, g, r, a;
@@ -132,6 +150,7 @@ typedef lt_rect RenRect;
 
 void ren_init(void *win);
 void ren_update_rects(RenRect *rects, int count);
+bool ren_scroll_rect(RenRect rect, int dy);
 void ren_set_clip_rect(RenRect rect);
 void ren_get_size(int *x, int *y);
 
@@ -149,10 +168,32 @@ void ren_draw_rect(RenRect rect, RenColor color);
 void ren_draw_image(RenImage *image, RenRect *sub, int x, int y, RenColor color);
 int ren_draw_text(RenFont *font, const char *text, int x, int y, RenColor color);
 
+TextRun *ren_get_text_run(RenFont *font, const char *text);
+int ren_get_text_run_width(TextRun *run);
+RenRect ren_get_text_run_ink(TextRun *run, int x, int y);
+void ren_draw_text_run(TextRun *run, int x, int y, RenColor color);
+void ren_text_cache_end_frame(void);
+void ren_get_text_cache_stats(unsigned *hits, unsigned *misses, unsigned *count);
+bool ren_prepare_text_runs(TextRun **runs, int count);
+
 // ----------------------------------------------------------------------------
 // lite/rencache.h
 
 void rencache_show_debug(bool enable);
+void rencache_set_cell_size(int size);
+void rencache_scroll_region(RenRect rect, int dy);
+
+typedef struct {
+    unsigned commands;
+    size_t command_bytes;
+    unsigned dirty_rects;
+    size_t dirty_pixels;
+    size_t upload_bytes;
+    double end_frame_ms;
+} RenCacheStats;
+
+// figures of the last rencache_end_frame
+void rencache_get_stats(RenCacheStats *stats);
 void rencache_free_font(RenFont *font);
 void rencache_set_clip_rect(RenRect rect);
 void rencache_draw_rect(RenRect rect, RenColor color);
@@ -160,11 +201,39 @@ int rencache_draw_text(RenFont *font, const char *text, int x, int y, RenColor c
 void rencache_invalidate(void);
 void rencache_begin_frame(void);
 void rencache_end_frame(void);
+void rencache_set_workers(int count);
 
 // neko lite
-void lt_init(lua_State *L, void *handle, const char *pathdata, int argc, char **argv, float scale, const char *platform);
-void lt_tick(struct lua_State *L);
-void lt_fini();
+enum {
+    LT_INIT_PBO_UPLOAD = 1 << 0,       // stream dirty rects through a ring of persistently mapped PBOs (needs GL 4.4 or ARB_buffer_storage + ARB_sync)
+    LT_INIT_THREADED_RASTER = 1 << 1,  // replay dirty regions on a pool of worker threads
+    LT_INIT_THREADED_TICK = 1 << 2,    // run lua and the renderer on a thread of their own, lt_tick then only uploads the latest frame
+};
+
+// one editor instance per context, each with its own lua_State and surface. a context
+// is only used by one thread at a time, different contexts may tick on different threads.
+// with LT_INIT_THREADED_TICK, lt_tick only uploads and must be called on the GL thread.
+// lt_tick returns the seconds until the editor has work again (0: call it next frame, HUGE_VAL:
+// only on input); hosts may sleep that long in glfwWaitEventsTimeout, input and the tick
+// thread wake them earlier through glfwPostEmptyEvent
+lt_context *lt_init(lua_State *L, void *handle, const char *pathdata, int argc, char **argv, float scale, const char *platform, unsigned flags = 0);
+double lt_tick(lt_context *ctx);
+void lt_fini(lt_context *ctx);
+
+typedef struct {
+    double poll_ms;     // system.poll_events
+    double update_ms;   // the rest of core.step
+    double draw_ms;     // renderer.begin_frame .. end_frame, raster included
+    double threads_ms;  // core.run_threads
+    double total_ms;
+} lt_tick_stats;
+
+// where the time of the last tick that ran lua went
+void lt_gettickstats(lt_context *ctx, lt_tick_stats *stats);
+
+void lt_setfocus(lt_context *ctx);                                   // glfw input of its window goes to ctx
+void lt_setwindowrect(lt_context *ctx, int x, int y, int w, int h);  // placement of the editor in the host window
+void lt_setmouse(lt_context *ctx, int x, int y);                     // mouse position relative to the editor
 
 typedef enum {
     INPUT_WRAP_NONE = 0,
@@ -221,58 +290,62 @@ typedef struct INPUT_WRAP_event {
 #define INPUT_WRAP_CAPACITY 256
 #endif
 
+// glfw 回调线程写 tick 线程读 ring 满时事件转入 spill 直到读空 保证按键不丢且不乱序
 typedef struct event_queue {
     INPUT_WRAP_event events[INPUT_WRAP_CAPACITY];
-    size_t head;
-    size_t tail;
+    alignas(64) std::atomic<size_t> head;  // 生产者
+    alignas(64) std::atomic<size_t> tail;  // 消费者
+    std::atomic<bool> spilling;
+    std::mutex spill_mutex;
+    std::vector<INPUT_WRAP_event> spill;
+    size_t spill_next;
 } event_queue;
 
-INPUT_WRAP_event *input_wrap_new_event(event_queue *equeue);
+void input_wrap_post(event_queue *equeue, const INPUT_WRAP_event *event);
 int input_wrap_next_e(event_queue *equeue, INPUT_WRAP_event *event);
 void input_wrap_free_e(INPUT_WRAP_event *event);
 
-#define INPUT_WRAP_DEFINE(NAME)                                              \
-    static event_queue NAME##_input_queue = {{INPUT_WRAP_NONE}, 0, 0};       \
-    static void NAME##_char_down(unsigned int c) {                           \
-        INPUT_WRAP_event *event = input_wrap_new_event(&NAME##_input_queue); \
-        event->type = INPUT_WRAP_CODEPOINT_INPUT;                            \
-        event->codepoint = c;                                                \
-    }                                                                        \
-    static void NAME##_key_down(int key, int scancode, int mods) {           \
-        INPUT_WRAP_event *event = input_wrap_new_event(&NAME##_input_queue); \
-        event->keyboard.key = key;                                           \
-        event->keyboard.scancode = scancode;                                 \
-        event->keyboard.mods = mods;                                         \
-        event->type = INPUT_WRAP_KEY_PRESSED;                                \
-    }                                                                        \
-    static void NAME##_key_up(int key, int scancode, int mods) {             \
-        INPUT_WRAP_event *event = input_wrap_new_event(&NAME##_input_queue); \
-        event->keyboard.key = key;                                           \
-        event->keyboard.scancode = scancode;                                 \
-        event->keyboard.mods = mods;                                         \
-        event->type = INPUT_WRAP_KEY_RELEASED;                               \
-    }                                                                        \
-    static void NAME##_mouse_down(int mouse) {                               \
-        INPUT_WRAP_event *event = input_wrap_new_event(&NAME##_input_queue); \
-        event->mouse.button = mouse;                                         \
-        event->type = INPUT_WRAP_BUTTON_PRESSED;                             \
-    }                                                                        \
-    static void NAME##_mouse_up(int mouse) {                                 \
-        INPUT_WRAP_event *event = input_wrap_new_event(&NAME##_input_queue); \
-        event->mouse.button = mouse;                                         \
-        event->type = INPUT_WRAP_BUTTON_RELEASED;                            \
-    }                                                                        \
-    static void NAME##_mouse_move(ImVec2 pos) {                              \
-        INPUT_WRAP_event *event = input_wrap_new_event(&NAME##_input_queue); \
-        event->type = INPUT_WRAP_CURSOR_MOVED;                               \
-        event->pos.x = (int)pos.x;                                           \
-        event->pos.y = (int)pos.y;                                           \
-    }                                                                        \
-    static void NAME##_scroll(ImVec2 scroll) {                               \
-        INPUT_WRAP_event *event = input_wrap_new_event(&NAME##_input_queue); \
-        event->type = INPUT_WRAP_SCROLLED;                                   \
-        event->scroll.x = scroll.x;                                          \
-        event->scroll.y = scroll.y;                                          \
+#define INPUT_WRAP_DEFINE(NAME)                                                        \
+    static void NAME##_char_down(event_queue *queue, unsigned int c) {                 \
+        INPUT_WRAP_event event = {INPUT_WRAP_CODEPOINT_INPUT};                         \
+        event.codepoint = c;                                                           \
+        input_wrap_post(queue, &event);                                                \
+    }                                                                                  \
+    static void NAME##_key_down(event_queue *queue, int key, int scancode, int mods) { \
+        INPUT_WRAP_event event = {INPUT_WRAP_KEY_PRESSED};                             \
+        event.keyboard.key = key;                                                      \
+        event.keyboard.scancode = scancode;                                            \
+        event.keyboard.mods = mods;                                                    \
+        input_wrap_post(queue, &event);                                                \
+    }                                                                                  \
+    static void NAME##_key_up(event_queue *queue, int key, int scancode, int mods) {   \
+        INPUT_WRAP_event event = {INPUT_WRAP_KEY_RELEASED};                            \
+        event.keyboard.key = key;                                                      \
+        event.keyboard.scancode = scancode;                                            \
+        event.keyboard.mods = mods;                                                    \
+        input_wrap_post(queue, &event);                                                \
+    }                                                                                  \
+    static void NAME##_mouse_down(event_queue *queue, int mouse) {                     \
+        INPUT_WRAP_event event = {INPUT_WRAP_BUTTON_PRESSED};                          \
+        event.mouse.button = mouse;                                                    \
+        input_wrap_post(queue, &event);                                                \
+    }                                                                                  \
+    static void NAME##_mouse_up(event_queue *queue, int mouse) {                       \
+        INPUT_WRAP_event event = {INPUT_WRAP_BUTTON_RELEASED};                         \
+        event.mouse.button = mouse;                                                    \
+        input_wrap_post(queue, &event);                                                \
+    }                                                                                  \
+    static void NAME##_mouse_move(event_queue *queue, ImVec2 pos) {                    \
+        INPUT_WRAP_event event = {INPUT_WRAP_CURSOR_MOVED};                            \
+        event.pos.x = (int)pos.x;                                                      \
+        event.pos.y = (int)pos.y;                                                      \
+        input_wrap_post(queue, &event);                                                \
+    }                                                                                  \
+    static void NAME##_scroll(event_queue *queue, ImVec2 scroll) {                     \
+        INPUT_WRAP_event event = {INPUT_WRAP_SCROLLED};                                \
+        event.scroll.x = scroll.x;                                                     \
+        event.scroll.y = scroll.y;                                                     \
+        input_wrap_post(queue, &event);                                                \
     }
 
 #endif
\ No newline at end of file
@@ -146,18 +146,15 @@ end
 
 function common.path_suggest(text)
     local path, name = text:match("^(.-)([^/\\]*)$")
-    local files = system.list_dir(path == "" and "." or path) or {}
+    local files = system.scan_dir(path == "" and "." or path) or {}
     local res = {}
-    for _, file in ipairs(files) do
-        file = path .. file
-        local info = system.get_file_info(file)
-        if info then
-            if info.type == "dir" then
-                file = file .. PATHSEP
-            end
-            if file:lower():find(text:lower(), nil, true) == 1 then
-                table.insert(res, file)
-            end
+    for _, info in ipairs(files) do
+        local file = path .. info.filename
+        if info.type == "dir" then
+            file = file .. PATHSEP
+        end
+        if file:lower():find(text:lower(), nil, true) == 1 then
+            table.insert(res, file)
         end
     end
     return res
@@ -5,6 +5,7 @@ config.max_log_items = 80
 config.message_timeout = 6 -- neko hack 3>6
 config.mouse_wheel_scroll = 50 * SCALE
 config.file_size_limit = 10
+config.large_file_size = 32 * 1024 * 1024 -- bytes; bigger files are memory-mapped and indexed in the background
 config.ignore_files = "^%."
 config.symbol_pattern = "[%a_][%w_]*"
 config.non_word_chars = " \t\n/\\()\"':,.;<>~!@#$%^&*|+=[]{}`?-"
@@ -40,6 +40,7 @@ end
 
 function Highlighter:reset()
   self.lines = {}
+  self.cached = 0
   self.first_invalid_line = 1
   self.max_wanted_line = 0
 end
@@ -65,15 +66,23 @@ function Highlighter:get_line(idx)
   if not line or line.text ~= self.doc.lines[idx] then
     local prev = self.lines[idx - 1]
     line = self:tokenize_line(idx, prev and prev.state)
+    if self.doc.large then
+      -- large files only tokenize what is drawn and keep a bounded cache
+      self.cached = self.cached + 1
+      if self.cached > 4096 then self.lines, self.cached = {}, 1 end
+    end
     self.lines[idx] = line
   end
-  self.max_wanted_line = math.max(self.max_wanted_line, idx)
+  if not self.doc.large then
+    self.max_wanted_line = math.max(self.max_wanted_line, idx)
+  end
   return line
 end
 
 
 function Highlighter:each_token(idx)
-  return tokenizer.each_token(self:get_line(idx).tokens)
+  local line = self:get_line(idx)
+  return tokenizer.each_token(line.tokens, line.text)
 end
 
 
@@ -1,22 +1,16 @@
+local core = require "core"
 local Object = require "core.object"
 local Highlighter = require "core.doc.highlighter"
 local syntax = require "core.syntax"
 local config = require "core.config"
 local common = require "core.common"
+local buffer = require "buffer"
 
 
 local Doc = Object:extend()
 
 local unpack = table.unpack
 
-local function split_lines(text)
-  local res = {}
-  for line in (text .. "\n"):gmatch("(.-)\n") do
-    table.insert(res, line)
-  end
-  return res
-end
-
 function Doc:new(filename)
   self:reset()
   if filename then
@@ -26,7 +20,9 @@ end
 
 
 function Doc:reset()
-  self.lines = { "\n" }
+  -- native text buffer; indexing it returns a line (with its "\n"), # gives
+  -- the line count, so it reads like the old array of line strings
+  self.lines = buffer.new()
   self.selections = { 1, 1, 1, 1 }
   self.cursor_clipboard = {}
   self.undo_stack = { idx = 1 }
@@ -54,33 +50,28 @@ end
 
 
 function Doc:load(filename)
-  local fp = assert( io.open(filename, "rb") )
+  local lines, crlf, large = assert( buffer.load(filename, config.large_file_size) )
   self:reset()
   self:set_filename(filename)
-  self.lines = {}
-  for line in fp:lines() do
-    if line:byte(-1) == 13 then
-      line = line:sub(1, -2)
-      self.crlf = true
-    end
-    table.insert(self.lines, line .. "\n")
-  end
-  if #self.lines == 0 then
-    table.insert(self.lines, "\n")
+  self.lines, self.crlf, self.large = lines, crlf, large
+  if large then
+    -- large files are mapped and their lines indexed in the background;
+    -- pick up the newly indexed lines until the whole file is in
+    core.add_thread(function()
+      while self.lines == lines and not lines:sync() do
+        core.redraw = true
+        coroutine.yield(0.05)
+      end
+      core.redraw = true
+    end, self)
   end
-  fp:close()
   self:reset_syntax()
 end
 
 
 function Doc:save(filename)
   filename = filename or assert(self.filename, "no filename set to default to")
-  local fp = assert( io.open(filename, "wb") )
-  for _, line in ipairs(self.lines) do
-    if self.crlf then line = line:gsub("\n", "\r\n") end
-    fp:write(line)
-  end
-  fp:close()
+  assert( self.lines:save(filename, self.crlf) )
   if filename then
     self:set_filename(filename)
   end
@@ -249,15 +240,7 @@ function Doc:get_text(line1, col1, line2, col2)
   line1, col1 = self:sanitize_position(line1, col1)
   line2, col2 = self:sanitize_position(line2, col2)
   line1, col1, line2, col2 = sort_positions(line1, col1, line2, col2)
-  if line1 == line2 then
-    return self.lines[line1]:sub(col1, col2 - 1)
-  end
-  local lines = { self.lines[line1]:sub(col1) }
-  for i = line1 + 1, line2 - 1 do
-    table.insert(lines, self.lines[i])
-  end
-  table.insert(lines, self.lines[line2]:sub(1, col2 - 1))
-  return table.concat(lines)
+  return self.lines:get_text(line1, col1, line2, col2)
 end
 
 
@@ -307,21 +290,9 @@ end
 
 
 function Doc:raw_insert(line, col, text, undo_stack, time)
-  -- split text into lines and merge with line at insertion point
-  local lines = split_lines(text)
-  local before = self.lines[line]:sub(1, col - 1)
-  local after = self.lines[line]:sub(col)
-  for i = 1, #lines - 1 do
-    lines[i] = lines[i] .. "\n"
-  end
-  lines[1] = before .. lines[1]
-  lines[#lines] = lines[#lines] .. after
-
-  -- splice lines into line array
-  common.splice(self.lines, line, 1, lines)
+  local line2, col2 = self.lines:insert(line, col, text)
 
   -- push undo
-  local line2, col2 = self:position_offset(line, col, #text)
   push_undo(undo_stack, time, "selection", unpack(self.selections))
   push_undo(undo_stack, time, "remove", line, col, line2, col2)
 
@@ -337,12 +308,7 @@ function Doc:raw_remove(line1, col1, line2, col2, undo_stack, time)
   push_undo(undo_stack, time, "selection", unpack(self.selections))
   push_undo(undo_stack, time, "insert", line1, col1, text)
 
-  -- get line content before/after removed text
-  local before = self.lines[line1]:sub(1, col1 - 1)
-  local after = self.lines[line2]:sub(col2)
-
-  -- splice line into line array
-  common.splice(self.lines, line1, line2 - line1 + 1, { before .. after })
+  self.lines:remove(line1, col1, line2, col2)
 
   -- update highlighter and assure selection is in bounds
   self.highlighter:invalidate(line1)
@@ -292,6 +292,7 @@ function DocView:update()
       core.redraw = true
     end
     core.blink_timer = tb
+    core.wake_at(t0 + (math.floor((tb - t0) / (T / 2)) + 1) * (T / 2))
   end
 
   DocView.super.update(self)
@@ -367,6 +368,12 @@ end
 
 
 function DocView:draw()
+  -- let the renderer shift what is still on screen instead of redrawing it
+  local pos, size = self.position, self.size
+  local _, oy = self:get_content_offset()
+  renderer.scroll_region(pos.x, pos.y, size.x + pos.x % 1, size.y + pos.y % 1, oy - (self.last_content_y or oy))
+  self.last_content_y = oy
+
   self:draw_background(style.background)
 
   local font = self:get_font()
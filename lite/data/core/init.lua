@@ -23,46 +23,26 @@ local function project_scan_thread()
     end
   end
 
-  local function compare_file(a, b)
-    return a.filename < b.filename
-  end
-
-  local function get_files(path, t)
+  -- one directory per resume; scan_dir filters, stats and sorts it natively
+  local function get_files(path, t, depth)
     coroutine.yield()
-    t = t or {}
-    local size_limit = config.file_size_limit * 10e5
-    local all = system.list_dir(path) or {}
-    local dirs, files = {}, {}
-
-    for _, file in ipairs(all) do
-      if not common.match_pattern(file, config.ignore_files) then
-        local file = (path ~= "." and path .. PATHSEP or "") .. file
-        local info = system.get_file_info(file)
-        if info and info.size < size_limit then
-          info.filename = file
---< https://github.com/0xd61/lite/blob/e5e7a2dc8c3e7d3f7f92ea5124bc111126ccfa1f/data/core/init.lua#L48-L68
-          local _, depth1 = file:gsub("/","")
-          local _, depth2 = file:gsub("\\","")
-          if (depth1+depth2) < config.project_scan_depth or config.project_scan_depth == 0 then
-            table.insert(info.type == "dir" and dirs or files, info)
-          end
-        end
-        if (#dirs + #files) >= config.project_max_files_per_folder then break end
---<
+    t, depth = t or {}, depth or 0
+    local prefix = path ~= "." and path .. PATHSEP or ""
+    local descend = depth + 1 < config.project_scan_depth or config.project_scan_depth == 0
+    local entries = system.scan_dir(path, {
+      ignore = config.ignore_files,
+      size_limit = config.file_size_limit * 10e5,
+      max_files = config.project_max_files_per_folder,
+    }) or {}
+
+    for _, info in ipairs(entries) do
+      info.filename = prefix .. info.filename
+      table.insert(t, info)
+      if info.type == "dir" and descend then
+        get_files(info.filename, t, depth + 1)
       end
     end
 
-    table.sort(dirs, compare_file)
-    for _, f in ipairs(dirs) do
-      table.insert(t, f)
-      get_files(f.filename, t)
-    end
-
-    table.sort(files, compare_file)
-    for _, f in ipairs(files) do
-      table.insert(t, f)
-    end
-
     return t
   end
 
@@ -110,6 +90,7 @@ function core.init()
   core.project_files = {}
   core.blink_start = system.get_time()
   core.blink_timer = core.blink_start
+  core.next_wake = math.huge
   core.redraw = true
 
   core.root_view = RootView()
@@ -387,13 +368,19 @@ function core.on_event(type, ...)
 end
 
 
+local events = {}
+
 function core.step()
   -- handle events
   local did_keymap = false
   local mouse_moved = false
   local mouse = { x = 0, y = 0, dx = 0, dy = 0 }
+  core.next_wake = math.huge
 
-  for type, a,b,c,d in system.poll_event do
+  -- all pending events arrive at once, 5 slots each: type, a, b, c, d
+  local n = system.poll_events(events)
+  for i = 1, n * 5, 5 do
+    local type, a, b, c, d = table.unpack(events, i, i + 4)
     if type == "mousemoved" then
       mouse_moved = true
       mouse.x, mouse.y = a, b
@@ -448,7 +435,7 @@ function core.step()
 end
 
 
-local run_threads = coroutine.wrap(function()
+core.run_threads = coroutine.wrap(function()
   while true do
     local max_time = 1 / config.fps - 0.004
     local ran_any_threads = false
@@ -480,10 +467,20 @@ local run_threads = coroutine.wrap(function()
 end)
 
 -- neko hack { split core.run() into core.run1()
+-- the earliest system.get_time() at which core.run1() has work again
+function core.get_wake_time(did_redraw)
+  if did_redraw then return 0 end
+  local wake = core.next_wake or math.huge
+  for _, thread in pairs(core.threads) do
+    wake = math.min(wake, thread.wake)
+  end
+  return wake
+end
+
 function core.run1()
   local did_redraw = core.step()
-  run_threads()
-  return did_redraw
+  core.run_threads()
+  return did_redraw, core.get_wake_time(did_redraw)
 end
 
 function core.run()
@@ -496,6 +493,11 @@ function core.run()
 end
 -- neko hack } split core.run() into core.run1()
 
+-- for views that change at time t without any input, call it from update()
+function core.wake_at(t)
+  core.next_wake = math.min(core.next_wake, t)
+end
+
 function core.blink_reset()
   core.blink_start = system.get_time()
 end
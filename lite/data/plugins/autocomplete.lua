@@ -32,6 +32,8 @@ core.add_thread(function()
   local function get_symbols(doc)
     local i = 1
     local s = {}
+    -- a large doc is never walked line by line, that would copy the whole file into lua
+    if doc.large then return s end
     while i < #doc.lines do
       for sym in doc.lines[i]:gmatch(config.symbol_pattern) do
         s[sym] = true
@@ -24,6 +24,7 @@ function ResultsView:get_name()
 end
 
 
+-- used by fuzzy search, plain and pattern searches run in filesearch threads
 local function find_all_matches_in_file(t, filename, fn)
   local fp = io.open(filename)
   if not fp then return t end
@@ -45,6 +46,8 @@ local function find_all_matches_in_file(t, filename, fn)
 end
 
 
+-- `fn` is either a per-line predicate or { pattern = bool, insensitive = bool }
+-- for a native search
 function ResultsView:begin_search(path, text, fn)
   self.search_args = { path, text, fn }
   self.results = {}
@@ -53,20 +56,40 @@ function ResultsView:begin_search(path, text, fn)
   self.searching = true
   self.selected_idx = 0
 
+  self.files = {}
+  for _, file in ipairs(core.project_files) do
+    if file.type == "file" and (not path or file.filename:find(path, 1, true) == 1) then
+      table.insert(self.files, file.filename)
+    end
+  end
+
+  if self.search then self.search:cancel() end
+  self.search = nil
+  if type(fn) == "table" then
+    self.search = filesearch.start(self.files, text, fn.pattern, fn.insensitive)
+  end
+
+  local search, results = self.search, self.results
   core.add_thread(function()
-    local i = 1
-    for dir_name, file in core.get_project_files() do
-      if file.type == "file" and (not path or (dir_name .. "/" .. file.filename):find(path, 1, true) == 1) then
-        local truncated_path = (dir_name == core.project_dir and "" or (dir_name .. PATHSEP))
-        find_all_matches_in_file(self.results, truncated_path .. file.filename, fn)
+    if search then
+      while true do
+        local n, finished, err = search:poll(results)
+        self.last_file_idx = n
+        core.redraw = true
+        if err then core.error("Project search: %s", err) end
+        if finished then break end
+        coroutine.yield(0.02)
+      end
+    else
+      for i, filename in ipairs(self.files) do
+        find_all_matches_in_file(results, filename, fn)
+        self.last_file_idx = i
       end
-      self.last_file_idx = i
-      i = i + 1
     end
     self.searching = false
     self.brightness = 100
     core.redraw = true
-  end, self.results)
+  end, results)
 
   self.scroll.to.y = 0
 end
@@ -171,7 +194,7 @@ function ResultsView:draw()
   -- status
   local ox, oy = self:get_content_offset()
   local x, y = ox + style.padding.x, oy + style.padding.y
-  local files_number = core.project_files_number()
+  local files_number = #self.files
   local per = common.clamp(files_number and self.last_file_idx / files_number or 1, 0, 1)
   local text
   if self.searching then
@@ -221,7 +244,7 @@ end
 
 ---@param path string
 ---@param text string
----@param fn fun(line_text:string):...
+---@param fn (fun(line_text:string):...)|{pattern:boolean?,insensitive:boolean?}
 ---@return plugins.projectsearch.resultsview?
 local function begin_search(path, text, fn)
   if text == "" then
@@ -229,7 +252,7 @@ local function begin_search(path, text, fn)
     return
   end
   local rv = ResultsView(path, text, fn)
-  core.root_view:get_active_node_default():add_view(rv)
+  core.root_view:get_active_node():add_view(rv)
   return rv
 end
 
@@ -243,15 +266,14 @@ local function get_selected_text()
 end
 
 
+-- project_files names are relative to the project directory
 local function normalize_path(path)
   if not path then return nil end
-  path = common.normalize_path(path)
-  for i, project_dir in ipairs(core.project_directories) do
-    if common.path_belongs_to(path, project_dir.name) then
-      return project_dir.item.filename .. PATHSEP .. common.relative_path(project_dir.name, path)
-    end
+  local project_dir = system.absolute_path(".")
+  if path:find(project_dir, 1, true) == 1 then
+    path = path:sub(#project_dir + 2)
   end
-  return path
+  return path ~= "" and path or nil
 end
 
 ---@class plugins.projectsearch
@@ -265,31 +287,15 @@ projectsearch.ResultsView = ResultsView
 ---@param insensitive? boolean
 ---@return plugins.projectsearch.resultsview?
 function projectsearch.search_plain(text, path, insensitive)
-  if insensitive then text = text:lower() end
-  return begin_search(path, text, function(line_text)
-    if insensitive then
-      return line_text:lower():find(text, nil, true)
-    else
-      return line_text:find(text, nil, true)
-    end
-  end)
+  return begin_search(path, text, { insensitive = insensitive })
 end
 
 ---@param text string
 ---@param path string
 ---@param insensitive? boolean
 ---@return plugins.projectsearch.resultsview?
-function projectsearch.search_regex(text, path, insensitive)
-  local re, errmsg
-  if insensitive then
-    re, errmsg = regex.compile(text, "i")
-  else
-    re, errmsg = regex.compile(text)
-  end
-  if not re then core.log("%s", errmsg) return end
-  return begin_search(path, text, function(line_text)
-    return regex.cmatch(re, line_text)
-  end)
+function projectsearch.search_pattern(text, path, insensitive)
+  return begin_search(path, text, { pattern = true, insensitive = insensitive })
 end
 
 ---@param text string
@@ -310,31 +316,26 @@ end
 
 command.add(nil, {
   ["project-search:find"] = function(path)
-    core.command_view:enter("Find Text In " .. (normalize_path(path) or "Project"), {
-      text = get_selected_text(),
-      select_text = true,
-      submit = function(text)
-        projectsearch.search_plain(text, path, true)
-      end
-    })
+    path = normalize_path(path)
+    core.command_view:set_text(get_selected_text() or "", true)
+    core.command_view:enter("Find Text In " .. (path or "Project"), function(text)
+      projectsearch.search_plain(text, path, true)
+    end)
   end,
 
-  ["project-search:find-regex"] = function(path)
-    core.command_view:enter("Find Regex In " .. (normalize_path(path) or "Project"), {
-      submit = function(text)
-        projectsearch.search_regex(text, path, true)
-      end
-    })
+  ["project-search:find-pattern"] = function(path)
+    path = normalize_path(path)
+    core.command_view:enter("Find Pattern In " .. (path or "Project"), function(text)
+      projectsearch.search_pattern(text, path, true)
+    end)
   end,
 
   ["project-search:fuzzy-find"] = function(path)
-    core.command_view:enter("Fuzzy Find Text In " .. (normalize_path(path) or "Project"), {
-      text = get_selected_text(),
-      select_text = true,
-      submit = function(text)
-        projectsearch.search_fuzzy(text, path, true)
-      end
-    })
+    path = normalize_path(path)
+    core.command_view:set_text(get_selected_text() or "", true)
+    core.command_view:enter("Fuzzy Find Text In " .. (path or "Project"), function(text)
+      projectsearch.search_fuzzy(text, path, true)
+    end)
   end,
 })
 
@@ -18,7 +18,7 @@ function tokenizer.tokenize(syntax, text, state)
   local newres = {}
   -- split parens out
   -- the stock tokenizer can't do this because it merges identical adjacent tokens
-  for i, type, text in tokenizer.each_token(res) do
+  for i, type, text in tokenizer.each_token(res, text) do
     if type == "normal" or type == "symbol" then
       for normtext1, paren, normtext2 in text:gmatch("([^%(%[{}%]%)]*)([%(%[{}%]%)]?)([^%(%[{}%]%)]*)") do
         if #normtext1 > 0 then
@@ -0,0 +1,111 @@
+-- Doc's array of line strings as it was before the native buffer, kept as the reference
+-- test_buffer.cpp checks the buffer module against. the bodies are those of the old
+-- Doc:load, Doc:save, Doc:get_text, Doc:raw_insert, Doc:raw_remove and position_offset
+
+local common = require "core.common"
+
+local Lines = {}
+Lines.__index = Lines
+
+local function split_lines(text)
+  local res = {}
+  for line in (text .. "\n"):gmatch("(.-)\n") do
+    table.insert(res, line)
+  end
+  return res
+end
+
+local function sort_positions(line1, col1, line2, col2)
+  if line1 > line2 or line1 == line2 and col1 > col2 then
+    return line2, col2, line1, col1
+  end
+  return line1, col1, line2, col2
+end
+
+function Lines.load(filename)
+  local self = setmetatable({ lines = {}, crlf = false }, Lines)
+  local fp = assert( io.open(filename, "rb") )
+  for line in fp:lines() do
+    if line:byte(-1) == 13 then
+      line = line:sub(1, -2)
+      self.crlf = true
+    end
+    table.insert(self.lines, line .. "\n")
+  end
+  if #self.lines == 0 then
+    table.insert(self.lines, "\n")
+  end
+  fp:close()
+  return self
+end
+
+function Lines:save(filename, crlf)
+  local fp = assert( io.open(filename, "wb") )
+  for _, line in ipairs(self.lines) do
+    if crlf then line = line:gsub("\n", "\r\n") end
+    fp:write(line)
+  end
+  fp:close()
+end
+
+function Lines:sanitize_position(line, col)
+  line = common.clamp(line, 1, #self.lines)
+  col = common.clamp(col, 1, #self.lines[line])
+  return line, col
+end
+
+function Lines:position_offset(line, col, offset)
+  line, col = self:sanitize_position(line, col)
+  col = col + offset
+  while line > 1 and col < 1 do
+    line = line - 1
+    col = col + #self.lines[line]
+  end
+  while line < #self.lines and col > #self.lines[line] do
+    col = col - #self.lines[line]
+    line = line + 1
+  end
+  return self:sanitize_position(line, col)
+end
+
+function Lines:get_text(line1, col1, line2, col2)
+  line1, col1 = self:sanitize_position(line1, col1)
+  line2, col2 = self:sanitize_position(line2, col2)
+  line1, col1, line2, col2 = sort_positions(line1, col1, line2, col2)
+  if line1 == line2 then
+    return self.lines[line1]:sub(col1, col2 - 1)
+  end
+  local lines = { self.lines[line1]:sub(col1) }
+  for i = line1 + 1, line2 - 1 do
+    table.insert(lines, self.lines[i])
+  end
+  table.insert(lines, self.lines[line2]:sub(1, col2 - 1))
+  return table.concat(lines)
+end
+
+function Lines:insert(line, col, text)
+  -- split text into lines and merge with line at insertion point
+  local lines = split_lines(text)
+  local before = self.lines[line]:sub(1, col - 1)
+  local after = self.lines[line]:sub(col)
+  for i = 1, #lines - 1 do
+    lines[i] = lines[i] .. "\n"
+  end
+  lines[1] = before .. lines[1]
+  lines[#lines] = lines[#lines] .. after
+
+  -- splice lines into line array
+  common.splice(self.lines, line, 1, lines)
+  return self:position_offset(line, col, #text)
+end
+
+function Lines:remove(line1, col1, line2, col2)
+  -- get line content before/after removed text
+  local before = self.lines[line1]:sub(1, col1 - 1)
+  local after = self.lines[line2]:sub(col2)
+
+  -- splice line into line array
+  common.splice(self.lines, line1, line2 - line1 + 1, { before .. after })
+end
+
+return Lines
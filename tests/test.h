@@ -0,0 +1,64 @@
+// tests and benchmarks build lite.cpp into the program so they can reach its internals
+
+#ifndef LITE_TEST_H
+#define LITE_TEST_H
+
+#include "../lite.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(x)                                                                    \
+    do {                                                                            \
+        if (!(x)) {                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+            exit(1);                                                                \
+        }                                                                           \
+    } while (0)
+
+#define TEST_FONT "lite/data/fonts/font.ttf"
+#define TEST_MONO_FONT "lite/data/fonts/monospace.ttf"
+
+// an editor context drawing into a cpu only surface: no window, no texture and no lua
+static lt_context *test_context(int w, int h) {
+    lt_context *ctx = new lt_context();
+    ctx->surface.ctx = ctx;
+    ctx->back.ctx = ctx;
+    ctx->target = &ctx->surface;
+    ctx->ren = new RenState();
+    ctx->rencache = new RenCache();
+    lt_makecurrent(ctx);
+    surface_resize(&ctx->surface, w, h, false);
+    ren_init(NULL);
+    return ctx;
+}
+
+static void test_free_context(lt_context *ctx) {
+    lt_makecurrent(ctx);
+    rencache_set_workers(0);
+    lt_free(ctx->surface.pixels);
+    ren_free_state(ctx->ren);
+    rencache_free_state(ctx->rencache);
+    lt_makecurrent(NULL);
+    delete ctx;
+}
+
+// a lua state with the editor's native modules loaded
+static lua_State *test_lua() {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    api_load_libs(L);
+    return L;
+}
+
+// runs a chunk, failing the test with its error
+static void test_lua_run(lua_State *L, const char *chunk) {
+    if (luaL_dostring(L, chunk) != LUA_OK) {
+        fprintf(stderr, "lua: %s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+}
+
+static double test_now_ms() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+#endif
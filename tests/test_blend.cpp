@@ -0,0 +1,122 @@
+// blend kernels: every vector kernel the cpu can run gives the scalar kernel's pixels,
+// bit for bit, for any span length and alignment
+
+#include <random>
+
+#include "test.h"
+
+typedef struct {
+    const char *name;
+    blend_coverage_span_fn coverage;
+    blend_image_span_fn image;
+    blend_rect_span_fn rect;
+    fill_span_fn fill;
+} Kernels;
+
+#define SPAN_MAX 80
+#define GUARD 8
+
+static std::mt19937 rng(3);
+
+static RenColor random_color() {
+    // a fourth of the channels at the ends, where the rounding of the kernels differs first
+    uint8_t c[4];
+    for (int i = 0; i < 4; i++) {
+        int r = rng() % 8;
+        c[i] = r == 0 ? 0 : r == 1 ? 0xff : (uint8_t)rng();
+    }
+    return RenColor{c[0], c[1], c[2], c[3]};
+}
+
+static void fill_random(void *p, size_t size) {
+    uint8_t *b = (uint8_t *)p;
+    for (size_t i = 0; i < size; i++) {
+        int r = rng() % 8;
+        b[i] = r == 0 ? 0 : r == 1 ? 0xff : (uint8_t)rng();
+    }
+}
+
+// runs the same span through the scalar kernel and k, on spans that start off any 32 byte
+// boundary, and checks the pixels around the span are left alone
+static void check_kernels(const Kernels &k, int rounds) {
+    alignas(32) RenColor want[SPAN_MAX + 2 * GUARD], got[SPAN_MAX + 2 * GUARD], src[SPAN_MAX + GUARD];
+    alignas(32) uint8_t cov[SPAN_MAX + GUARD];
+    for (int r = 0; r < rounds; r++) {
+        int n = rng() % (SPAN_MAX + 1), off = rng() % GUARD, soff = rng() % GUARD;
+        RenColor color = random_color();
+        fill_random(src, sizeof(src));
+        fill_random(cov, sizeof(cov));
+        for (int op = 0; op < 4; op++) {
+            fill_random(want, sizeof(want));
+            memcpy(got, want, sizeof(want));
+            RenColor *w = want + off, *g = got + off;
+            if (op == 0) {
+                blend_coverage_span_scalar(w, cov + soff, n, color);
+                k.coverage(g, cov + soff, n, color);
+            } else if (op == 1) {
+                blend_image_span_scalar(w, src + soff, n, color);
+                k.image(g, src + soff, n, color);
+            } else if (op == 2) {
+                blend_rect_span_scalar(w, n, color);
+                k.rect(g, n, color);
+            } else {
+                fill_span_scalar(w, n, color);
+                k.fill(g, n, color);
+            }
+            if (memcmp(want, got, sizeof(want))) {
+                static const char *ops[] = {"coverage", "image", "rect", "fill"};
+                fprintf(stderr, "%s %s: n=%d off=%d color=%d,%d,%d,%d\n", k.name, ops[op], n, off, color.r, color.g, color.b, color.a);
+                CHECK(!"span differs from the scalar kernel");
+            }
+        }
+    }
+}
+
+// every source alpha against every color alpha, the products the kernels round differently
+static void check_alphas(const Kernels &k) {
+    RenColor want[256], got[256], src[256];
+    uint8_t cov[256];
+    for (int ca = 0; ca < 256; ca++) {
+        RenColor color = {(uint8_t)(ca * 7), (uint8_t)(255 - ca), 0xff, (uint8_t)ca};
+        for (int i = 0; i < 256; i++) {
+            cov[i] = (uint8_t)i;
+            src[i] = RenColor{(uint8_t)(i * 3), 0xff, (uint8_t)(255 - i), (uint8_t)i};
+            want[i] = RenColor{(uint8_t)(255 - i), (uint8_t)i, 0xff, (uint8_t)(i * 5)};
+        }
+        memcpy(got, want, sizeof(want));
+        blend_coverage_span_scalar(want, cov, 256, color);
+        k.coverage(got, cov, 256, color);
+        CHECK(!memcmp(want, got, sizeof(want)));
+        blend_image_span_scalar(want, src, 256, color);
+        k.image(got, src, 256, color);
+        CHECK(!memcmp(want, got, sizeof(want)));
+        blend_rect_span_scalar(want, 256, color);
+        k.rect(got, 256, color);
+        CHECK(!memcmp(want, got, sizeof(want)));
+    }
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+    std::vector<Kernels> sets;
+#if defined(LT_ARCH_X86)
+    sets.push_back(Kernels{"sse2", blend_coverage_span_sse2, blend_image_span_sse2, blend_rect_span_sse2, fill_span_sse2});
+    if (cpu_has_avx2()) {
+        sets.push_back(Kernels{"avx2", blend_coverage_span_avx2, blend_image_span_avx2, blend_rect_span_avx2, fill_span_sse2});
+    } else {
+        printf("blend: no avx2 on this cpu, skipped\n");
+    }
+#elif defined(LT_ARCH_NEON)
+    sets.push_back(Kernels{"neon", blend_coverage_span_neon, blend_image_span_neon, blend_rect_span_neon, fill_span_scalar});
+#endif
+    // and whatever ren_init_kernels picks for the running cpu
+    ren_init_kernels();
+    sets.push_back(Kernels{"selected", blend_coverage_span, blend_image_span, blend_rect_span, fill_span});
+
+    for (const Kernels &k : sets) {
+        check_alphas(k);
+        check_kernels(k, rounds);
+        printf("blend %s: ok\n", k.name);
+    }
+    return 0;
+}
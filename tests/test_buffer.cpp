@@ -0,0 +1,133 @@
+// the native text buffer against the array of line strings Doc kept before it
+// (tests/buffer_ref.lua): loading, line reads, inserts, removes, get_text and saving, on the
+// repo's own sources and on texts made of the line ends the loader has to normalise
+
+#include <filesystem>
+
+#include "test.h"
+
+static const char *compare_lua = R"lua(
+local files, tmp = ...
+package.path = "lite/data/?.lua;lite/data/?/init.lua;" .. package.path
+local buffer = require "buffer"
+local Lines = dofile("tests/buffer_ref.lua")
+
+local function read(filename)
+  local fp = assert(io.open(filename, "rb"))
+  local text = fp:read("a")
+  fp:close()
+  return text
+end
+
+local function write(filename, text)
+  local fp = assert(io.open(filename, "wb"))
+  fp:write(text)
+  fp:close()
+end
+
+local function check_lines(buf, ref, where)
+  assert(#buf == #ref.lines, string.format("%s: %d lines, want %d", where, #buf, #ref.lines))
+  for i, line in ipairs(ref.lines) do
+    if buf[i] ~= line then error(string.format("%s: line %d is %q, want %q", where, i, buf[i], line)) end
+  end
+  assert(buf[0] == nil and buf[#buf + 1] == nil, where)
+end
+
+local pieces = { "", "x", "\n", "ab\ncd", "\n\n\n", "\r", "\t", "é中", "end\n", string.rep("long ", 700), string.rep("l\n", 900) }
+
+local function random_position(ref)
+  local line = math.random(#ref.lines)
+  return line, math.random(#ref.lines[line])
+end
+
+-- Doc sanitizes and sorts positions before they reach the buffer
+local function random_range(ref)
+  local l1, c1 = random_position(ref)
+  local l2, c2
+  if math.random(4) == 1 then
+    l2, c2 = random_position(ref)
+  else
+    l2, c2 = ref:position_offset(l1, c1, math.random(0, 60))
+  end
+  if l1 > l2 or l1 == l2 and c1 > c2 then l1, c1, l2, c2 = l2, c2, l1, c1 end
+  return l1, c1, l2, c2
+end
+
+local function edit(buf, ref, ops, where)
+  for n = 1, ops do
+    local op = math.random(3)
+    if op == 1 then
+      local line, col = random_position(ref)
+      local text = pieces[math.random(#pieces)]
+      local l2, c2 = buf:insert(line, col, text)
+      local rl2, rc2 = ref:insert(line, col, text)
+      assert(l2 == rl2 and c2 == rc2, string.format("%s: insert at %d:%d returned %d:%d, want %d:%d", where, line, col, l2, c2, rl2, rc2))
+    elseif op == 2 then
+      local l1, c1, l2, c2 = random_range(ref)
+      buf:remove(l1, c1, l2, c2)
+      ref:remove(l1, c1, l2, c2)
+    else
+      local l1, c1, l2, c2 = random_range(ref)
+      assert(buf:get_text(l1, c1, l2, c2) == ref:get_text(l1, c1, l2, c2), where .. ": get_text")
+    end
+    if n % 64 == 0 or #ref.lines < 100 then check_lines(buf, ref, where .. " after " .. n .. " edits") end
+  end
+  check_lines(buf, ref, where .. " after editing")
+end
+
+local function check_text(name, text, ops)
+  write(tmp, text)
+  local ref = Lines.load(tmp)
+  local buf, crlf = buffer.new(text)
+  assert(crlf == ref.crlf, name .. ": crlf")
+  check_lines(buf, ref, name)
+  local loaded, crlf2, large = buffer.load(tmp)
+  assert(crlf2 == ref.crlf and not large, name .. ": load")
+  check_lines(loaded, ref, name .. " loaded")
+
+  edit(buf, ref, ops, name)
+  for _, save_crlf in ipairs({ false, true }) do
+    assert(buf:save(tmp, save_crlf))
+    local got = read(tmp)
+    ref:save(tmp, save_crlf)
+    assert(got == read(tmp), name .. ": saved file differs")
+  end
+end
+
+math.randomseed(20)
+-- line ends: lone \r stays in the line, \r\n and a last \r end it, a missing last \n is added
+local texts = {
+  { "empty", "" }, { "newline", "\n" }, { "one line", "a" }, { "crlf", "a\r\nb\r\n" }, { "cr", "a\rb\r" },
+  { "lone cr", "\r" }, { "cr cr lf", "x\r\r\n\r\n" }, { "mixed", "a\nb\r\nc\rd\n\n\re" }, { "empty lines", string.rep("\n", 5000) },
+  { "long line", string.rep("0123456789", 3000) .. "\nshort\n" .. string.rep("x", 2049) },
+  { "crlf lines", string.rep("some text\r\n", 3000) },
+}
+for _, t in ipairs(texts) do check_text(t[1], t[2], 2000) end
+for _, filename in ipairs(files) do check_text(filename, read(filename), 500) end
+print(string.format("buffer: ok, %d texts, %d files", #texts, #files))
+)lua";
+
+int main() {
+    std::vector<std::string> files = {"lite.cpp", "lite.h", "README.md", "xmake.lua"};
+    for (auto &e : std::filesystem::recursive_directory_iterator("lite/data/core")) {
+        if (e.is_regular_file() && e.path().extension() == ".lua") files.push_back(e.path().generic_string());
+    }
+    std::sort(files.begin(), files.end());
+    std::string tmp = (std::filesystem::temp_directory_path() / "lite_test_buffer.txt").string();
+
+    lua_State *L = test_lua();
+    CHECK(luaL_loadstring(L, compare_lua) == LUA_OK);
+    lua_createtable(L, (int)files.size(), 0);
+    for (size_t i = 0; i < files.size(); i++) {
+        lua_pushstring(L, files[i].c_str());
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    lua_pushstring(L, tmp.c_str());
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+        fprintf(stderr, "lua: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_close(L);
+    std::filesystem::remove(tmp);
+    return 0;
+}
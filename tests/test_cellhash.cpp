@@ -0,0 +1,237 @@
+// rencache cell hashes: a long generated command stream, with every cell checked against
+// what it holds. a cell may only keep its hash when its commands are unchanged, may only
+// change it when they changed, and must invalidate exactly where the 32bit fnv-1a hash of
+// the command bytes used before did (wherever that one did not collide itself)
+
+#include <map>
+#include <random>
+#include <unordered_set>
+
+#include "test.h"
+
+#define W 640
+#define H 480
+
+enum { OP_CLIP, OP_RECT, OP_TEXT };
+
+typedef struct {
+    int type;
+    RenRect rect;
+    RenColor color;
+    RenFont *font;
+    std::string text;
+} Op;
+
+static bool same_op(const Op &a, const Op &b) {
+    return a.type == b.type && !memcmp(&a.rect, &b.rect, sizeof(RenRect)) && !memcmp(&a.color, &b.color, sizeof(RenColor)) && a.font == b.font && a.text == b.text;
+}
+
+// the old hash: fnv-1a over the command's fields, then over each command hash folded into the cell
+static void fnv32(uint32_t *h, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (size--) *h = (*h ^ *p++) * 16777619u;
+}
+
+static uint32_t fnv32_op(const Op &op) {
+    uint32_t h = 2166136261u;
+    int tab = op.font ? ren_get_font_tab_width(op.font) : 0;
+    fnv32(&h, &op.type, sizeof(op.type));
+    fnv32(&h, &op.rect, sizeof(op.rect));
+    fnv32(&h, &op.color, sizeof(op.color));
+    fnv32(&h, &op.font, sizeof(op.font));
+    fnv32(&h, &tab, sizeof(tab));
+    fnv32(&h, op.text.data(), op.text.size());
+    return h;
+}
+
+// a strong fingerprint of what a cell holds, independent of the hash under test
+static uint64_t fingerprint(const std::vector<Op> &ops) {
+    std::string s;
+    for (const Op &op : ops) {
+        s.append((const char *)&op.type, sizeof(op.type)).append((const char *)&op.rect, sizeof(op.rect)).append((const char *)&op.color, sizeof(op.color));
+        s.append((const char *)&op.font, sizeof(op.font)).append(op.text).push_back('\0');
+    }
+    return std::hash<std::string>()(s) ^ s.size() * 0x9e3779b97f4a7c15ull;
+}
+
+typedef struct {
+    std::vector<std::vector<Op>> ops;  // per cell, in drawing order
+    std::vector<uint32_t> fnv;
+} Model;
+
+// the cells end_frame lets each op touch: its bounds clipped to the current clip rect
+static void build_model(const std::vector<Op> &frame, Model *m) {
+    int cs = rcache->cell_size, cx = rcache->cells_x, cy = rcache->cells_y;
+    m->ops.assign((size_t)cx * cy, {});
+    m->fnv.assign((size_t)cx * cy, 2166136261u);
+    RenRect screen = {0, 0, W, H}, cr = screen;
+    for (Op op : frame) {
+        RenRect r;
+        if (op.type == OP_CLIP) {
+            // set_clip_rect keeps the on screen part only, and no color
+            r = cr = op.rect = intersect_rects(op.rect, screen);
+            op.color = RenColor{0, 0, 0, 0};
+        } else if (op.type == OP_RECT) {
+            if (!rects_overlap(screen, op.rect)) continue;
+            r = intersect_rects(op.rect, cr);
+        } else {
+            RenRect ink = ren_get_text_run_ink(ren_get_text_run(op.font, op.text.c_str()), op.rect.x, op.rect.y);
+            if (!rects_overlap(screen, ink)) continue;
+            r = intersect_rects(ink, cr);
+        }
+        if (r.width == 0 || r.height == 0) continue;
+        uint32_t h = fnv32_op(op);
+        for (int y = std::max(r.y / cs, 0); y <= std::min((r.y + r.height) / cs, cy - 1); y++) {
+            for (int x = std::max(r.x / cs, 0); x <= std::min((r.x + r.width) / cs, cx - 1); x++) {
+                m->ops[y * cx + x].push_back(op);
+                fnv32(&m->fnv[y * cx + x], &h, sizeof(h));
+            }
+        }
+    }
+}
+
+static void draw_frame(const std::vector<Op> &frame) {
+    rencache_begin_frame();
+    for (const Op &op : frame) {
+        if (op.type == OP_CLIP) {
+            rencache_set_clip_rect(op.rect);
+        } else if (op.type == OP_RECT) {
+            rencache_draw_rect(op.rect, op.color);
+        } else {
+            rencache_draw_text(op.font, op.text.c_str(), op.rect.x, op.rect.y, op.color);
+        }
+    }
+    rencache_end_frame();
+}
+
+static std::mt19937 rng(12);
+
+static Op random_op(RenFont **fonts) {
+    static const char *words[] = {"local", "end", "x", "self.doc", "-- comment", "\t", "fjord", "\xc3\x85", "12", "()", " "};
+    Op op = {};
+    int kind = rng() % 10;
+    op.type = kind == 0 ? OP_CLIP : kind < 4 ? OP_RECT : OP_TEXT;
+    op.rect = RenRect{(int)(rng() % (W + 40)) - 20, (int)(rng() % (H + 40)) - 20, 1 + (int)(rng() % 60), 1 + (int)(rng() % 40)};
+    // few distinct colors so that ops differing in one field only are common
+    op.color = RenColor{(uint8_t)(rng() % 3 * 100), 50, (uint8_t)(rng() % 2 * 200), (uint8_t)(rng() % 4 ? 255 : 128)};
+    if (op.type == OP_CLIP) {
+        op.rect.width += 200, op.rect.height += 200;
+        op.color = RenColor{0, 0, 0, 0};
+    } else if (op.type == OP_TEXT) {
+        op.font = fonts[rng() % 2];
+        op.text = words[rng() % (sizeof(words) / sizeof(*words))];
+        if (rng() % 3 == 0) op.text += words[rng() % (sizeof(words) / sizeof(*words))];
+        op.rect.width = op.rect.height = 0;
+    }
+    return op;
+}
+
+// edits that look alike to a weak hash: one pixel, one color step, two ops swapped
+static void edit_frame(std::vector<Op> &frame, RenFont **fonts) {
+    int edits = rng() % 4;
+    for (int e = 0; e < edits && frame.size() > 2; e++) {
+        size_t i = 1 + rng() % (frame.size() - 1);
+        switch (rng() % 6) {
+        case 0: frame.insert(frame.begin() + i, random_op(fonts)); break;
+        case 1: frame.erase(frame.begin() + i); break;
+        case 2: frame[i].rect.x += rng() % 2 ? 1 : -1; break;
+        case 3: frame[i].rect.y += rng() % 2 ? 1 : -1; break;
+        case 4: frame[i].color.r ^= 1; break;
+        case 5: std::swap(frame[i], frame[1 + rng() % (frame.size() - 1)]); break;
+        }
+    }
+}
+
+// the per command hash end_frame folds into a cell, for a million commands that differ
+// in one or two fields: all distinct, and two commands folded in either order differ
+static void test_command_hashes(RenFont *font) {
+    std::unordered_set<uint64_t> hashes;
+    Command cmd;
+    int count = 0;
+    for (int y = 0; y < 100; y++) {
+        for (int x = 0; x < 100; x++) {
+            for (int w = 1; w <= 10; w++) {
+                for (int c = 0; c < 10; c++) {
+                    memset(&cmd, 0, sizeof(cmd));
+                    cmd.type = DRAW_RECT;
+                    cmd.rect = RenRect{x, y, w, 1 + c / 2};
+                    cmd.color = RenColor{(uint8_t)(c % 2), 0, 0, 255};
+                    seal_command(&cmd);
+                    hashes.insert(hash_pair(cmd.hash, cmd.rect.y, cmd.rect.height));
+                    count++;
+                }
+            }
+        }
+    }
+    static const char *texts[] = {"a", "b", "ab", "ba", "local", "locaI", "\t", " ", "  "};
+    for (const char *text : texts) {
+        for (int x = 0; x < 100; x++) {
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.type = DRAW_TEXT;
+            cmd.run = ren_get_text_run(font, text);
+            cmd.rect = RenRect{x, 0, ren_get_text_run_width(cmd.run), ren_get_font_height(font)};
+            cmd.tab_width = cmd.run->tab_width;
+            cmd.color = RenColor{255, 255, 255, 255};
+            seal_command(&cmd);
+            hashes.insert(hash_pair(cmd.hash, cmd.rect.y, cmd.rect.height));
+            count++;
+        }
+    }
+    CHECK((int)hashes.size() == count);
+    uint64_t a = hash_word(HASH_INITIAL, 1), b = hash_word(HASH_INITIAL, 2);
+    CHECK(hash_word(a, 2) != hash_word(b, 1));
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 20000;
+    lt_context *ctx = test_context(W, H);
+    RenFont *fonts[2] = {ren_load_font(TEST_FONT, 14), ren_load_font(TEST_MONO_FONT, 15)};
+    CHECK(fonts[0] && fonts[1]);
+    ren_set_font_tab_width(fonts[1], 4 * ren_get_font_width(fonts[1], " "));
+    test_command_hashes(fonts[0]);
+
+    std::vector<Op> frame = {Op{OP_CLIP, RenRect{0, 0, W, H}}};
+    for (int i = 0; i < 200; i++) frame.push_back(random_op(fonts));
+    Model prev, cur;
+    std::vector<uint64_t> prev_cells;
+    std::map<uint64_t, uint64_t> seen;  // cell hash -> fingerprint of the cell it was seen for
+    int64_t cells_checked = 0, cells_changed = 0, fnv_collisions = 0;
+
+    for (int f = 0; f < frames; f++) {
+        edit_frame(frame, fonts);
+        if (frame.size() > 260) frame.erase(frame.begin() + 1, frame.begin() + 40);
+        draw_frame(frame);
+        build_model(frame, &cur);
+        // end_frame swapped the buffers: cells_prev holds the hashes of this frame
+        std::vector<uint64_t> cells(rcache->cells_prev, rcache->cells_prev + cur.ops.size());
+        for (size_t i = 0; f > 0 && i < cells.size(); i++) {
+            bool changed = cur.ops[i].size() != prev.ops[i].size();
+            for (size_t k = 0; !changed && k < cur.ops[i].size(); k++) changed = !same_op(cur.ops[i][k], prev.ops[i][k]);
+            if ((cells[i] != prev_cells[i]) != changed) {
+                fprintf(stderr, "frame %d cell %zu: changed %d, ops %zu -> %zu\n", f, i, changed, prev.ops[i].size(), cur.ops[i].size());
+                for (const Op &o : prev.ops[i]) fprintf(stderr, "  prev %d %d %d %d %d '%s'\n", o.type, o.rect.x, o.rect.y, o.rect.width, o.rect.height, o.text.c_str());
+                for (const Op &o : cur.ops[i]) fprintf(stderr, "  cur  %d %d %d %d %d '%s'\n", o.type, o.rect.x, o.rect.y, o.rect.width, o.rect.height, o.text.c_str());
+            }
+            CHECK((cells[i] != prev_cells[i]) == changed);
+            if (changed && cur.fnv[i] == prev.fnv[i]) {
+                fnv_collisions++;  // the old hash would have missed this one
+            } else {
+                CHECK((cells[i] != prev_cells[i]) == (cur.fnv[i] != prev.fnv[i]));
+            }
+            cells_changed += changed;
+        }
+        for (size_t i = 0; i < cells.size(); i++) {
+            uint64_t fp = fingerprint(cur.ops[i]);
+            auto it = seen.emplace(cells[i], fp).first;
+            CHECK(it->second == fp);  // one hash, two different cells
+        }
+        cells_checked += cells.size();
+        prev_cells = cells;
+        std::swap(prev, cur);
+    }
+    printf("cellhash: ok, %lld cells, %lld changed, %zu distinct, %lld fnv collisions\n", (long long)cells_checked, (long long)cells_changed, seen.size(), (long long)fnv_collisions);
+
+    for (RenFont *font : fonts) ren_free_font(font);
+    test_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,94 @@
+// fonts: faces shared between sizes, sizes shared between handles, the prewarm worker
+
+#include "test.h"
+
+static void wait_prewarm() {
+    std::unique_lock<std::mutex> lock(prewarm_worker.mutex);
+    prewarm_worker.idle.wait(lock, [] { return !prewarm_worker.running && prewarm_worker.queue.empty(); });
+}
+
+// handles of one size share its glyphs and text runs, not their tab width
+static void test_handles() {
+    RenFont *a = ren_load_font(TEST_FONT, 17), *b = ren_load_font(TEST_FONT, 17);
+    CHECK(a && b && a != b && a->shared == b->shared);
+    int tab = ren_get_font_tab_width(b);
+    ren_set_font_tab_width(a, tab + 100);
+    CHECK(ren_get_font_tab_width(b) == tab);
+    CHECK(ren_get_font_width(a, "\t") == tab + 100 && ren_get_font_width(b, "\t") == tab);
+    TextRun *ra = ren_get_text_run(a, "x\ty"), *rb = ren_get_text_run(b, "x\ty");
+    CHECK(ra != rb && ren_get_text_run_width(ra) - ren_get_text_run_width(rb) == 100);
+    ren_set_font_tab_width(b, tab + 100);
+    CHECK(ren_get_text_run(b, "x\ty") == ra);
+    ren_free_font(a);
+    CHECK(b->shared->refs == 1);
+    ren_free_font(b);
+
+    // the same through lua, as plugins/scale.lua and the docview use it
+    lua_State *L = test_lua();
+    test_lua_run(L,
+                 "local a = renderer.font.load('" TEST_FONT "', 17)\n"
+                 "local b = renderer.font.load('" TEST_FONT "', 17)\n"
+                 "local tab = b:get_width('\\t')\n"
+                 "a:set_tab_width(tab * 2 + 1)\n"
+                 "assert(a:get_width('\\t') == tab * 2 + 1)\n"
+                 "assert(b:get_width('\\t') == tab)\n");
+    lua_close(L);
+}
+
+// the staged bitmaps are exactly what rasterizing on first draw would give
+static void test_prewarm_bitmaps() {
+    RenFont *font = ren_load_font(TEST_FONT, 21);
+    CHECK(font);
+    wait_prewarm();
+    GlyphPrewarm *pw = font->shared->prewarm;
+    int staged = 0;
+    for (int cp = 32; cp < 256; cp++) {
+        if (pw->state[cp] != PREWARM_READY) continue;
+        const Glyph *g = get_glyph(font->shared, cp);
+        std::vector<uint8_t> direct((size_t)g->w * g->h);
+        if (g->w > 0 && g->h > 0) stbtt_MakeGlyphBitmap(&font->shared->face->info, direct.data(), g->w, g->h, g->w, font->shared->scale, font->shared->scale, g->index);
+        CHECK(pw->bitmaps[cp].size() == direct.size() || g->w == 0);
+        CHECK(direct.empty() || !memcmp(direct.data(), pw->bitmaps[cp].data(), direct.size()));
+        staged++;
+    }
+    CHECK(staged > 0);
+    ren_free_font(font);
+}
+
+// sizes freed while the worker still rasterizes them
+static void test_prewarm_churn() {
+    for (int i = 0; i < 200; i++) {
+        RenFont *font = ren_load_font(TEST_FONT, 8 + i * 0.25f);
+        CHECK(font);
+        ren_draw_text(font, "zoom", 0, 0, RenColor{255, 255, 255, 255});
+        ren_free_font(font);
+    }
+    wait_prewarm();
+}
+
+// what lt_fini does: stop with jobs queued, then a new size starts the worker again
+static void test_prewarm_stop() {
+    RenFont *fonts[6];
+    for (int i = 0; i < 6; i++) fonts[i] = ren_load_font(TEST_MONO_FONT, 30 + i);
+    glyph_prewarm_stop();
+    CHECK(!prewarm_worker.thread.joinable() && prewarm_worker.queue.empty());
+    for (RenFont *font : fonts) ren_free_font(font);
+
+    RenFont *font = ren_load_font(TEST_MONO_FONT, 50);
+    wait_prewarm();
+    CHECK(font->shared->prewarm->state['a'] == PREWARM_READY);
+    ren_free_font(font);
+    glyph_prewarm_stop();
+}
+
+int main() {
+    lt_context *ctx = test_context(320, 240);
+    test_handles();
+    test_prewarm_bitmaps();
+    test_prewarm_churn();
+    test_prewarm_stop();
+    test_free_context(ctx);
+    CHECK(faces.empty());
+    printf("font: ok\n");
+    return 0;
+}
@@ -0,0 +1,283 @@
+// large-file mode: a mapped document against a plain string holding what it should contain,
+// while the line index is still partial, while the indexer thread runs, and across saves
+// over the mapped file; a crlf file against the small-file loader; and the autocomplete
+// plugin leaving a large document's lines alone
+
+#include <filesystem>
+#include <random>
+
+#include "test.h"
+
+static std::mt19937 rng(21);
+
+// a crlf file through lua, next to the same text in a small buffer: the small-file loader
+// drops the \r of every line end, the mapped buffer has to show its lines the same way
+static const char *crlf_lua = R"lua(
+local path, ref_path = ...
+local big, crlf, large = buffer.load(path, 1)
+assert(large and crlf)
+while not big:sync() do end
+local fp = assert(io.open(path, "rb"))
+local ref, ref_crlf = buffer.new(fp:read("a"))
+fp:close()
+assert(ref_crlf and #big == #ref)
+for i = 1, #ref do assert(big[i] == ref[i], i) end
+
+-- typing at the end of a line goes before its line end
+local l = 1
+while big[l]:find("\r") do l = l + 1 end
+local line = big[l]
+big:insert(l, #line, "new")
+ref:insert(l, #line, "new")
+assert(big[l] == line:sub(1, -2) .. "new\n")
+-- and a column past the end is the start of the next line, never between \r and \n
+big:insert(l, #big[l] + 1, "next")
+ref:insert(l, #ref[l] + 1, "next")
+assert(big[l + 1] == ref[l + 1] and big[l + 1]:sub(1, 4) == "next")
+
+local pieces = { "x", "\n", "ab\ncd", "\r", "x\r\ny", "\r\n", "\n\n" }
+math.randomseed(21)
+for n = 1, 3000 do
+  local l = math.random(#ref)
+  local c = math.random(#ref[l])
+  if math.random(2) == 1 then
+    local text = pieces[math.random(#pieces)]
+    local l2, c2 = big:insert(l, c, text)
+    local rl2, rc2 = ref:insert(l, c, text)
+    assert(l2 == rl2 and c2 == rc2, n)
+  else
+    local l2 = math.min(l + math.random(0, 2), #ref)
+    local c2 = l2 == l and math.random(c, #ref[l]) or math.random(#ref[l2])
+    assert(big:get_text(l, c, l2, c2) == ref:get_text(l, c, l2, c2), n)
+    big:remove(l, c, l2, c2)
+    ref:remove(l, c, l2, c2)
+  end
+  assert(#big == #ref, n)
+  for i = math.max(l - 1, 1), math.min(l + 3, #ref) do assert(big[i] == ref[i], n) end
+end
+for i = 1, #ref do assert(big[i] == ref[i], i) end
+assert(big:save(path, true) and ref:save(ref_path, true))
+return big
+)lua";
+
+// the autocomplete plugin's symbol thread, run against a large doc and a small one: it picks
+// up the small doc's symbols and never reads a line of the large one
+static const char *autocomplete_lua = R"lua(
+local big = ...
+package.path = "lite/data/?.lua;lite/data/?/init.lua;" .. package.path
+SCALE = 1
+local reads, change_id, thread = 0, 0, nil
+local lines = setmetatable({}, { __index = function(_, i) reads = reads + 1 return big[i] end, __len = function() return #big end })
+local large = { lines = lines, large = true, get_change_id = function() return change_id end }
+local small = { lines = buffer.new("local alpha = beta\n\n"), get_change_id = function() return change_id end }
+package.loaded["core"] = { docs = { large, small }, add_thread = function(fn) thread = coroutine.create(fn) end }
+for _, name in ipairs({ "core.common", "core.style", "core.doc.translate", "core.rootview", "core.docview" }) do
+  package.loaded[name] = {}
+end
+package.loaded["core.command"] = { add = function() end }
+package.loaded["core.keymap"] = { add = function() end }
+local autocomplete = require "plugins.autocomplete"
+
+-- a few thousand steps of the thread, with both docs changing now and then
+for i = 1, 5000 do
+  assert(coroutine.resume(thread))
+  if i % 100 == 0 then change_id = change_id + 1 end
+end
+local found = {}
+for _, item in ipairs(autocomplete.map["open-docs"].items) do found[item.text] = true end
+assert(found.alpha and found.beta and found["local"])
+assert(reads == 0, reads .. " lines of the large doc read")
+)lua";
+
+// lines of source and log like text, a line longer than a few map blocks, some lone \r,
+// and no \n at the end
+static std::string make_file(size_t size) {
+    static const char *words[] = {"local", "x", "=", "function", "end", "2024-01-01T00:00:00", "INFO", "\t", "\xe4\xb8\xad", "\r"};
+    std::string s;
+    bool long_line = false;
+    while (s.size() < size) {
+        if (!long_line && s.size() > size / 2) s.append(6 * BUF_MAP_BLOCK + 77, 'L'), long_line = true;
+        for (int w = 0, n = rng() % 16; w < n; w++) s.append(words[rng() % 10]).push_back(' ');
+        s.push_back('\n');
+    }
+    s += "last line";
+    return s;
+}
+
+static void write_file(const std::string &path, const std::string &s) {
+    FILE *fp = fopen(path.c_str(), "wb");
+    CHECK(fp && fwrite(s.data(), 1, s.size(), fp) == s.size());
+    fclose(fp);
+}
+
+static std::string read_file(const std::string &path) {
+    lt_filemap map;
+    CHECK(lt_mapfile(&map, path.c_str()));
+    std::string s(map.data, map.size);
+    lt_unmapfile(&map);
+    return s;
+}
+
+// the tree holds exactly s, and every line starts where it does in s
+static void check_buffer(TextBuffer *b, const std::string &s) {
+    std::string all;
+    buf_copy(b, b->root, 0, buf_size(b->root), all);
+    CHECK(all == s);
+    size_t lines = std::count(s.begin(), s.end(), '\n') + (!s.empty() && s.back() != '\n');
+    CHECK(buf_line_count(b) == lines);
+    size_t line = 1;
+    CHECK(buf_line_offset(b, 1) == 0);
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '\n') CHECK(buf_line_offset(b, ++line) == i + 1);
+    }
+    CHECK(buf_line_offset(b, lines + 1) == s.size());
+}
+
+// edits the way a doc does, never touching the last byte so the doc keeps ending in a line end
+static void random_edit(TextBuffer *b, std::string &s) {
+    static const char *texts[] = {"x", "\n", "inserted text\n", "\n\n", "a longer insertion without a line end ", "\xc3\xa9"};
+    size_t off = s.size() > 1 ? rng() % (s.size() - 1) : 0;
+    if (rng() % 2) {
+        std::string t = texts[rng() % 6];
+        if (rng() % 8 == 0) t = std::string(BUF_CHUNK_MAX + rng() % 5000, 'i') + "\n";
+        buf_insert(b, off, t.data(), t.size());
+        s.insert(off, t);
+    } else {
+        size_t n = std::min((size_t)(rng() % (rng() % 4 ? 40 : 40000)), s.size() - 1 - off);
+        buf_remove(b, off, n);
+        s.erase(off, n);
+    }
+}
+
+// takes what buf_absorb appended from the mapping into the model
+static void absorbed(TextBuffer *b, const char *map, size_t *from, std::string &s) {
+    s.append(map + *from, b->absorbed - *from);
+    *from = b->absorbed;
+}
+
+int main(int argc, char **argv) {
+    std::string path = (std::filesystem::temp_directory_path() / "lite_test_largefile.txt").string();
+    std::string file = make_file(argc > 1 ? atoi(argv[1]) << 20 : 6 << 20);
+    write_file(path, file);
+    size_t blocks = (file.size() + BUF_MAP_BLOCK - 1) / BUF_MAP_BLOCK;
+    CHECK(blocks > 4 * BUF_MAP_SYNC_BLOCKS);
+
+    lua_State *L = test_lua();
+    TextBuffer *b = buf_push_new(L);
+    lua_setglobal(L, "doc");
+
+    // the indexer is told to stop before it starts: the doc holds what open indexed by itself
+    b->cancel = true;
+    lt_filemap map;
+    CHECK(lt_mapfile(&map, path.c_str()));
+    buf_open_mapped(b, &map, path.c_str());
+    b->indexer.join();
+    CHECK(b->indexed == BUF_MAP_SYNC_BLOCKS && b->absorbed == file.rfind('\n', BUF_MAP_SYNC_BLOCKS * BUF_MAP_BLOCK - 1) + 1);
+    std::string doc = file.substr(0, b->absorbed);
+    size_t from = b->absorbed;
+    check_buffer(b, doc);
+    CHECK(!buf_absorb(b));
+
+    // edits on the part that is in, then the index advancing a few blocks at a time under them.
+    // a block inside the long line has no line end, absorbing it has to wait for the next one
+    const char *data = b->map.data;
+    bool stalled = false;
+    for (size_t i = BUF_MAP_SYNC_BLOCKS; i < blocks * 3 / 4;) {
+        for (int e = 0; e < 20; e++) random_edit(b, doc);
+        for (size_t end = std::min(i + 1 + rng() % 3, blocks); i < end; i++) {
+            b->block_nl[i] = (uint32_t)buf_count_nl(data + i * BUF_MAP_BLOCK, BUF_MAP_BLOCK);
+        }
+        size_t before = b->absorbed;
+        b->indexed = i;
+        CHECK(!buf_absorb(b));
+        stalled |= b->absorbed == before;
+        absorbed(b, data, &from, doc);
+        CHECK(b->absorbed == file.rfind('\n', i * BUF_MAP_BLOCK - 1) + 1);
+        check_buffer(b, doc);
+    }
+    CHECK(stalled);
+
+    // the rest on the indexer thread, polled like Doc's thread does, editing in between
+    b->cancel = false;
+    b->indexer = std::thread(buf_index_blocks, b, (size_t)b->indexed);
+    int polls = 0;
+    for (bool done = false; !done; polls++) {
+        done = buf_absorb(b);
+        absorbed(b, data, &from, doc);
+        if (done) doc += '\n';  // the whole file is in: its last line got a line end
+        random_edit(b, doc);
+    }
+    CHECK(!b->indexer.joinable() && from == file.size());
+    check_buffer(b, doc);
+
+    // saving over the mapped file: the doc then maps what it wrote, and keeps working
+    for (int round = 0; round < 3; round++) {
+        test_lua_run(L, ("assert(doc:save('" + path + "'))").c_str());
+        CHECK(read_file(path) == doc && !std::filesystem::exists(path + ".lite-save"));
+        CHECK(b->map.data && b->map.size == doc.size() && b->path == path);
+        size_t off = 0;
+        buf_each_node(b->root, [&](BufNode *t) {
+            CHECK(t->mapped && t->moff == off && t->text.empty());
+            off += t->len;
+        });
+        check_buffer(b, doc);
+        for (int e = 0; e < 200; e++) random_edit(b, doc);
+        check_buffer(b, doc);
+    }
+
+    // with crlf line ends the written file can't be mapped back, the doc takes its own copy.
+    // a line that already ends in \r\n is written as it is
+    buf_insert(b, 0, "a\r\n", 3);
+    doc.insert(0, "a\r\n");
+    test_lua_run(L, ("assert(doc:save('" + path + "', true))").c_str());
+    std::string crlf;
+    for (size_t i = 0; i < doc.size(); i++) doc[i] == '\n' && (i == 0 || doc[i - 1] != '\r') ? crlf += "\r\n" : crlf += doc[i];
+    CHECK(read_file(path) == crlf && !b->map.data);
+    check_buffer(b, doc);
+
+    // and through lua, the way Doc reads it: without the \r of a line end
+    std::string shown;
+    for (size_t i = 0; i < doc.size(); i++) {
+        if (doc[i] != '\r' || i + 1 == doc.size() || doc[i + 1] != '\n') shown += doc[i];
+    }
+    lua_pushlstring(L, shown.data(), shown.size());
+    lua_setglobal(L, "expected");
+    test_lua_run(L,
+                 "local n, pos = 0, 1\n"
+                 "for i = 1, #doc do\n"
+                 "  local line = doc[i]\n"
+                 "  assert(line == expected:sub(pos, pos + #line - 1), i)\n"
+                 "  pos, n = pos + #line, i\n"
+                 "end\n"
+                 "assert(pos == #expected + 1 and doc[n + 1] == nil)\n");
+
+    // a crlf file keeps its line ends through edits and saves, and is mapped back after saving
+    std::string crlf_file;
+    for (char c : make_file(2 << 20)) c == '\n' ? crlf_file += "\r\n" : crlf_file += c;
+    write_file(path, crlf_file);
+    std::string ref_path = path + ".ref";
+    CHECK(luaL_loadstring(L, crlf_lua) == LUA_OK);
+    lua_pushstring(L, path.c_str());
+    lua_pushstring(L, ref_path.c_str());
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+        fprintf(stderr, "lua: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    TextBuffer *big = buf_check(L, -1);
+    std::string saved = read_file(path);
+    CHECK(saved == read_file(ref_path) && saved.find("new\r\n") != std::string::npos);
+    CHECK(big->map.data && big->map.size == saved.size());
+    std::filesystem::remove(ref_path);
+
+    CHECK(luaL_loadstring(L, autocomplete_lua) == LUA_OK);
+    lua_insert(L, -2);
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        fprintf(stderr, "lua: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    lua_close(L);
+    std::filesystem::remove(path);
+    printf("largefile: ok, %zu blocks, %d polls while indexing\n", blocks, polls);
+    return 0;
+}
@@ -0,0 +1,126 @@
+// rencache: a frame drawn through its dirty rects must match the same frame drawn from scratch
+
+#include <random>
+
+#include "test.h"
+
+#define W 640
+#define H 480
+
+typedef struct {
+    RenFont *font;
+    std::string text;
+    int x, y;
+    RenColor color;
+} Item;
+
+typedef struct {
+    std::vector<Item> texts;
+    std::vector<std::pair<RenRect, RenColor>> rects;
+} Scene;
+
+static void draw_scene(const Scene &sc) {
+    rencache_begin_frame();
+    rencache_set_clip_rect(RenRect{0, 0, W, H});
+    rencache_draw_rect(RenRect{0, 0, W, H}, RenColor{30, 30, 30, 255});
+    for (const Item &it : sc.texts) rencache_draw_text(it.font, it.text.c_str(), it.x, it.y, it.color);
+    for (auto &r : sc.rects) rencache_draw_rect(r.first, r.second);
+    rencache_end_frame();
+}
+
+// draws sc over the previous frame, then again from scratch, and compares
+static void check_scene(const Scene &sc) {
+    lt_surface *s = lt_current->target;
+    draw_scene(sc);
+    std::vector<uint32_t> incremental((uint32_t *)s->pixels, (uint32_t *)s->pixels + W * H);
+    rencache_invalidate();
+    draw_scene(sc);
+    CHECK(!memcmp(incremental.data(), s->pixels, W * H * 4));
+}
+
+// every latin glyph stays inside the ink rect of a run made of it
+static void test_ink_bounds(RenFont *font) {
+    for (int cp = 32; cp < 256; cp++) {
+        const Glyph *g = get_glyph(font->shared, cp);
+        if (g->w <= 0 || g->h <= 0) continue;
+        char text[8];
+        strcpy(text, codepoint_to_utf8_(cp));
+        TextRun *run = ren_get_text_run(font, text);
+        RenRect ink = ren_get_text_run_ink(run, 0, 0);
+        CHECK(g->xoff >= ink.x && g->yoff >= ink.y);
+        CHECK(g->xoff + g->w <= ink.x + ink.width && g->yoff + g->h <= ink.y + ink.height);
+    }
+}
+
+// a glyph whose ink spills into the next cell, then a change in that cell only
+static void test_overhang(RenFont *font) {
+    int cell = rcache->cell_size;
+    int best[4] = {0}, cps[4] = {'A', 'A', 'A', 'A'};  // left, top, right, bottom
+    for (int cp = 33; cp < 256; cp++) {
+        const Glyph *g = get_glyph(font->shared, cp);
+        if (g->w <= 0 || g->h <= 0) continue;
+        int over[4] = {-g->xoff, -g->yoff, g->xoff + g->w - g->xadvance, g->yoff + g->h - font->shared->height};
+        for (int i = 0; i < 4; i++) {
+            if (over[i] > best[i]) best[i] = over[i], cps[i] = cp;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        char text[8];
+        strcpy(text, codepoint_to_utf8_(cps[i]));
+        const Glyph *g = get_glyph(font->shared, cps[i]);
+        int x = 4 * cell + 1, y = 4 * cell + 1;
+        if (i == 2) x = 6 * cell - 1 - g->xadvance;
+        if (i == 3) y = 6 * cell - 1 - font->shared->height;
+        RenRect near = {x + g->xoff + (i == 2 ? g->w - 1 : 0), y + g->yoff + (i == 3 ? g->h - 1 : 0), 1, 1};
+
+        Scene sc;
+        sc.texts.push_back(Item{font, text, x, y, RenColor{255, 255, 255, 255}});
+        check_scene(sc);
+        sc.rects.push_back({RenRect{near.x / cell * cell, near.y / cell * cell, 1, 1}, RenColor{200, 0, 0, 255}});
+        check_scene(sc);
+    }
+}
+
+// random edits over text of every kind
+static void test_random(RenFont **fonts, int font_count, int frames) {
+    static const char *words[] = {"fjord", "Wave", "jiffy", "\xc3\x85ngstr\xc3\xb6m", "gyp", "\t=", "local x = 1", "\xe4\xb8\xad\xe6\x96\x87", "ff", "//", "{}"};
+    std::mt19937 rng(1);
+    Scene sc;
+    for (int f = 0; f < frames; f++) {
+        int edits = 1 + rng() % 3;
+        for (int e = 0; e < edits; e++) {
+            int op = rng() % 4;
+            if (op == 0 || sc.texts.empty()) {
+                RenFont *font = fonts[rng() % font_count];
+                sc.texts.push_back(Item{font, words[rng() % (sizeof(words) / sizeof(*words))], (int)(rng() % W) - 20, (int)(rng() % H) - 20, RenColor{(uint8_t)rng(), (uint8_t)rng(), 200, 255}});
+            } else if (op == 1) {
+                sc.texts.erase(sc.texts.begin() + rng() % sc.texts.size());
+            } else if (op == 2) {
+                Item &it = sc.texts[rng() % sc.texts.size()];
+                it.x += (int)(rng() % 7) - 3;
+                it.y += (int)(rng() % 7) - 3;
+            } else {
+                sc.rects.push_back({RenRect{(int)(rng() % W), (int)(rng() % H), 1 + (int)(rng() % 4), 1 + (int)(rng() % 4)}, RenColor{(uint8_t)rng(), 0, 0, 255}});
+                if (sc.rects.size() > 8) sc.rects.erase(sc.rects.begin());
+            }
+        }
+        check_scene(sc);
+    }
+}
+
+int main(int argc, char **argv) {
+    lt_context *ctx = test_context(W, H);
+    RenFont *fonts[] = {ren_load_font(TEST_FONT, 14), ren_load_font(TEST_FONT, 41), ren_load_font(TEST_MONO_FONT, 15), ren_load_font(TEST_MONO_FONT, 33.5f)};
+    for (RenFont *font : fonts) {
+        CHECK(font);
+        ren_set_font_tab_width(font, 3 * ren_get_font_width(font, " "));
+        test_ink_bounds(font);
+        test_overhang(font);
+    }
+    test_random(fonts, 4, argc > 1 ? atoi(argv[1]) : 300);
+
+    for (RenFont *font : fonts) ren_free_font(font);
+    test_free_context(ctx);
+    printf("rencache: ok\n");
+    return 0;
+}
@@ -0,0 +1,81 @@
+// system.scan_dir: listing order and options, and a malformed ignore pattern raising its
+// error only after the directories being listed are closed again
+
+#include <filesystem>
+
+#include "test.h"
+
+static const char *scan_lua = R"lua(
+local root = ...
+local function names(list)
+  local t = {}
+  for _, e in ipairs(list) do t[#t + 1] = e.type:sub(1, 1) .. ":" .. e.filename end
+  return table.concat(t, " ")
+end
+local sep = PLATFORM == "Windows" and "\\" or "/"
+local function p(s) return (s:gsub("/", sep)) end
+local function expect(list, want) local got = names(list) assert(got == want, got) end
+
+expect(system.scan_dir(root), "d:sub d:zdir f:big.bin f:zzz.txt")
+expect(system.scan_dir(root, { ignore = "^z" }), "d:sub f:big.bin")
+expect(system.scan_dir(root, { ignore = { "^q", "^sub$" }, size_limit = 20000 }), "d:zdir f:zzz.txt")
+expect(system.scan_dir(root, { recursive = true, ignore = "%.bin$" }), p"d:sub d:sub/deep f:sub/deep/x f:sub/a.txt d:zdir f:zzz.txt")
+expect(system.scan_dir(root, { recursive = true, max_depth = 1 }), "d:sub d:zdir f:big.bin f:zzz.txt")
+local list, err = system.scan_dir(root .. "/missing")
+assert(list == nil and err)
+
+-- "a[" only fails once a name has an "a" to match: at the top, and only down in sub
+for _, case in ipairs({ { "[", {} }, { "a[", { recursive = true } }, { { "%.txt$", "%" }, {} } }) do
+  local opt = case[2]
+  opt.ignore = case[1]
+  for i = 1, 200 do
+    local ok, msg = pcall(system.scan_dir, root, opt)
+    assert(not ok and msg:find("bad ignore pattern", 1, true), msg)
+  end
+end
+-- a bad option is reported as one
+assert(not pcall(system.scan_dir, root, { ignore = { "x", {} } }))
+assert(not pcall(system.scan_dir, root, { max_files = "many" }))
+)lua";
+
+static void touch(const std::filesystem::path &path, size_t size) {
+    FILE *fp = fopen(path.string().c_str(), "wb");
+    CHECK(fp);
+    for (size_t i = 0; i < size; i++) fputc('x', fp);
+    fclose(fp);
+}
+
+static int open_fds() {
+#ifdef __linux__
+    auto it = std::filesystem::directory_iterator("/proc/self/fd");
+    return (int)std::distance(begin(it), end(it));
+#else
+    return 0;
+#endif
+}
+
+int main() {
+    std::filesystem::path root = std::filesystem::temp_directory_path() / "lite_test_scandir";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "sub" / "deep");
+    std::filesystem::create_directories(root / "zdir");
+    touch(root / "zzz.txt", 10);
+    touch(root / "big.bin", 50000);
+    touch(root / "sub" / "a.txt", 1);
+    touch(root / "sub" / "deep" / "x", 1);
+
+    lua_State *L = test_lua();
+    int fds = open_fds();
+    CHECK(luaL_loadstring(L, scan_lua) == LUA_OK);
+    lua_pushstring(L, root.string().c_str());
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        fprintf(stderr, "lua: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    // 600 raised errors, every one of them with directories open when the pattern failed
+    CHECK(open_fds() == fds);
+    lua_close(L);
+    std::filesystem::remove_all(root);
+    printf("scandir: ok\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+// the native tokenizer against the lua one it replaced (tests/tokenizer_ref.lua): the repo's
+// own sources with the syntax the editor picks for them and with every other bundled
+// syntax, then generated lines built from the pieces the patterns look for, and syntaxes
+// that are malformed
+
+#include <filesystem>
+
+#include "test.h"
+
+static const char *compare_lua = R"lua(
+local files = ...
+package.path = "lite/data/?.lua;lite/data/?/init.lua;" .. package.path
+package.loaded["core.style"] = {}  -- language_glsl requires it without using it, the real one loads fonts
+local syntax = require "core.syntax"
+local tokenizer = require "core.tokenizer"
+local reference = dofile("tests/tokenizer_ref.lua")
+local langs, names = {}, {}
+for _, name in ipairs({ "c", "cpp", "glsl", "lua", "md", "teal", "xml" }) do
+  require("languages.language_" .. name)
+  langs[#langs + 1] = syntax.items[#syntax.items]
+  names[syntax.items[#syntax.items]] = name
+end
+
+-- the native spans as { type, text, ... }, the shape the lua tokenizer returns
+local function expand(spans, text)
+  local t = {}
+  for _, type, s in tokenizer.each_token(spans, text) do
+    t[#t + 1] = type
+    t[#t + 1] = s
+  end
+  return t
+end
+
+local lines_checked = 0
+local function compare(syn, lines, where)
+  local state_ref, state = nil, nil
+  for i, line in ipairs(lines) do
+    local want
+    want, state_ref = reference.tokenize(syn, line, state_ref)
+    local spans
+    spans, state = tokenizer.tokenize(syn, line, state)
+    local got = expand(spans, line)
+    local same = #got == #want and state == state_ref
+    for k = 1, #want do same = same and got[k] == want[k] end
+    if not same then
+      local function show(t) local s = {} for k = 1, #t, 2 do s[#s + 1] = t[k] .. "=" .. string.format("%q", t[k + 1]) end return table.concat(s, " ") end
+      error(string.format("%s:%d %q\n  lua:    %s (state %s)\n  native: %s (state %s)", where, i, line, show(want), tostring(state_ref), show(got), tostring(state)))
+    end
+    lines_checked = lines_checked + 1
+  end
+end
+
+local function read_lines(filename)
+  local lines = {}
+  for line in io.lines(filename, "L") do lines[#lines + 1] = line end
+  return lines
+end
+
+-- every file with its own syntax and with each bundled one
+for _, filename in ipairs(files) do
+  local lines = read_lines(filename)
+  local own = syntax.get(filename, lines[1] or "")
+  compare(own, lines, filename)
+  for _, syn in ipairs(langs) do
+    if syn ~= own then compare(syn, lines, filename .. " as " .. names[syn]) end
+  end
+end
+
+-- the pieces the patterns are made of, run together: open strings and comments carried over
+-- lines, escapes before their end, symbols next to operators, numbers in odd shapes
+local pieces = { '"', "'", "\\", "\\\\", "[[", "]]", "--[[", "--", "/*", "*/", "//", "<!--", "-->", "<", ">", "</", "#include",
+  "#define", "0x1F", "-12.5e3", ".5", "1..2", "...", "::label::", "if", "then", "end", "local", "function", "int", "return",
+  "self", "f(", "t{", "s\"", "`", "```", "**", "__", "x", "_y2", " ", "  ", "\t", "=", "==", "~=", "+", "%", "é", "中", "\r" }
+math.randomseed(19)
+for _, syn in ipairs(langs) do
+  local lines = {}
+  for i = 1, 4000 do
+    local t = {}
+    for k = 1, math.random(0, 12) do t[k] = pieces[math.random(#pieces)] end
+    lines[i] = table.concat(t) .. "\n"
+  end
+  compare(syn, lines, "generated " .. names[syn])
+end
+-- and a syntax without patterns, which the lua tokenizer special cased
+compare({ patterns = {}, symbols = {} }, { "plain text\n", "" }, "plain")
+
+-- a malformed syntax from a plugin is an error naming what is wrong, raised before anything
+-- is built (run under a leak checker, this is where a longjmp past a destructor shows up)
+local malformed = {
+  { {}, "no patterns" },
+  { { patterns = { "x" } }, "pattern 1 is not a table" },
+  { { patterns = { { pattern = "x" } } }, "pattern 1: type is nil" },
+  { { patterns = { { type = "normal", pattern = "x" }, { type = "comment" } } }, "pattern 2: pattern is nil" },
+  { { patterns = { { type = "comment", pattern = { "/%*" } } } }, "pattern[2] is nil" },
+  { { patterns = { { type = "string", pattern = { "'", "'", {} } } } }, "pattern[3] is table" },
+  { { patterns = { { type = "normal", pattern = "x" } }, symbols = { x = true } }, "symbol 'x' is boolean" },
+}
+for _, case in ipairs(malformed) do
+  for i = 1, 200 do
+    local ok, err = pcall(tokenizer.tokenize, case[1], "x\n")
+    assert(not ok and err:find(case[2], 1, true), err)
+  end
+end
+compare(langs[1], { "int x;\n" }, "after malformed syntaxes")
+print(string.format("tokenizer: ok, %d lines", lines_checked))
+)lua";
+
+int main() {
+    std::vector<std::string> files = {"lite.cpp", "lite.h", "README.md", "xmake.lua"};
+    for (auto &e : std::filesystem::recursive_directory_iterator("lite/data")) {
+        std::string ext = e.path().extension().string();
+        if (e.is_regular_file() && (ext == ".lua" || ext == ".md" || ext == ".glsl" || ext == ".xml")) files.push_back(e.path().generic_string());
+    }
+    std::sort(files.begin(), files.end());
+
+    lua_State *L = test_lua();
+    CHECK(luaL_loadstring(L, compare_lua) == LUA_OK);
+    lua_createtable(L, (int)files.size(), 0);
+    for (size_t i = 0; i < files.size(); i++) {
+        lua_pushstring(L, files[i].c_str());
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        fprintf(stderr, "lua: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_close(L);
+    return 0;
+}
@@ -40,3 +40,28 @@ target("example")
 
     set_targetdir("./")
     set_rundir("./")
+
+-- every test and benchmark builds lite.cpp in, see tests/test.h
+-- xmake test, or xmake build -g bench && xmake run bench_rencache
+for _, file in ipairs(os.files("tests/test_*.cpp")) do
+    target(path.basename(file))
+        set_kind("binary")
+        set_default(false)
+        set_group("tests")
+        add_files(file)
+        add_packages("lua", "imgui", "stb", "glew")
+
+        set_rundir("./")
+        add_tests("default")
+end
+
+for _, file in ipairs(os.files("bench/bench_*.cpp")) do
+    target(path.basename(file))
+        set_kind("binary")
+        set_default(false)
+        set_group("bench")
+        add_files(file)
+        add_packages("lua", "imgui", "stb", "glew")
+
+        set_rundir("./")
+end